@@ -54,6 +54,13 @@ bool Avbl::SaveToFile(QList<TimelineTrail*> trails, WeightedAnimation::FigureTyp
         animElm.setAttribute("position", currentItem->beginIndex());
         animElm.setAttribute("mixIn", currentItem->mixIn());
         animElm.setAttribute("mixOut", currentItem->mixOut());
+        if(currentItem->isAdditive())
+        {
+          animElm.setAttribute("additive", "true");
+          animElm.setAttribute("additiveReference", currentItem->additiveReference());
+        }
+        if(currentItem->timeScale() != 1.0)
+          animElm.setAttribute("timeScale", currentItem->timeScale());
 
         QDomElement bvhElm = document.createElement("bvhData");
         QString bvhData;
@@ -66,21 +73,26 @@ bool Avbl::SaveToFile(QList<TimelineTrail*> trails, WeightedAnimation::FigureTyp
         bvhElm.appendChild(cData);
         animElm.appendChild(bvhElm);
 
+        //weights are kept by frames of the animation, not by time-line positions of the item
+        int animFrames = currentItem->getAnimation()->getNumberOfFrames();
         QDomElement fWeightsElm = document.createElement("frameWeights");
-        for(int i=0; i<currentItem->frames(); i++)
+        for(int i=0; i<animFrames; i++)
         {
           QDomElement fWeight = document.createElement("frame");
           fWeight.setAttribute("number", i);
-          fWeight.setAttribute("weight", currentItem->getWeight(i));
+          fWeight.setAttribute("weight", currentItem->getAnimation()->getFrameWeight(i));
+          int weightBeforeAdditive = currentItem->getAnimation()->weightBeforeAdditive(i);
+          if(weightBeforeAdditive >= 0)        //the weight revertAdditive() goes back to
+            fWeight.setAttribute("weightBeforeAdditive", weightBeforeAdditive);
           fWeightsElm.appendChild(fWeight);
         }
         animElm.appendChild(fWeightsElm);
 
         QDomElement bWeightsElm = document.createElement("boneWeights");
         BVHNode* posit = currentItem->getAnimation()->getNode(0);
-        createLimbWeightsElement(document, bWeightsElm, posit, currentItem->frames());
+        createLimbWeightsElement(document, bWeightsElm, posit, animFrames);
         BVHNode* root = currentItem->getAnimation()->getMotion();
-        createLimbWeightsElement(document, bWeightsElm, root, currentItem->frames());
+        createLimbWeightsElement(document, bWeightsElm, root, animFrames);
         animElm.appendChild(bWeightsElm);
 
         rootElm.appendChild(animElm);
@@ -157,6 +169,7 @@ QList<TrailItem*>* Avbl::LoadFromFile(QString fileName, WeightedAnimation::Figur
   }
 
   QDomNodeList items = avbl.elementsByTagName("animation");
+  QHash<QString, WeightedAnimation*> loadedClips;
   for(int i=0; i<items.size(); i++)
   {
     QDomElement itemElm = items.at(i).toElement();
@@ -165,10 +178,16 @@ QList<TrailItem*>* Avbl::LoadFromFile(QString fileName, WeightedAnimation::Figur
     QString bvh = cData.data();
     bvh = bvh.simplified();        //a hack for a very, very nasty bug (some kind of lazy eval for data() or what)
 
-    BVH* b = new BVH();
-    WeightedAnimation* wa = new WeightedAnimation(b, "");
-    wa->loadBVHFromString(bvh);
-    wa->setNumberOfFrames(b->lastLoadedNumberOfFrames);
+    //the same clip placed more times is parsed once, its items share the key frames
+    if(!loadedClips.contains(bvh))
+    {
+      BVH* b = new BVH();
+      WeightedAnimation* loaded = new WeightedAnimation(b, "");
+      loaded->loadBVHFromString(bvh);
+      loaded->setNumberOfFrames(b->lastLoadedNumberOfFrames);
+      loadedClips.insert(bvh, loaded);
+    }
+    WeightedAnimation* wa = new WeightedAnimation(new BVH(), loadedClips.value(bvh));
 
     QString name = itemElm.attribute("name", "--unknown--");
     int trailIndex = itemElm.attribute("trail", "-1").toInt();
@@ -176,10 +195,16 @@ QList<TrailItem*>* Avbl::LoadFromFile(QString fileName, WeightedAnimation::Figur
     int trailOrder = itemElm.attribute("trailOrder", "-1").toInt();
     int mixIn = itemElm.attribute("mixIn", "-1").toInt();
     int mixOut = itemElm.attribute("mixOut", "-1").toInt();
+    bool additive = itemElm.attribute("additive", "false") == "true";
+    int additiveReference = itemElm.attribute("additiveReference", "0").toInt();
+    double timeScale = itemElm.attribute("timeScale", "1").toDouble();
 
     TrailItem* tempItem = new TrailItem(wa, name, beginIndex, false);
     tempItem->setMixIn(mixIn);
     tempItem->setMixOut(mixOut);
+    wa->setAdditive(additive, additiveReference);
+    if(timeScale > 0.0)
+      wa->setTimeScale(timeScale);
 
 
     //TODO: frames/limbs weights
@@ -191,6 +216,9 @@ QList<TrailItem*>* Avbl::LoadFromFile(QString fileName, WeightedAnimation::Figur
       int index = fWeight.attribute("number", "-1").toInt();
       int weight = fWeight.attribute("weight", "-1").toInt();
       tempItem->getAnimation()->setFrameWeight(index, weight);
+      int weightBeforeAdditive = fWeight.attribute("weightBeforeAdditive", "-1").toInt();
+      if(weightBeforeAdditive >= 0)
+        tempItem->getAnimation()->setWeightBeforeAdditive(index, weightBeforeAdditive);
     }
 
     QDomElement boneWeightsElm = itemElm.elementsByTagName("boneWeights").at(0).toElement();
@@ -212,6 +240,7 @@ QList<TrailItem*>* Avbl::LoadFromFile(QString fileName, WeightedAnimation::Figur
     loadedItems[trailIndex][trailOrder] = tempItem;
   }
 
+  qDeleteAll(loadedClips);
   QList<TrailItem*>* result = linkLoadedItems(loadedItems, trailsCount);
   return result;
 }
@@ -0,0 +1,540 @@
+/*
+  Golden-output check and benchmark of Blender, run without the main window.
+*/
+
+#include "avbl.h"
+#include "blendcheck.h"
+#include "blender.h"
+#include "bvh.h"
+#include "sectionsweep.h"
+#include "settings.h"
+#include "trailitem.cpp"
+#include "weightedanimation.h"
+
+#include <QDir>
+#include <QFile>
+#include <QMap>
+#include <QStringList>
+#include <QTextStream>
+#include <QtAlgorithms>
+#include <QTime>
+#include <math.h>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#define BLEND_CHECK_TOLERANCE   0.01    //largest allowed difference of a channel (degrees or BVH units)
+#define SYNTHETIC_TRAILS        5       //trails of synthetic time-lines
+#define SYNTHETIC_KEY_STEP      8       //frames between key frames of synthetic animations
+#define SECTION_CHECK_SETS      2000    //random item sets whose blend sections are checked
+#define SECTION_CHECK_ITEMS     12      //most items in one of them
+
+
+/*! Peak resident memory of the process in kilobytes, -1 where unknown !*/
+static long peakMemory()
+{
+#ifdef Q_OS_UNIX
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) == 0)
+#ifdef Q_OS_MAC
+    return usage.ru_maxrss / 1024;            //bytes there
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+  return -1;
+}
+
+
+/*! Largest difference of a channel between two animations. -1 if they differ in length or skeleton. !*/
+static double difference(WeightedAnimation* anim1, WeightedAnimation* anim2)
+{
+  int frames = anim1->getNumberOfFrames();
+  if(frames != anim2->getNumberOfFrames())
+    return -1.0;
+
+  double result = 0.0;
+  QMap<QString, BVHNode*>* bones = anim1->bones();
+  foreach(QString name, bones->keys())
+  {
+    BVHNode* limb1 = bones->value(name);
+    BVHNode* limb2 = anim2->bones()->value(name);
+    if(limb2 == NULL)
+      return -1.0;
+    if(limb1->type == BVH_END)
+      continue;
+
+    for(int f=0; f<frames; f++)
+    {
+      double channels[6];
+      if(limb1->type == BVH_POS)
+      {
+        Position p1 = limb1->frameData(f).position();
+        Position p2 = limb2->frameData(f).position();
+        channels[0] = p1.x - p2.x;
+        channels[1] = p1.y - p2.y;
+        channels[2] = p1.z - p2.z;
+        channels[3] = channels[4] = channels[5] = 0.0;
+      }
+      else
+      {
+        Rotation r1 = limb1->frameData(f).rotation();
+        Rotation r2 = limb2->frameData(f).rotation();
+        channels[0] = channels[1] = channels[2] = 0.0;
+        channels[3] = r1.x - r2.x;
+        channels[4] = r1.y - r2.y;
+        channels[5] = r1.z - r2.z;
+      }
+
+      for(int c=0; c<6; c++)
+      {
+        double d = fabs(channels[c]);
+        if(c >= 3)
+          d = fabs(d - 360.0*floor(d/360.0 + 0.5));       //the same angle
+        if(d > result)
+          result = d;
+      }
+    }
+  }
+
+  return result;
+}
+
+
+/*! Pseudo-random number from 0 to @param bound - 1. The same on all platforms, unlike qrand(). !*/
+static int nextRandom(unsigned int& seed, int bound)
+{
+  seed = seed*1103515245 + 12345;
+  return (int)((seed >> 16) % (unsigned int)bound);
+}
+
+
+static bool beginsBefore(TrailItem* item1, TrailItem* item2)
+{
+  return item1->beginIndex() < item2->beginIndex();
+}
+
+
+/*! One line per blend section: its first and last position and ascending indices of items overlapping it !*/
+static QString sectionText(int start, int end, QList<int> indices)
+{
+  qSort(indices);
+  QStringList items;
+  foreach(int index, indices)
+    items << QString::number(index);
+  return QString("%1..%2: %3").arg(start).arg(end).arg(items.join(","));
+}
+
+
+/*! Sections of @param sortedItems found by SectionSweep, as Blender::blend() walks them !*/
+static QStringList sweepSections(QList<TrailItem*>& sortedItems, int lastFrameIndex)
+{
+  QStringList result;
+  int start;
+  int end;
+  QList<int> indices;
+  SectionSweep sweep(sortedItems, lastFrameIndex);
+  while(sweep.nextSection(start, end, indices))
+    result << sectionText(start, end, indices);
+  return result;
+}
+
+
+/*! Sections of @param sortedItems found the way Blender::blend() did before SectionSweep, by scanning
+    the items for the nearest begin or end on every section. Kept only to check the sweep against it. !*/
+static QStringList legacySections(QList<TrailItem*>& sortedItems, int lastFrameIndex)
+{
+  QStringList result;
+  int intervalStartPosition;
+  int intervalEndPosition = sortedItems.first()->beginIndex() - 1;
+  QList<int> itemsInInterval;
+
+  for(int i=0; i<sortedItems.size(); i++)
+  {
+    if(sortedItems.at(i)->beginIndex() > intervalEndPosition+1)
+      break;
+    itemsInInterval.append(i);
+  }
+
+  while(intervalEndPosition != lastFrameIndex)
+  {
+    if(result.size() > 4*sortedItems.size())          //it never got to the end
+    {
+      result << "(endless)";
+      break;
+    }
+    intervalStartPosition = intervalEndPosition+1;
+
+    for(int cur=0; cur<itemsInInterval.size(); cur++)
+    {
+      if(sortedItems[itemsInInterval[cur]]->endIndex() < intervalStartPosition)
+      {
+        itemsInInterval.removeAt(cur);
+        cur--;
+      }
+    }
+
+    for(int i=0; i<sortedItems.size(); i++)
+    {
+      if(sortedItems.at(i)->beginIndex() == intervalStartPosition && !itemsInInterval.contains(i))
+        itemsInInterval.append(i);
+      else if(sortedItems.at(i)->beginIndex() > intervalStartPosition)
+        break;
+    }
+
+    if(!itemsInInterval.isEmpty())
+    {
+      int minEndFramePos = 999999999;
+      for(int a=0; a<itemsInInterval.size(); a++)
+      {
+        if(sortedItems[itemsInInterval[a]]->endIndex() < minEndFramePos)
+          minEndFramePos = sortedItems[itemsInInterval[a]]->endIndex();
+      }
+
+      int nextIndex = itemsInInterval.last()+1;
+      while(nextIndex < sortedItems.size())
+      {
+        if(sortedItems[nextIndex]->beginIndex() > minEndFramePos)
+          break;
+        if(sortedItems[nextIndex]->endIndex() < minEndFramePos)
+        {
+          if(sortedItems[nextIndex]->beginIndex() > intervalStartPosition)
+          {
+            minEndFramePos = sortedItems[nextIndex]->beginIndex() - 1;
+            break;
+          }
+          nextIndex++;
+          continue;
+        }
+        minEndFramePos = sortedItems[nextIndex]->beginIndex() - 1;
+        break;
+      }
+      intervalEndPosition = minEndFramePos;
+    }
+    else                                      //gap until the first item after
+    {
+      int min = 999999999;
+      for(int i=0; i<sortedItems.size(); i++)
+      {
+        if(sortedItems[i]->beginIndex() > intervalStartPosition && sortedItems[i]->beginIndex() < min)
+          min = sortedItems[i]->beginIndex();
+      }
+      intervalEndPosition = min - 1;
+    }
+
+    result << sectionText(intervalStartPosition, intervalEndPosition, itemsInInterval);
+  }
+
+  return result;
+}
+
+
+BlendCheck::BlendCheck(const QString& checkDirectory)
+{
+  checkDir = checkDirectory;
+}
+
+
+int BlendCheck::run(bool record, QTextStream& out)
+{
+  //shadows must not be linked into trails and only compositions asking for it are time warped
+  Settings::Instance()->setDebug(false);
+  bool timeWarping = Settings::Instance()->timeWarping();
+
+  int failed = checkSections(out);
+
+  QList<Composition> all = compositions();
+  all << synthetic(10, 4000) << synthetic(50, 20000);
+
+  out << QString("%1 %2 %3 %4  %5").arg("composition", -22).arg("frames", 8).arg("time[ms]", 10)
+                                   .arg("peak[kB]", 12).arg("result") << endl;
+  for(int i=0; i<all.size(); i++)
+  {
+    Composition& composition = all[i];
+    if(composition.trails.isEmpty())
+    {
+      out << QString("%1 FAILED, can't load %2").arg(composition.name, -22)
+                                               .arg(QDir(checkDir).filePath(composition.name + ".avbl")) << endl;
+      failed++;
+      continue;
+    }
+
+    long memoryBefore = peakMemory();
+    QTime timer;
+    timer.start();
+    WeightedAnimation* result = blend(composition);
+    int elapsed = timer.elapsed();
+    long memory = peakMemory();
+
+    QString verdict = "measured";
+    if(composition.golden)
+    {
+      QString goldenFile = QDir(checkDir).filePath(composition.name + ".bvh");
+      if(record)
+      {
+        result->saveBVH(goldenFile);
+        verdict = "recorded";
+      }
+      else if(!QFile::exists(goldenFile))
+      {
+        verdict = "FAILED, no golden file " + goldenFile + " (record it with --record)";
+        failed++;
+      }
+      else
+      {
+        WeightedAnimation* golden = new WeightedAnimation(new BVH(), goldenFile);
+        double diff = difference(result, golden);
+        if(diff < 0.0)
+          verdict = "FAILED, different length or skeleton";
+        else if(diff > BLEND_CHECK_TOLERANCE)
+          verdict = "FAILED, differs by " + QString::number(diff);
+        else
+          verdict = "ok";
+        if(diff < 0.0 || diff > BLEND_CHECK_TOLERANCE)
+          failed++;
+        delete golden;
+      }
+    }
+
+    QString peak = memory < 0 ? QString("n/a") : QString("%1 (+%2)").arg(memory).arg(memory-memoryBefore);
+    out << QString("%1 %2 %3 %4  %5").arg(composition.name, -22).arg(result->getNumberOfFrames(), 8)
+                                     .arg(elapsed, 10).arg(peak, 12).arg(verdict) << endl;
+
+    delete result;
+    release(composition);
+  }
+
+  Settings::Instance()->setTimeWarping(timeWarping);
+  out << (failed==0 ? QString("All checks passed") : QString("%1 checks failed").arg(failed)) << endl;
+  return failed;
+}
+
+
+/*! Compares blend sections found by SectionSweep with those of the previous algorithm on random item sets
+    with gaps, touching and overlapping items, shadows and single items. Prints the first set that differs
+    and returns 1 if any did. !*/
+int BlendCheck::checkSections(QTextStream& out)
+{
+  //real items are views of animations long 1 to 20 frames, shadows need none
+  QList<WeightedAnimation*> animations;
+  for(int length=1; length<=20; length++)
+  {
+    WeightedAnimation* anim = new WeightedAnimation(new BVH(), "");
+    anim->setNumberOfFrames(length);
+    animations.append(anim);
+  }
+  ShadowPosture posture = { NULL, 0, NULL, 0, 100, 0, 0 };
+
+  unsigned int seed = 1;
+  int different = 0;
+  for(int set=0; set<SECTION_CHECK_SETS && different==0; set++)
+  {
+    int count = set%10==0 ? 1 : 2 + nextRandom(seed, SECTION_CHECK_ITEMS-1);
+    QList<TrailItem*> items;
+    int lastEnd = -1;
+    for(int i=0; i<count; i++)
+    {
+      int begin;
+      int placement = nextRandom(seed, 4);
+      if(i>0 && placement==0)
+        begin = lastEnd + 1;                                //touching the previous one
+      else if(i>0 && placement==1)
+        begin = lastEnd + 2 + nextRandom(seed, 10);         //after a gap
+      else
+        begin = nextRandom(seed, 60);
+
+      int length = 1 + nextRandom(seed, 20);
+      TrailItem* item;
+      if(nextRandom(seed, 3) == 0)
+        item = new TrailItem(posture, "shadow", begin, length);
+      else
+        item = new TrailItem(animations.at(length-1), "item", begin, false);
+      lastEnd = item->endIndex();
+      items.append(item);
+    }
+
+    qStableSort(items.begin(), items.end(), beginsBefore);
+    int lastFrameIndex = -999999999;
+    foreach(TrailItem* item, items)
+    {
+      if(item->endIndex() > lastFrameIndex)
+        lastFrameIndex = item->endIndex();
+    }
+
+    QStringList expected = legacySections(items, lastFrameIndex);
+    QStringList found = sweepSections(items, lastFrameIndex);
+    if(found != expected)
+    {
+      different++;
+      out << "Blend sections of set " << set << " differ. Items:" << endl;
+      for(int i=0; i<items.size(); i++)
+        out << "  " << i << " " << items.at(i)->name() << " " << items.at(i)->beginIndex() << ".."
+            << items.at(i)->endIndex() << endl;
+      out << "Previous algorithm:" << endl << "  " << expected.join("\n  ") << endl;
+      out << "SectionSweep:" << endl << "  " << found.join("\n  ") << endl;
+    }
+
+    qDeleteAll(items);
+  }
+
+  qDeleteAll(animations);
+  out << QString("%1 %2").arg("sections", -22).arg(different==0 ? QString("ok, %1 random item sets").arg(SECTION_CHECK_SETS)
+                                                                 : QString("FAILED")) << endl;
+  return different==0 ? 0 : 1;
+}
+
+
+/*! Loads trails of the composition from its AVBL file in the check directory. Trails stay empty
+    if it can't be loaded. !*/
+void BlendCheck::load(Composition& composition)
+{
+  QString file = QDir(checkDir).filePath(composition.name + ".avbl");
+  if(!QFile::exists(file))
+    return;
+
+  Avbl avbl;
+  WeightedAnimation::FigureType figure;
+  int fps;
+  bool loop;
+  QList<TrailItem*>* firstItems = avbl.LoadFromFile(file, &figure, &fps, &loop);
+  if(firstItems == NULL)
+    return;
+
+  composition.trails = *firstItems;
+  delete firstItems;
+  foreach(TrailItem* item, composition.trails)
+  {
+    for(; item != NULL; item = item->nextItem())
+      composition.animations.append(item->getAnimation());
+  }
+}
+
+
+/*! Animation of @param frames frames of all limbs swinging by sine waves. The same @param seed
+    gives the same animation. !*/
+WeightedAnimation* BlendCheck::synthesize(int frames, int seed)
+{
+  WeightedAnimation* anim = new WeightedAnimation(new BVH(), "");       //default posture
+  anim->setNumberOfFrames(frames);
+  for(int f=0; f<frames; f++)
+    anim->setFrameWeight(f, 50);
+
+  QList<BVHNode*> limbs = anim->bones()->values();
+  for(int l=0; l<limbs.size(); l++)
+  {
+    BVHNode* limb = limbs.at(l);
+    if(limb->type == BVH_END)
+      continue;
+
+    for(int f=0; f<frames; f+=SYNTHETIC_KEY_STEP)
+    {
+      double phase = 0.37*(l+seed) + 0.05*f;
+      if(limb->type == BVH_POS)
+        limb->addKeyframe(f, Position(0.02*f, 40.0 + 2.0*sin(phase), 5.0*sin(0.5*phase)), Rotation());
+      else
+        limb->addKeyframe(f, Position(), Rotation(20.0*sin(phase), 10.0*sin(1.3*phase), 15.0*cos(0.7*phase)));
+    }
+  }
+
+  return anim;
+}
+
+
+/** Puts @param anim at the end of given trail, beginning on time-line position @param begin */
+TrailItem* BlendCheck::place(Composition& composition, int trail, WeightedAnimation* anim, int begin)
+{
+  composition.animations.append(anim);
+  while(composition.trails.size() <= trail)
+    composition.trails.append(NULL);
+
+  TrailItem* item = new TrailItem(anim, QString("%1/%2").arg(composition.name).arg(composition.animations.size()),
+                                  begin, false);
+  TrailItem* last = composition.trails.at(trail);
+  if(last == NULL)
+  {
+    composition.trails[trail] = item;
+    return item;
+  }
+
+  while(last->nextItem() != NULL)
+    last = last->nextItem();
+  last->setNextItem(item);
+  item->setPreviousItem(last);
+  return item;
+}
+
+
+/*! Compositions covering special cases of Blender, each kept in an AVBL file of the check directory
+    and made of the clips in resources/data and resources/examples: a single item (only copied), overlapping items, a gap filled by holding the last posture, zero frame
+    and limb weights, mix zones on one trail and across trails, three overlapping trails, an additive item,
+    retimed items and time warped items. !*/
+QList<BlendCheck::Composition> BlendCheck::compositions()
+{
+  QList<Composition> result;
+  result << Composition("single") << Composition("overlap") << Composition("gap")
+         << Composition("zero-weights") << Composition("mix-zones") << Composition("three-trails")
+         << Composition("additive") << Composition("retimed") << Composition("time-warp", true);
+
+  for(int i=0; i<result.size(); i++)
+    load(result[i]);
+
+  return result;
+}
+
+
+/*! Time-line of @param clips synthetic animations on SYNTHETIC_TRAILS trails, about @param frames long.
+    Items of neighbour trails overlap, so most of the time-line is blended from several of them. !*/
+BlendCheck::Composition BlendCheck::synthetic(int clips, int frames)
+{
+  Composition composition(QString("synthetic-%1x%2").arg(clips).arg(frames), false, false);
+  int perTrail = (clips + SYNTHETIC_TRAILS-1) / SYNTHETIC_TRAILS;
+  int length = frames / perTrail;
+
+  for(int i=0; i<clips; i++)
+  {
+    int trail = i % SYNTHETIC_TRAILS;
+    int order = i / SYNTHETIC_TRAILS;
+    place(composition, trail, synthesize(length, i), order*length + trail*(length/SYNTHETIC_TRAILS));
+  }
+
+  return composition;
+}
+
+
+/** Blends the composition the way BlenderTimeline does in a background thread */
+WeightedAnimation* BlendCheck::blend(Composition& composition)
+{
+  Settings::Instance()->setTimeWarping(composition.timeWarping);
+
+  int count = composition.trails.size();
+  TrailItem** rails = new TrailItem*[count];
+  for(int i=0; i<count; i++)
+    rails[i] = composition.trails.at(i);
+
+  Blender blender;
+  QList<TrailItem*> items = blender.PrepareTrails(rails, count);
+  delete [] rails;
+  WeightedAnimation* result = blender.CreateResultingAnimation(items);
+  if(items.size() > 1)
+    blender.BlendRange(items, result, items.at(0)->beginIndex(), 999999999);
+
+  return result;
+}
+
+
+void BlendCheck::release(Composition& composition)
+{
+  foreach(TrailItem* item, composition.trails)
+  {
+    while(item != NULL)
+    {
+      TrailItem* next = item->nextItem();
+      delete item;
+      item = next;
+    }
+  }
+
+  qDeleteAll(composition.animations);
+  composition.trails.clear();
+  composition.animations.clear();
+}
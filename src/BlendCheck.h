@@ -0,0 +1,62 @@
+#ifndef BLENDCHECK_H
+#define BLENDCHECK_H
+
+#include <QList>
+#include <QString>
+
+class QTextStream;
+class TrailItem;
+class WeightedAnimation;
+
+
+/** Check of Blender without the main window, run as 'animik --blend-check [check directory] [--record]'.
+    It's a mode of the GUI program, not a separate target: main() creates the QApplication first, so it
+    needs whatever the program needs to start (a display on X11).
+    Blends reference compositions loaded from AVBL files of the check directory (resources/blendcheck in
+    the sources), compares each with the golden BVH file of the same name next to it and reports time and
+    peak memory of each blend. Allocations are not counted: Qt containers allocate by qMalloc(), past
+    any replaced operator new, so such a count would miss most of them. Blend sections found by
+    SectionSweep are compared with the previous algorithm on random item sets. Golden files are written
+    with --record on a build known to be good and committed with the compositions. Large synthetic
+    time-lines are only measured. */
+class BlendCheck
+{
+  public:
+    /** @param checkDirectory - where composition AVBL files and their golden BVH files are kept */
+    BlendCheck(const QString& checkDirectory);
+
+    /** Returns number of failed checks: compositions that differ from their golden files and blend
+        sections that differ from the previous algorithm */
+    int run(bool record, QTextStream& out);
+
+  private:
+    /** Time-line to be blended. Trails are lists of items linked as on BlenderTimeline. */
+    struct Composition
+    {
+      QString name;
+      QList<TrailItem*> trails;             //first item of each trail, empty if not loaded
+      QList<WeightedAnimation*> animations; //owned
+      bool timeWarping;
+      bool golden;                          //FALSE if only measured
+
+      Composition(const QString& compositionName="", bool warping=false, bool checked=true)
+      {
+        name = compositionName;
+        timeWarping = warping;
+        golden = checked;
+      }
+    };
+
+    QString checkDir;
+
+    int checkSections(QTextStream& out);
+    void load(Composition& composition);
+    WeightedAnimation* synthesize(int frames, int seed);
+    TrailItem* place(Composition& composition, int trail, WeightedAnimation* anim, int begin);
+    QList<Composition> compositions();
+    Composition synthetic(int clips, int frames);
+    WeightedAnimation* blend(Composition& composition);
+    void release(Composition& composition);
+};
+
+#endif // BLENDCHECK_H
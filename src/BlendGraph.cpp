@@ -0,0 +1,1165 @@
+/*
+  Graph of blend nodes with cached outputs. Blender renders the time-line through it.
+*/
+
+#include "blendgraph.h"
+#include "bvhnode.h"
+#include "iktree.h"
+#include "trailitem.cpp"
+#include "weightedanimation.h"
+
+#include <QFuture>
+#include <QThread>
+#include <QtConcurrentRun>
+#include <math.h>
+#define BLEND_MIN_FRAMES        16      //shortest block of frames given to one thread
+#define BLEND_WINDOW            256     //frames rendered at once, so caches don't grow with the time-line
+
+quint64 BlendNode::clock = 0;
+
+
+void PoseBlock::resize(int first, int count, int limbsCount)
+{
+  firstFrame = first;
+  frames = count;
+  limbs = limbsCount;
+  rotations.resize(count*limbsCount);
+  eulers.resize(count*limbsCount);
+  limbWeights.resize(count*limbsCount);
+  positions.resize(count);
+  previousPositions.resize(count);
+  positionWeights.resize(count);
+  frameWeights.resize(count);
+  moves.resize(count);
+  present.resize(count);
+  exact.resize(count);
+}
+
+
+/*! Normalized linear interpolation of two rotations, taking the shorter way !*/
+static inline MT_Quaternion nlerp(const MT_Quaternion& a, const MT_Quaternion& b, double t)
+{
+  double sign = a.dot(b) < 0.0 ? -1.0 : 1.0;
+  double q[4];
+  double length = 0.0;
+  for(int c=0; c<4; c++)
+  {
+    q[c] = (1.0-t)*a[c] + t*sign*b[c];
+    length += q[c]*q[c];
+  }
+
+  length = sqrt(length);
+  for(int c=0; c<4; c++)
+    q[c] /= length;
+  return MT_Quaternion(q);
+}
+
+
+/*! Rotation of limb @param limb in (fractional) frame @param frame from @param rotations
+    of @param frames frames and @param limbsCount limbs !*/
+static inline MT_Quaternion sampleRotation(const QVector<MT_Quaternion>& rotations, int frames, int limbsCount,
+                                           int limb, double frame)
+{
+  int first = (int)frame;
+  double t = frame - first;
+  const MT_Quaternion& q = rotations.at(first*limbsCount + limb);
+  if(t <= 0.0 || first+1 >= frames)
+    return q;
+  return nlerp(q, rotations.at((first+1)*limbsCount + limb), t);
+}
+
+
+/*! Part of additive @param delta, interpolated from identity. The delta is on the shorter way. !*/
+static inline MT_Quaternion partialDelta(const MT_Quaternion& delta, double amount)
+{
+  double q[4] = { amount*delta[0], amount*delta[1], amount*delta[2], 1.0-amount + amount*delta[3] };
+  double length = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+  for(int c=0; c<4; c++)
+    q[c] /= length;
+  return MT_Quaternion(q);
+}
+
+
+/*! Posture of one node of a shadow item, interpolation of the two frames it's made of. Positions are
+    interpolated linearly, rotations as quaternions (the shorter way) and returned in channel order
+    of @param targetLimb. Frame weights are not considered in interpolation. !*/
+static FrameData interpolateShadowFrame(const ShadowPosture& posture, int partIndex, const BVHNode* targetLimb)
+{
+  BVHNode* node1 = posture.anim1->getNode(partIndex);
+  FrameData data1 = node1->frameData(posture.frame1);
+  int w1 = posture.anim1->getFrameWeight(posture.frame1) * data1.weight();
+  BVHNode* node2 = posture.anim2->getNode(partIndex);
+  FrameData data2 = node2->frameData(posture.frame2);
+  int w2 = posture.anim2->getFrameWeight(posture.frame2) * data2.weight();
+
+  double t = (w1+w2 == 0) ? 0.5 : (double)w2 / (double)(w1+w2);
+
+  Position p1 = data1.position();
+  p1.Add(posture.anim1->getOffset());
+  p1.Multiply(1.0-t);
+  Position p2 = data2.position();
+  p2.Add(posture.anim2->getOffset());
+  p2.Multiply(t);
+  p1.Add(p2);
+
+  const MT_Quaternion q1 = IKTree::toQuaternion(node1, data1.rotation());
+  const MT_Quaternion q2 = IKTree::toQuaternion(node2, data2.rotation());
+  Rotation rotation;
+  IKTree::toEuler(nlerp(q1, q2, t), targetLimb->channelOrder, rotation.x, rotation.y, rotation.z);
+  return FrameData(0, p1, rotation);
+}
+
+
+BlendNode::BlendNode(const BlendSkeleton* skeleton)
+{
+  this->skeleton = skeleton;
+  modified = ++clock;
+  cacheVersion = 0;
+}
+
+void BlendNode::changed()
+{
+  modified = ++clock;
+}
+
+void BlendNode::release()
+{
+  if(cache.frames == 0)
+    return;
+  cache = PoseBlock();
+  cacheVersion = 0;
+}
+
+quint64 BlendNode::version() const
+{
+  quint64 result = modified;
+  foreach(BlendNode* input, inputs)
+    result = qMax(result, input->version());
+  return result;
+}
+
+const PoseBlock& BlendNode::evaluate(int from, int to)
+{
+  if(to < from)
+    to = from;
+
+  quint64 current = version();
+  if(cacheVersion == current && cache.covers(from, to))
+    return cache;
+
+  prepare(from, to);
+  int framesCount = to - from + 1;
+  cache.resize(from, framesCount, skeleton->limbs.size());
+
+  //short ranges aren't worth the threads
+  int numThreads = qBound(1, QThread::idealThreadCount(), (framesCount+BLEND_MIN_FRAMES-1) / BLEND_MIN_FRAMES);
+  int chunk = (framesCount+numThreads-1) / numThreads;
+
+  QList<QFuture<void> > workers;
+  for(int first=from+chunk; first<=to; first+=chunk)
+    workers.append(QtConcurrent::run(computeBlock, this, first, qMin(first+chunk-1, to)));
+  computeBlock(this, from, qMin(from+chunk-1, to));                 //first block on this thread
+  for(int i=0; i<workers.size(); i++)
+    workers[i].waitForFinished();
+
+  cacheVersion = current;
+  return cache;
+}
+
+void BlendNode::computeBlock(BlendNode* node, int first, int last)
+{
+  node->compute(first, last, node->cache);
+}
+
+
+ClipNode::ClipNode(WeightedAnimation* anim, const BlendSkeleton* skeleton) : BlendNode(skeleton)
+{
+  this->anim = anim;
+  framesCount = anim->getNumberOfFrames();
+  foreach(int partIndex, skeleton->partIndices)
+    nodes.append(anim->getNode(partIndex));
+}
+
+/** Shadow posture is the same in all its frames, it's evaluated just once */
+ClipNode::ClipNode(const ShadowPosture& posture, const QVector<int>& frameWeights, const BlendSkeleton* skeleton)
+  : BlendNode(skeleton)
+{
+  anim = NULL;
+  framesCount = frameWeights.size();
+  postureWeights = frameWeights;
+  posturePosition = interpolateShadowFrame(posture, 0, skeleton->position);
+  posturePosition.setWeight(0);                 //position always taken from 'master' blender
+  for(int l=0; l<skeleton->limbs.size(); l++)
+  {
+    postureLimbs.append(skeleton->limbs.at(l)->type==BVH_END ? FrameData()
+                                                             : interpolateShadowFrame(posture, skeleton->partIndices.at(l),
+                                                                                      skeleton->limbs.at(l)));
+  }
+}
+
+Position ClipNode::offset() const
+{
+  return anim==NULL ? Position(0.0, 0.0, 0.0) : anim->getOffset();
+}
+
+void ClipNode::compute(int first, int last, PoseBlock& out)
+{
+  int limbsCount = skeleton->limbs.size();
+  BVHNode* position = anim==NULL ? NULL : anim->getNode(0);
+  const MT_Quaternion identity(0.0, 0.0, 0.0, 1.0);
+
+  for(int frame=first; frame<=last; frame++)
+  {
+    int i = out.at(frame);
+    FrameData data = position ? position->frameData(frame) : posturePosition;
+    out.positions[i] = data.position();
+    out.positionWeights[i] = data.weight();
+    out.frameWeights[i] = anim ? anim->getFrameWeight(frame) : postureWeights.at(frame);
+    out.present[i] = true;
+    out.exact[i] = true;
+
+    for(int l=0; l<limbsCount; l++)
+    {
+      int index = out.at(frame, l);
+      BVHNode* limb = skeleton->limbs.at(l);
+      BVHNode* node = anim ? nodes.at(l) : NULL;
+      FrameData limbData = anim==NULL ? postureLimbs.at(l)
+                                      : (node ? node->frameData(frame) : FrameData());
+      out.eulers[index] = limbData.rotation();
+      out.limbWeights[index] = limbData.weight();
+      if(limb->type == BVH_END || (anim && node == NULL))
+        out.rotations[index] = identity;
+      else                                      //channel order of the data
+        out.rotations[index] = IKTree::toQuaternion(node ? node : limb, limbData.rotation());
+    }
+  }
+}
+
+
+TimeOffsetNode::TimeOffsetNode(ClipNode* clip, int offset, int length, double scale) : BlendNode(clip->getSkeleton())
+{
+  clipNode = clip;
+  inputs.append(clip);
+  begin = offset;
+  this->length = length;
+  timeScale = scale;
+  source = NULL;
+}
+
+void TimeOffsetNode::setPlacement(int offset, int length, double scale)
+{
+  if(offset == begin && length == this->length && scale == timeScale)
+    return;
+  begin = offset;
+  this->length = length;
+  timeScale = scale;
+  changed();
+}
+
+void TimeOffsetNode::setWarps(const QList<FrameWarp>& warps)
+{
+  if(warps == this->warps)
+    return;
+  this->warps = warps;
+  changed();
+}
+
+/** The same as TrailItem::animationPosition() */
+double TimeOffsetNode::clipPosition(int frame) const
+{
+  return qBound(0.0, (frame-begin) * timeScale, (double)(clipNode->frames()-1));
+}
+
+double TimeOffsetNode::clipPosition(int frame, const FrameWarp* warp) const
+{
+  if(warp != NULL)
+  {
+    int k = frame - warp->begin;
+    if(k >= 0 && k < warp->frames.size())
+      return warp->frames.at(k);
+  }
+  return clipPosition(frame);
+}
+
+const FrameWarp* TimeOffsetNode::warpAt(int frame) const
+{
+  for(int i=0; i<warps.size(); i++)
+  {
+    if(frame >= warps.at(i).first && frame <= warps.at(i).last)
+      return &warps.at(i);
+  }
+  return NULL;
+}
+
+void TimeOffsetNode::prepare(int from, int to)
+{
+  from = qMax(from, begin);
+  to = qMin(to, last());
+  source = NULL;
+  if(from > to)
+    return;
+
+  //frames of the clip all the positions need
+  int lastFrame = clipNode->frames()-1;
+  int first = from==begin ? 0 : lastFrame;
+  int last = 0;
+  for(int t=from; t<=to; t++)
+  {
+    const FrameWarp* warp = warpAt(t);
+    double positions[2] = { clipPosition(t, warp), t > begin ? clipPosition(t-1, warp) : -1.0 };
+    for(int p=0; p<2 && positions[p] >= 0.0; p++)
+    {
+      int frame = (int)positions[p];
+      first = qMin(first, frame);
+      last = qMax(last, qMin(frame+1, lastFrame));
+    }
+    int nearest = (int)(clipPosition(t) + 0.5);
+    first = qMin(first, nearest);
+    last = qMax(last, nearest);
+  }
+
+  source = &clipNode->evaluate(first, last);
+  if(from == begin)
+  {
+    int i = source->at(0);
+    startData = FrameData(0, source->positions.at(i), Rotation());
+    startData.setWeight(source->positionWeights.at(i));
+  }
+}
+
+/** Position in (fractional) frame of the clip, weight is the one of the earlier frame */
+void TimeOffsetNode::samplePosition(double position, Position& result, int* weight) const
+{
+  int first = (int)position;
+  double t = position - first;
+  const Position& p1 = source->positions.at(source->at(first));
+  if(weight != NULL)
+    *weight = source->positionWeights.at(source->at(first));
+  if(t <= 0.0)
+  {
+    result = p1;
+    return;
+  }
+
+  const Position& p2 = source->positions.at(source->at(first+1));
+  result = Position(p1.x + t*(p2.x-p1.x), p1.y + t*(p2.y-p1.y), p1.z + t*(p2.z-p1.z));
+}
+
+void TimeOffsetNode::compute(int first, int last, PoseBlock& out)
+{
+  int limbsCount = skeleton->limbs.size();
+  int frames = clipNode->frames();
+
+  for(int t=first; t<=last; t++)
+  {
+    int i = out.at(t);
+    out.present[i] = source!=NULL && isPresent(t);
+    out.exact[i] = out.present[i] && timeScale == 1.0;
+    if(!out.present[i])
+      continue;
+
+    const FrameWarp* warp = warpAt(t);
+    double position = clipPosition(t, warp);
+    int frame = (int)position;
+    double fraction = position - frame;
+    out.frameWeights[i] = source->frameWeights.at(source->at((int)(clipPosition(t) + 0.5)));
+    samplePosition(position, out.positions[i], &out.positionWeights[i]);
+    if(t > begin)
+      samplePosition(clipPosition(t-1, warp), out.previousPositions[i], NULL);
+
+    for(int l=0; l<limbsCount; l++)
+    {
+      int index = out.at(t, l);
+      int s = source->at(frame, l);
+      out.eulers[index] = source->eulers.at(s);
+      out.limbWeights[index] = source->limbWeights.at(s);
+      out.rotations[index] = (fraction <= 0.0 || frame+1 >= frames) ? source->rotations.at(s)
+                                                                   : nlerp(source->rotations.at(s),
+                                                                           source->rotations.at(s+limbsCount), fraction);
+    }
+  }
+}
+
+
+CrossfadeNode::CrossfadeNode(BlendNode* a, BlendNode* b, int begin, int length, const BlendSkeleton* skeleton)
+  : BlendNode(skeleton)
+{
+  inputs << a << b;
+  this->begin = begin;
+  this->length = qMax(0, length);
+}
+
+void CrossfadeNode::setFade(int begin, int length)
+{
+  this->begin = begin;
+  this->length = qMax(0, length);
+  changed();
+}
+
+void CrossfadeNode::prepare(int from, int to)
+{
+  a = &inputs.at(0)->evaluate(from, to);
+  b = &inputs.at(1)->evaluate(from, to);
+}
+
+void CrossfadeNode::compute(int first, int last, PoseBlock& out)
+{
+  for(int t=first; t<=last; t++)
+  {
+    int i = out.at(t);
+    bool presentA = a->present.at(a->at(t));
+    bool presentB = b->present.at(b->at(t));
+    double fade = (double)(t-begin+1) / (double)(length+1);
+    if(!presentB || (presentA && fade <= 0.0))
+      fade = 0.0;
+    else if(!presentA || fade >= 1.0)
+      fade = 1.0;
+
+    out.present[i] = presentA || presentB;
+    out.exact[i] = false;
+    const Position& moveA = a->moves.at(a->at(t));
+    const Position& moveB = b->moves.at(b->at(t));
+    out.moves[i] = Position(moveA.x + fade*(moveB.x-moveA.x), moveA.y + fade*(moveB.y-moveA.y),
+                            moveA.z + fade*(moveB.z-moveA.z));
+    for(int l=0; l<out.limbs; l++)
+      out.rotations[out.at(t, l)] = nlerp(a->rotations.at(a->at(t, l)), b->rotations.at(b->at(t, l)), fade);
+  }
+}
+
+
+LimbMaskNode::LimbMaskNode(BlendNode* a, BlendNode* b, const BlendSkeleton* skeleton) : BlendNode(skeleton)
+{
+  inputs << a << b;
+  limbWeights.fill(0.0, skeleton->limbs.size());
+}
+
+void LimbMaskNode::setLimbWeight(int limb, double weight)
+{
+  limbWeights[limb] = qBound(0.0, weight, 1.0);
+  changed();
+}
+
+void LimbMaskNode::prepare(int from, int to)
+{
+  a = &inputs.at(0)->evaluate(from, to);
+  b = &inputs.at(1)->evaluate(from, to);
+}
+
+void LimbMaskNode::compute(int first, int last, PoseBlock& out)
+{
+  double rootWeight = limbWeights.isEmpty() ? 0.0 : limbWeights.at(0);
+  for(int t=first; t<=last; t++)
+  {
+    int i = out.at(t);
+    out.present[i] = a->present.at(a->at(t)) || b->present.at(b->at(t));
+    out.exact[i] = false;
+    const Position& moveA = a->moves.at(a->at(t));
+    const Position& moveB = b->moves.at(b->at(t));
+    out.moves[i] = Position(moveA.x + rootWeight*(moveB.x-moveA.x), moveA.y + rootWeight*(moveB.y-moveA.y),
+                            moveA.z + rootWeight*(moveB.z-moveA.z));
+    for(int l=0; l<out.limbs; l++)
+      out.rotations[out.at(t, l)] = nlerp(a->rotations.at(a->at(t, l)), b->rotations.at(b->at(t, l)),
+                                          limbWeights.at(l));
+  }
+}
+
+
+WeightedSumNode::WeightedSumNode(const BlendSkeleton* skeleton) : BlendNode(skeleton)
+{
+  origin = 0;
+}
+
+void WeightedSumNode::setInputs(const QList<TimeOffsetNode*>& clips)
+{
+  if(clips == this->clips)
+    return;
+  this->clips = clips;
+  inputs.clear();
+  foreach(TimeOffsetNode* clip, clips)
+    inputs.append(clip);
+  changed();
+}
+
+void WeightedSumNode::setOrigin(int frame)
+{
+  if(frame == origin)
+    return;
+  origin = frame;
+  changed();
+}
+
+void WeightedSumNode::prepare(int from, int to)
+{
+  sources.fill(NULL, clips.size());
+  active.clear();
+  for(int c=0; c<clips.size(); c++)
+  {
+    TimeOffsetNode* clip = clips.at(c);
+    int first = qMax(from, clip->offset());
+    int last = qMin(to, clip->last());
+    if(first > last)
+      continue;
+    sources[c] = &clip->evaluate(first, last);
+    active.append(c);
+  }
+}
+
+void WeightedSumNode::compute(int first, int last, PoseBlock& out)
+{
+  int limbsCount = skeleton->limbs.size();
+  QVector<double> sum(limbsCount*4);
+  QVector<double> clearSum(limbsCount*4);        //just for the case all weights are 0
+  QVector<double> reference(limbsCount*4);
+  QVector<int> sumWeights(limbsCount);
+
+  for(int t=first; t<=last; t++)
+  {
+    int i = out.at(t);
+    int count = 0;
+    int single = -1;
+    for(int a=0; a<active.size(); a++)
+    {
+      int c = active.at(a);
+      if(clips.at(c)->isPresent(t))
+      {
+        count++;
+        single = c;
+      }
+    }
+
+    out.present[i] = count > 0;
+    out.exact[i] = false;
+    if(count == 0)
+      continue;
+
+    combineMove(t, out.moves[i]);
+    combineRotations(t, out, sum.data(), clearSum.data(), reference.data(), sumWeights.data());
+
+    const PoseBlock* source = sources.at(single);
+    if(count == 1 && source->exact.at(source->at(t)))          //nothing to blend with
+    {
+      out.exact[i] = true;
+      for(int l=0; l<limbsCount; l++)
+        out.eulers[out.at(t, l)] = source->eulers.at(source->at(t, l));
+    }
+  }
+}
+
+/*! Position pseudo-node of one frame. Only rises of X and Z since previous frame are evaluated, so frames
+    don't depend on each other. The rises are averaged as weighted vectors. !*/
+void WeightedSumNode::combineMove(int frame, Position& move) const
+{
+  move = Position(0.0, 0.0, 0.0);
+  int baseCount = 0;
+  for(int a=0; a<active.size(); a++)
+  {
+    int c = active.at(a);
+    if(clips.at(c)->isPresent(frame))
+      baseCount++;
+  }
+
+  if(frame == origin)         //very beginning of overal blend
+  {
+    Position sumPos(0.0, 0.0, 0.0);
+    int sumWeights = 0;
+
+    for(int a=0; a<active.size(); a++)
+    {
+      int c = active.at(a);
+      const PoseBlock* source = sources.at(c);
+      if(!clips.at(c)->isPresent(frame))
+        continue;
+      const FrameData& data = clips.at(c)->start();             //all of them begin here
+      int frameW = clips.at(c)->clip()->animation()==NULL ? 0
+                                                           : source->frameWeights.at(source->at(frame));
+      int limbW = data.weight();
+
+      sumWeights += frameW*limbW;
+      Position tempPos = data.position();
+      if(baseCount==1 && sumWeights==0)         //no time for efficient solutions
+      {
+        sumWeights = 53;
+        tempPos.Multiply(53.0);
+      }
+      else
+        tempPos.Multiply((double)(frameW*limbW));
+      sumPos.Add(tempPos);
+    }
+
+    if(sumWeights == 0)           //zero weights
+      sumWeights = qMax(1, baseCount);
+
+    move.x = sumPos.x/sumWeights;
+    move.y = sumPos.y/sumWeights;
+    move.z = sumPos.z/sumWeights;
+    return;
+  }
+
+  double sumY = 0.0;
+  double clearSumY = 0.0;             //just for the case all weights are 0
+  double sumX = 0.0;                  //X and Z are summed as moves since previous frame
+  double clearSumX = 0.0;
+  double sumZ = 0.0;
+  double clearSumZ = 0.0;
+  int sumWeightsY = 0;
+  int sumWeightsXZ = 0;
+  int positionsUsed = 0;
+
+  for(int a=0; a<active.size(); a++)
+  {
+    int c = active.at(a);
+    const PoseBlock* source = sources.at(c);
+    TimeOffsetNode* clip = clips.at(c);
+    if(!clip->isPresent(frame))
+      continue;
+    int i = source->at(frame);
+    bool shadow = clip->clip()->animation() == NULL;
+    int frameW = shadow ? 0 : source->frameWeights.at(i);
+    int w = frameW*source->positionWeights.at(i);
+    double y = source->positions.at(i).y;
+    if(!shadow)                               //shadow postures have the offsets in already
+      y += clip->clip()->offset().y;
+
+    sumWeightsY += w;
+    clearSumY += y;
+    sumY += y*w;
+
+    if(frame > clip->offset())                //Item that has just joined blending has no previous
+    {                                         //frame to have difference with, it doesn't move anything
+      const Position& p1 = source->previousPositions.at(i);
+      const Position& p2 = source->positions.at(i);
+      positionsUsed++;
+      sumWeightsXZ += w;
+      clearSumX += p2.x-p1.x;
+      clearSumZ += p2.z-p1.z;
+      sumX += (p2.x-p1.x)*w;
+      sumZ += (p2.z-p1.z)*w;
+    }
+    else
+      sumWeightsXZ += w;                      //for case other inputs have zero weight at this place
+  }
+
+  if(positionsUsed > 0)
+  {
+    if(sumWeightsXZ == 0)                             //Houdini
+    {
+      move.x = clearSumX/positionsUsed;
+      move.z = clearSumZ/positionsUsed;
+    }
+    else
+    {
+      move.x = sumX/sumWeightsXZ;
+      move.z = sumZ/sumWeightsXZ;
+    }
+  }
+  //else items have just joined, position stays where it was
+
+  if(sumWeightsY == 0)
+    move.y = clearSumY / qMax(1, baseCount);
+  else
+    move.y = sumY/sumWeightsY;
+}
+
+/*! Rotations of all limbs in one frame. Partial rotations are averaged as quaternions (normalized
+    weighted sum), so they don't jump when some of them crosses +-180 degrees.
+    The buffers are [limb*4 + component] and are owned by the caller, so nothing gets allocated per frame. !*/
+void WeightedSumNode::combineRotations(int frame, PoseBlock& out, double* sum, double* clearSum,
+                                       double* reference, int* sumWeights) const
+{
+  int limbsCount = skeleton->limbs.size();
+  for(int i=0; i<limbsCount*4; i++)
+  {
+    sum[i] = 0.0;
+    clearSum[i] = 0.0;
+  }
+  for(int l=0; l<limbsCount; l++)
+  {
+    sumWeights[l] = 0;
+    for(int c=0; c<3; c++)
+      reference[l*4 + c] = 0.0;
+    reference[l*4 + 3] = 1.0;
+  }
+
+  bool haveReference = false;
+  for(int a=0; a<active.size(); a++)
+  {
+    int c = active.at(a);
+    const PoseBlock* source = sources.at(c);
+    if(!clips.at(c)->isPresent(frame))
+      continue;
+    int frameW = source->frameWeights.at(source->at(frame));
+
+    for(int l=0; l<limbsCount; l++)
+    {
+      if(skeleton->limbs.at(l)->type == BVH_END)
+        continue;
+
+      int index = source->at(frame, l);
+      const MT_Quaternion& q = source->rotations.at(index);
+      double* ref = reference + l*4;
+      if(!haveReference)
+      {
+        for(int k=0; k<4; k++)
+          ref[k] = q[k];
+      }
+      //q and -q are the same rotation, keep all of them in one hemisphere
+      double sign = (q[0]*ref[0] + q[1]*ref[1] + q[2]*ref[2] + q[3]*ref[3]) < 0.0 ? -1.0 : 1.0;
+
+      int w = frameW*source->limbWeights.at(index);
+      sumWeights[l] += w;
+      for(int k=0; k<4; k++)
+      {
+        clearSum[l*4 + k] += sign*q[k];
+        sum[l*4 + k] += sign*w*q[k];
+      }
+    }
+    haveReference = true;
+  }
+
+  for(int l=0; l<limbsCount; l++)
+  {
+    if(skeleton->limbs.at(l)->type == BVH_END)
+    {
+      out.rotations[out.at(frame, l)] = MT_Quaternion(0.0, 0.0, 0.0, 1.0);
+      continue;
+    }
+
+    double* q = (sumWeights[l] == 0) ? clearSum + l*4 : sum + l*4;
+    double length = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    if(length < 1e-9)           //opposite rotations cancelled out
+      q = reference + l*4;
+    else
+    {
+      for(int k=0; k<4; k++)
+        q[k] /= length;
+    }
+    out.rotations[out.at(frame, l)] = MT_Quaternion(q);
+  }
+}
+
+
+AdditiveNode::AdditiveNode(BlendNode* base, TimeOffsetNode* layer, int referenceFrame,
+                           const BlendSkeleton* skeleton) : BlendNode(skeleton)
+{
+  inputs << base << layer;
+  this->layer = layer;
+  this->referenceFrame = referenceFrame;
+  origin = 0;
+  deltasReference = -1;
+}
+
+void AdditiveNode::setBase(BlendNode* base)
+{
+  if(base == inputs.at(0))
+    return;
+  inputs[0] = base;
+  changed();
+}
+
+void AdditiveNode::setReferenceFrame(int frame)
+{
+  if(frame == referenceFrame)
+    return;
+  referenceFrame = frame;
+  changed();
+}
+
+void AdditiveNode::setOrigin(int frame)
+{
+  if(frame == origin)
+    return;
+  origin = frame;
+  changed();
+}
+
+/** Besides evaluating the inputs, finds deltas of the whole clip on first use or when
+    the reference frame changes. They don't depend on weights, so they survive changed(). */
+void AdditiveNode::prepare(int from, int to)
+{
+  base = &inputs.at(0)->evaluate(from, to);
+  ClipNode* clipNode = layer->clip();
+  int frames = clipNode->frames();
+  clip = &clipNode->evaluate(0, frames-1);
+
+  int reference = qBound(0, referenceFrame, frames-1);
+  if(reference == deltasReference && deltaPositions.size() == frames)
+    return;
+
+  int limbsCount = skeleton->limbs.size();
+  deltasReference = reference;
+  deltaRotations.resize(frames*limbsCount);
+  deltaPositions.resize(frames);
+
+  const Position& referencePos = clip->positions.at(reference);
+  for(int f=0; f<frames; f++)
+  {
+    const Position& pos = clip->positions.at(f);
+    deltaPositions[f] = Position(pos.x-referencePos.x, pos.y-referencePos.y, pos.z-referencePos.z);
+  }
+
+  WeightedAnimation* anim = clipNode->animation();
+  for(int l=0; l<limbsCount; l++)
+  {
+    if(anim == NULL || anim->getNode(skeleton->partIndices.at(l)) == NULL || skeleton->limbs.at(l)->type == BVH_END)
+    {
+      for(int f=0; f<frames; f++)
+        deltaRotations[f*limbsCount + l] = MT_Quaternion(0.0, 0.0, 0.0, 1.0);
+      continue;
+    }
+
+    MT_Quaternion inverseReference = clip->rotations.at(reference*limbsCount + l).conjugate();
+    for(int f=0; f<frames; f++)
+    {
+      MT_Quaternion delta = inverseReference * clip->rotations.at(f*limbsCount + l);
+      if(delta[3] < 0.0)              //the shorter way, so partial deltas can be interpolated from identity
+        delta = MT_Quaternion(-delta[0], -delta[1], -delta[2], -delta[3]);
+      deltaRotations[f*limbsCount + l] = delta;
+    }
+  }
+}
+
+/*! How much of the layer's limb (or position if limb is -1) is added in @param clipFrame, the nearest
+    frame of the clip. Frame weight 100 adds the whole layer, zero limb weight leaves the limb out. !*/
+double AdditiveNode::amount(int limb, int clipFrame) const
+{
+  int weight = limb < 0 ? clip->positionWeights.at(clipFrame) : clip->limbWeights.at(clip->at(clipFrame, limb));
+  if(weight == 0)
+    return 0.0;
+  return clip->frameWeights.at(clipFrame) / 100.0;
+}
+
+/*! Offset of the layer's position in (fractional) frame of the clip !*/
+Position AdditiveNode::deltaPosition(double clipPosition) const
+{
+  int first = (int)clipPosition;
+  double t = clipPosition - first;
+  Position p1 = deltaPositions.at(first);
+  if(t <= 0.0 || first+1 >= deltaPositions.size())
+    return p1;
+  Position p2 = deltaPositions.at(first+1);
+  return Position(p1.x + t*(p2.x-p1.x), p1.y + t*(p2.y-p1.y), p1.z + t*(p2.z-p1.z));
+}
+
+void AdditiveNode::compute(int first, int last, PoseBlock& out)
+{
+  int limbsCount = skeleton->limbs.size();
+  int frames = deltaPositions.size();
+
+  for(int t=first; t<=last; t++)
+  {
+    int i = out.at(t);
+    int b = base->at(t);
+    out.present[i] = base->present.at(b);
+    out.exact[i] = base->exact.at(b);
+    out.moves[i] = base->moves.at(b);
+    for(int l=0; l<limbsCount; l++)
+    {
+      out.rotations[out.at(t, l)] = base->rotations.at(base->at(t, l));
+      if(out.exact[i])
+        out.eulers[out.at(t, l)] = base->eulers.at(base->at(t, l));
+    }
+    if(!layer->isPresent(t))
+      continue;
+
+    if(!out.present[i])                   //on T-pose
+    {
+      out.moves[i] = Position(0.0, 0.0, 0.0);
+      for(int l=0; l<limbsCount; l++)
+        out.rotations[out.at(t, l)] = MT_Quaternion(0.0, 0.0, 0.0, 1.0);
+    }
+    out.present[i] = true;
+    out.exact[i] = false;
+
+    int frame = t - layer->offset();
+    double position = layer->clipPosition(t);
+    int clipFrame = (int)(position + 0.5);
+
+    for(int l=0; l<limbsCount; l++)
+    {
+      if(skeleton->limbs.at(l)->type == BVH_END)
+        continue;
+      double limbAmount = amount(l, clipFrame);
+      if(limbAmount <= 0.0)
+        continue;
+      MT_Quaternion delta = sampleRotation(deltaRotations, frames, limbsCount, l, position);
+      MT_Quaternion& rotation = out.rotations[out.at(t, l)];
+      rotation = rotation * (limbAmount < 1.0 ? partialDelta(delta, limbAmount) : delta);
+    }
+
+    Position& move = out.moves[i];
+    double positionAmount = amount(-1, clipFrame);
+    Position delta = deltaPosition(position);
+    move.y += positionAmount*delta.y;
+    if(t == origin)
+    {
+      move.x += positionAmount*delta.x;
+      move.z += positionAmount*delta.z;
+    }
+    else if(frame > 0)
+    {
+      double previousPosition = layer->clipPosition(t-1);
+      double previousAmount = amount(-1, (int)(previousPosition + 0.5));
+      Position previous = deltaPosition(previousPosition);
+      move.x += positionAmount*delta.x - previousAmount*previous.x;
+      move.z += positionAmount*delta.z - previousAmount*previous.z;
+    }
+  }
+}
+
+
+static void collectLimbs(BVHNode* limb, QList<BVHNode*>& limbs)
+{
+  limbs.append(limb);
+  for(int i=0; i<limb->numChildren(); i++)
+    collectLimbs(limb->child(i), limbs);
+}
+
+
+BlendGraph::BlendGraph(WeightedAnimation* target)
+{
+  this->target = NULL;
+  limbs.position = NULL;
+  output = NULL;
+  sum = NULL;
+  setTarget(target);
+}
+
+BlendGraph::~BlendGraph()
+{
+  qDeleteAll(nodes);
+}
+
+void BlendGraph::setTarget(WeightedAnimation* target)
+{
+  this->target = target;
+  QList<BVHNode*> targetLimbs;
+  collectLimbs(target->getMotion(), targetLimbs);
+  QStringList names;
+  foreach(BVHNode* limb, targetLimbs)
+    names.append(limb->name());
+  if(names != limbs.names)
+    clear();
+
+  limbs.limbs = targetLimbs;
+  limbs.names = names;
+  limbs.partIndices.clear();
+  foreach(BVHNode* limb, targetLimbs)
+    limbs.partIndices.append(target->getPartIndex(limb));
+  limbs.position = target->getNode(0);
+}
+
+void BlendGraph::clear()
+{
+  qDeleteAll(nodes);
+  nodes.clear();
+  trailNodes.clear();
+  output = NULL;
+  sum = NULL;
+}
+
+void BlendGraph::remove(BlendNode* node)
+{
+  nodes.removeAll(node);
+  if(output == node)
+    output = NULL;
+  delete node;
+}
+
+void BlendGraph::removeTrailNodes(const TrailNodes& trail)
+{
+  if(trail.layer != NULL)
+    remove(trail.layer);
+  remove(trail.placement);
+  remove(trail.clip);
+}
+
+
+/*! Euler angles of output frames @param first to @param last, in channel order of the target.
+    @param result is indexed the same way as rotations of @param block. !*/
+static void toEulerRange(const PoseBlock* block, const BlendSkeleton* skeleton, Rotation* result,
+                         int first, int last)
+{
+  int limbsCount = skeleton->limbs.size();
+  for(int t=first; t<=last; t++)
+  {
+    int i = block->at(t);
+    for(int l=0; l<limbsCount; l++)
+    {
+      int index = block->at(t, l);
+      BVHNode* limb = skeleton->limbs.at(l);
+      if(block->exact.at(i))
+        result[index] = block->eulers.at(index);
+      else if(limb->type == BVH_END)
+        result[index] = Rotation();
+      else
+        IKTree::toEuler(block->rotations.at(index), limb->channelOrder, result[index].x, result[index].y,
+                        result[index].z);
+    }
+  }
+}
+
+void BlendGraph::render(int from, int to, int targetFrame)
+{
+  if(output == NULL || target == NULL)
+    return;
+
+  int limbsCount = limbs.limbs.size();
+  BVHNode* position = target->getNode(0);
+  Position lastPos;
+  if(targetFrame > 0)
+    lastPos = position->frameData(targetFrame-1).position();
+
+  QVector<Rotation> rotations;
+  for(int first=from; first<=to; first+=BLEND_WINDOW)
+  {
+    int last = qMin(first+BLEND_WINDOW-1, to);
+    const PoseBlock& block = output->evaluate(first, last);
+
+    int framesCount = last - first + 1;
+    rotations.resize(block.frames*limbsCount);
+    int numThreads = qBound(1, QThread::idealThreadCount(), (framesCount+BLEND_MIN_FRAMES-1) / BLEND_MIN_FRAMES);
+    int chunk = (framesCount+numThreads-1) / numThreads;
+    QList<QFuture<void> > workers;
+    for(int t=first+chunk; t<=last; t+=chunk)
+      workers.append(QtConcurrent::run(toEulerRange, &block, (const BlendSkeleton*)&limbs,
+                                       rotations.data(), t, qMin(t+chunk-1, last)));
+    toEulerRange(&block, &limbs, rotations.data(), first, qMin(first+chunk-1, last));
+    for(int i=0; i<workers.size(); i++)
+      workers[i].waitForFinished();
+
+    //add up the position moves, then write everything into the target
+    for(int t=first; t<=last; t++)
+    {
+      int i = block.at(t);
+      if(!block.present.at(i))
+        continue;
+
+      int frame = targetFrame + t - from;
+      const Position& move = block.moves.at(i);
+      Position pos = (frame == 0) ? move : Position(lastPos.x + move.x, move.y, lastPos.z + move.z);
+      position->addKeyframe(frame, pos, Rotation());
+      lastPos = pos;
+
+      const Rotation* frameRotations = rotations.data() + block.at(t, 0);
+      for(int l=0; l<limbsCount; l++)
+        limbs.limbs[l]->addKeyframe(frame, Position(), frameRotations[l]);
+    }
+    releaseEnded(last);
+  }
+}
+
+/** Frees caches of items that end before @param frame+1, the rendering goes on after them */
+void BlendGraph::releaseEnded(int frame)
+{
+  foreach(const TrailNodes& trail, trailNodes)
+  {
+    if(trail.placement->last() > frame)
+      continue;
+    trail.clip->release();
+    trail.placement->release();
+  }
+}
+
+
+BlendGraph* BlendGraph::fromTrails(QList<TrailItem*> sortedItems, WeightedAnimation* target)
+{
+  BlendGraph* graph = new BlendGraph(target);
+  graph->setTrails(sortedItems);
+  return graph;
+}
+
+void BlendGraph::setTrails(QList<TrailItem*> sortedItems)
+{
+  QHash<TrailItem*, TrailNodes> kept;
+  foreach(TrailItem* item, sortedItems)
+  {
+    TrailNodes trail;
+    QHash<TrailItem*, TrailNodes>::iterator old = trailNodes.find(item);
+    if(old != trailNodes.end() && !item->isShadow() && old.value().clip->animation() == item->getAnimation())
+    {
+      trail = old.value();
+      trailNodes.erase(old);
+    }
+    else if(item->isShadow())
+    {
+      QVector<int> weights(item->frames());
+      for(int k=0; k<weights.size(); k++)
+        weights[k] = item->getWeight(k);
+      trail.clip = add(new ClipNode(item->shadowPosture(), weights, &limbs));
+      trail.placement = add(new TimeOffsetNode(trail.clip, item->beginIndex(), item->frames()));
+      trail.layer = NULL;
+    }
+    else
+    {
+      trail.clip = add(new ClipNode(item->getAnimation(), &limbs));
+      trail.placement = add(new TimeOffsetNode(trail.clip, item->beginIndex(), item->frames(), item->timeScale()));
+      trail.layer = NULL;
+    }
+
+    trail.placement->setPlacement(item->beginIndex(), item->frames(), item->timeScale());
+    kept.insert(item, trail);
+  }
+
+  foreach(TrailNodes trail, trailNodes)
+    removeTrailNodes(trail);
+  trailNodes = kept;
+
+  //everything but the additive items is summed, those are added on top in order
+  if(sum == NULL)
+    sum = add(new WeightedSumNode(&limbs));
+  int origin = sortedItems.isEmpty() ? 0 : sortedItems.first()->beginIndex();
+  QList<TimeOffsetNode*> clips;
+  QList<TrailItem*> additiveItems;
+  foreach(TrailItem* item, sortedItems)
+  {
+    TrailNodes& trail = trailNodes[item];
+    if(item->isAdditive())
+      additiveItems.append(item);
+    else
+    {
+      if(trail.layer != NULL)
+      {
+        remove(trail.layer);
+        trail.layer = NULL;
+      }
+      clips.append(trail.placement);
+    }
+  }
+  sum->setInputs(clips);
+  sum->setOrigin(origin);
+
+  BlendNode* top = sum;
+  foreach(TrailItem* item, additiveItems)
+  {
+    TrailNodes& trail = trailNodes[item];
+    if(trail.layer == NULL)
+      trail.layer = add(new AdditiveNode(top, trail.placement, item->additiveReference(), &limbs));
+    else
+    {
+      trail.layer->setBase(top);
+      trail.layer->setReferenceFrame(item->additiveReference());
+    }
+    trail.layer->setOrigin(origin);
+    top = trail.layer;
+  }
+  output = top;
+}
+
+void BlendGraph::itemChanged(TrailItem* item)
+{
+  QHash<TrailItem*, TrailNodes>::const_iterator trail = trailNodes.constFind(item);
+  if(trail != trailNodes.constEnd())
+    trail.value().clip->changed();
+}
+
+void BlendGraph::invalidate()
+{
+  foreach(BlendNode* node, nodes)
+    node->changed();
+}
+
+TimeOffsetNode* BlendGraph::placement(TrailItem* item) const
+{
+  QHash<TrailItem*, TrailNodes>::const_iterator trail = trailNodes.constFind(item);
+  return trail == trailNodes.constEnd() ? NULL : trail.value().placement;
+}
@@ -0,0 +1,336 @@
+#ifndef BLENDGRAPH_H
+#define BLENDGRAPH_H
+
+#include <QHash>
+#include <QList>
+#include <QStringList>
+#include <QVector>
+#include "bvhnode.h"
+#include "mt_quaternion.h"
+#include "rotation.h"
+#include "trailitem.cpp"
+
+class WeightedAnimation;
+
+
+/** Limbs a graph blends: the target skeleton without position node, depth first */
+struct BlendSkeleton
+{
+  QList<BVHNode*> limbs;
+  QStringList names;
+  QList<int> partIndices;               //indices of the limbs for Animation::getNode()
+  BVHNode* position;                    //position pseudo-node of the target
+};
+
+
+/** Output of a BlendNode for a range of frames. Per limb data go in the order of BlendSkeleton::limbs.
+    Clips (ClipNode, TimeOffsetNode) fill everything but moves. Sums (WeightedSumNode, AdditiveNode)
+    fill rotations and moves, and Euler angles of frames marked exact. */
+struct PoseBlock
+{
+  int firstFrame;
+  int frames;
+  int limbs;
+  QVector<MT_Quaternion> rotations;     //[frame*limbs + limb]
+  QVector<Rotation> eulers;             //[frame*limbs + limb], in channel order of the source limb
+  QVector<int> limbWeights;             //[frame*limbs + limb]
+  QVector<Position> positions;          //[frame]
+  QVector<Position> previousPositions;  //[frame], position of the clip one frame earlier
+  QVector<int> positionWeights;         //[frame], limb weight of the position
+  QVector<int> frameWeights;            //[frame]
+  QVector<Position> moves;              //[frame], see WeightedSumNode
+  QVector<bool> present;                //[frame]
+  QVector<bool> exact;                  //[frame], Euler angles are the result, nothing got blended
+
+  PoseBlock() { firstFrame = 0; frames = 0; limbs = 0; }
+  void resize(int first, int count, int limbsCount);
+  bool covers(int from, int to) const { return from >= firstFrame && to < firstFrame+frames; }
+  /** Index of @param frame (absolute, not from firstFrame) for per frame data */
+  int at(int frame) const             { return frame-firstFrame; }
+  int at(int frame, int limb) const   { return (frame-firstFrame)*limbs + limb; }
+};
+
+
+/** Node of a blend graph. The output of a node is cached together with the version of the node it
+    was computed for. The version changes whenever parameters of the node or of any node it reads
+    from change, so an edit re-evaluates only nodes downstream of the edited one. Frames are computed
+    in parallel blocks, evaluate() itself must be called from one thread at a time. */
+class BlendNode
+{
+  public:
+    BlendNode(const BlendSkeleton* skeleton);
+    virtual ~BlendNode() {}
+
+    /** Output in frames @param from to @param to, taken from cache when possible. The returned block
+        may cover more frames and stays valid until the next evaluate() of this node. */
+    const PoseBlock& evaluate(int from, int to);
+    /** Grows with every change of this node or its inputs */
+    quint64 version() const;
+    /** To be called when parameters of the node or data it reads from outside the graph change */
+    void changed();
+    /** Frees the cached output */
+    void release();
+    const BlendSkeleton* getSkeleton() const  { return skeleton; }
+
+  protected:
+    const BlendSkeleton* skeleton;
+    QList<BlendNode*> inputs;
+
+    /** Evaluates inputs needed for frames @param from to @param to. Called before compute(). */
+    virtual void prepare(int from, int to) { Q_UNUSED(from); Q_UNUSED(to); }
+    /** Computes frames @param first to @param last into @param out. Called from worker threads,
+        each with its own frames. */
+    virtual void compute(int first, int last, PoseBlock& out) = 0;
+
+  private:
+    quint64 modified;
+    PoseBlock cache;
+    quint64 cacheVersion;
+
+    static quint64 clock;
+    static void computeBlock(BlendNode* node, int first, int last);
+};
+
+
+/** Frames of an animation, or of a shadow posture held for given number of frames. Postures of
+    the animation are supposed not to change while the node exists, its weights may. */
+class ClipNode : public BlendNode
+{
+  public:
+    ClipNode(WeightedAnimation* anim, const BlendSkeleton* skeleton);
+    ClipNode(const ShadowPosture& posture, const QVector<int>& frameWeights, const BlendSkeleton* skeleton);
+
+    WeightedAnimation* animation() const  { return anim; }
+    int frames() const                    { return framesCount; }
+    /** Offset of the animation, positions come without it. Shadow postures have it in already. */
+    Position offset() const;
+
+  protected:
+    virtual void compute(int first, int last, PoseBlock& out);
+
+  private:
+    WeightedAnimation* anim;              //NULL for a shadow posture
+    int framesCount;
+    QVector<BVHNode*> nodes;
+    FrameData posturePosition;
+    QVector<FrameData> postureLimbs;
+    QVector<int> postureWeights;
+};
+
+
+/** Time-line positions @param first to @param last play frames of the clip given by @param frames
+    from position @param begin on, instead of the evenly spaced ones */
+struct FrameWarp
+{
+  int first;
+  int last;
+  int begin;
+  QVector<int> frames;
+
+  bool operator==(const FrameWarp& other) const
+  {
+    return first==other.first && last==other.last && begin==other.begin && frames==other.frames;
+  }
+};
+
+/** Clip placed at time-line position @param offset and played @param scale times faster, taking
+    @param length positions. Frames between two clip frames are interpolated. Rotation data and limb
+    weights are the ones of the earlier frame, frame weights the ones of the nearest frame. */
+class TimeOffsetNode : public BlendNode
+{
+  public:
+    TimeOffsetNode(ClipNode* clip, int offset, int length, double scale=1.0);
+
+    void setPlacement(int offset, int length, double scale);
+    /** Time warps of the clip, checked in given order */
+    void setWarps(const QList<FrameWarp>& warps);
+
+    ClipNode* clip() const              { return clipNode; }
+    int offset() const                  { return begin; }
+    int last() const                    { return begin+length-1; }
+    double scale() const                { return timeScale; }
+    bool isPresent(int frame) const     { return frame >= begin && frame <= last(); }
+    /** Frame of the clip, possibly fractional, played at time-line position @param frame, time warps aside */
+    double clipPosition(int frame) const;
+    /** Position data of the clip's first frame. Valid after evaluation of the first time-line position. */
+    const FrameData& start() const      { return startData; }
+
+  protected:
+    virtual void prepare(int from, int to);
+    virtual void compute(int first, int last, PoseBlock& out);
+
+  private:
+    ClipNode* clipNode;
+    int begin;
+    int length;
+    double timeScale;
+    QList<FrameWarp> warps;
+    const PoseBlock* source;
+    FrameData startData;
+
+    double clipPosition(int frame, const FrameWarp* warp) const;
+    const FrameWarp* warpAt(int frame) const;
+    void samplePosition(double position, Position& result, int* weight) const;
+};
+
+
+/** Goes from input @param a to input @param b over @param length frames starting at @param begin */
+class CrossfadeNode : public BlendNode
+{
+  public:
+    CrossfadeNode(BlendNode* a, BlendNode* b, int begin, int length, const BlendSkeleton* skeleton);
+
+    void setFade(int begin, int length);
+
+  protected:
+    virtual void prepare(int from, int to);
+    virtual void compute(int first, int last, PoseBlock& out);
+
+  private:
+    int begin;
+    int length;
+    const PoseBlock* a;
+    const PoseBlock* b;
+};
+
+
+/** Takes each limb from input @param a or @param b (or between) by limb weights. 0 means a, 1 means b.
+    The position goes with the first limb. */
+class LimbMaskNode : public BlendNode
+{
+  public:
+    LimbMaskNode(BlendNode* a, BlendNode* b, const BlendSkeleton* skeleton);
+
+    void setLimbWeight(int limb, double weight);
+
+  protected:
+    virtual void prepare(int from, int to);
+    virtual void compute(int first, int last, PoseBlock& out);
+
+  private:
+    QVector<double> limbWeights;
+    const PoseBlock* a;
+    const PoseBlock* b;
+};
+
+
+/** How the trail model blends placed clips. Rotations of the clips present in a frame are averaged
+    as quaternions by frame and limb weights, in order of inputs. Only Y of the position is averaged,
+    X and Z are averaged as moves since the previous frame. So moves hold X and Z relative to the
+    previous frame (absolute at @param origin, the first frame of the blend) and absolute Y.
+    Frames of just one unscaled clip are its Euler angles, marked exact. */
+class WeightedSumNode : public BlendNode
+{
+  public:
+    WeightedSumNode(const BlendSkeleton* skeleton);
+
+    void setInputs(const QList<TimeOffsetNode*>& clips);
+    void setOrigin(int frame);
+
+  protected:
+    virtual void prepare(int from, int to);
+    virtual void compute(int first, int last, PoseBlock& out);
+
+  private:
+    QList<TimeOffsetNode*> clips;
+    QVector<const PoseBlock*> sources;      //NULL for clips not present in evaluated frames
+    QVector<int> active;                    //indices of the others, in order
+    int origin;
+
+    void combineMove(int frame, Position& move) const;
+    void combineRotations(int frame, PoseBlock& out, double* sum, double* clearSum, double* reference,
+                          int* sumWeights) const;
+};
+
+
+/** Adds motion of clip @param layer relative to its posture at @param referenceFrame on top of @param base
+    (on T-pose where the base is not present). Frame weight 100 adds the whole motion, zero limb weight
+    leaves the limb out. Positions are added as whole offsets from the reference frame, so a layer
+    fading out returns the position back. Moves are the ones of WeightedSumNode. */
+class AdditiveNode : public BlendNode
+{
+  public:
+    AdditiveNode(BlendNode* base, TimeOffsetNode* layer, int referenceFrame, const BlendSkeleton* skeleton);
+
+    void setBase(BlendNode* base);
+    void setReferenceFrame(int frame);
+    void setOrigin(int frame);
+
+  protected:
+    virtual void prepare(int from, int to);
+    virtual void compute(int first, int last, PoseBlock& out);
+
+  private:
+    TimeOffsetNode* layer;
+    int referenceFrame;
+    int origin;
+    const PoseBlock* base;
+    const PoseBlock* clip;
+    //motion of the clip relative to the reference frame, evaluated once for all its frames
+    int deltasReference;
+    QVector<MT_Quaternion> deltaRotations;  //[frame*limbs + limb]
+    QVector<Position> deltaPositions;       //[frame]
+
+    double amount(int limb, int clipFrame) const;
+    Position deltaPosition(double clipPosition) const;
+};
+
+
+/** Owner of blend nodes working on skeleton of the target animation. The output node is rendered
+    into key frames of the target. */
+class BlendGraph
+{
+  public:
+    BlendGraph(WeightedAnimation* target);
+    ~BlendGraph();
+
+    /** Renders into @param target from now on. Nodes are dropped if its skeleton differs from the last one. */
+    void setTarget(WeightedAnimation* target);
+    const BlendSkeleton* skeleton() const   { return &limbs; }
+
+    /** The graph takes ownership of the node */
+    template <class T> T* add(T* node)      { nodes.append(node); return node; }
+    void remove(BlendNode* node);
+    void setOutput(BlendNode* node)         { output = node; }
+
+    /** Writes output frames @param from to @param to into key frames of the target, output frame
+        @param from going to target frame @param targetFrame. X and Z of the position are added up from
+        moves onto the target's frame before. Frames without output are left as they are. */
+    void render(int from, int to, int targetFrame);
+
+    /** Graph doing what Blender does with given items sorted by begin: a clip placed on time-line for each
+        (shadows included), all but the additive ones summed, the additive ones added on top in order.
+        Output frames are time-line positions. */
+    static BlendGraph* fromTrails(QList<TrailItem*> sortedItems, WeightedAnimation* target);
+    /** Changes the graph to the given items. Nodes of items that stay are kept with their caches,
+        shadows get new ones. */
+    void setTrails(QList<TrailItem*> sortedItems);
+    /** Weights of @param item have changed */
+    void itemChanged(TrailItem* item);
+    /** Data outside the graph may have changed, nothing cached is valid any more */
+    void invalidate();
+    /** Placed clip of the item, NULL if it isn't in the graph */
+    TimeOffsetNode* placement(TrailItem* item) const;
+
+  private:
+    /** Nodes made for one item */
+    struct TrailNodes
+    {
+      ClipNode* clip;
+      TimeOffsetNode* placement;
+      AdditiveNode* layer;                  //NULL if the item isn't additive
+    };
+
+    WeightedAnimation* target;
+    BlendSkeleton limbs;
+    QList<BlendNode*> nodes;
+    BlendNode* output;
+    QHash<TrailItem*, TrailNodes> trailNodes;
+    WeightedSumNode* sum;
+
+    void clear();
+    void removeTrailNodes(const TrailNodes& trail);
+    void releaseEnded(int frame);
+};
+
+#endif // BLENDGRAPH_H
@@ -0,0 +1,122 @@
+/*
+  Background blending of time-line items for BlenderTimeline.
+*/
+
+#include "blender.h"
+#include "blendworker.h"
+#include "bvh.h"
+#include "trailitem.cpp"
+#include "weightedanimation.h"
+
+#define BLEND_BLOCK_FRAMES      60      //time-line positions blended between two publications
+
+
+BlendWorker::BlendWorker(QList<TrailItem*> sortedItems, int framesCount, Blender* blender, QObject* parent)
+  : QThread(parent)
+{
+  this->blender = blender;
+  cancelled = false;
+  lastBlendedFrame = -1;
+
+  //own copies, so begin indices stay as they were when blending started
+  foreach(TrailItem* item, sortedItems)
+  {
+    TrailItem* copy = new TrailItem(*item);       //shadows are just views, so a shallow copy will do
+    copy->setPreviousItem(0);
+    copy->setNextItem(0);
+    items.append(copy);
+  }
+
+  work = new WeightedAnimation(new BVH(), "");
+  work->setNumberOfFrames(framesCount);
+}
+
+BlendWorker::~BlendWorker()
+{
+  while(!items.isEmpty())
+    delete items.takeFirst();
+  delete work;
+}
+
+
+void BlendWorker::cancel()
+{
+  cancelled = true;
+}
+
+
+void BlendWorker::run()
+{
+  if(items.size() < 2)
+    return;
+
+  int firstPosition = items.first()->beginIndex();
+  int lastPosition = firstPosition + work->getNumberOfFrames() - 1;
+  int position = firstPosition;
+
+  while(position <= lastPosition && !cancelled)
+  {
+    int blended = blender->BlendRange(items, work, position, position+BLEND_BLOCK_FRAMES-1);
+    if(blended < position)          //nothing done, don't loop forever
+      break;
+
+    QList<QList<FrameData> > block;
+    collectKeyFrames(work->getNode(0), position-firstPosition, blended-firstPosition, block);
+    collectKeyFrames(work->getMotion(), position-firstPosition, blended-firstPosition, block);
+
+    blocksMutex.lock();
+    blocks.append(block);
+    lastBlendedFrame = blended-firstPosition;
+    blocksMutex.unlock();
+
+    emit framesBlended(blended-firstPosition);
+    position = blended+1;
+  }
+}
+
+
+int BlendWorker::takeBlendedFrames(WeightedAnimation* target)
+{
+  blocksMutex.lock();
+  QList<QList<QList<FrameData> > > ready = blocks;
+  blocks.clear();
+  int result = lastBlendedFrame;
+  blocksMutex.unlock();
+
+  foreach(QList<QList<FrameData> > block, ready)
+  {
+    int nodeIndex = 0;
+    applyKeyFrames(target->getNode(0), block, nodeIndex);
+    applyKeyFrames(target->getMotion(), block, nodeIndex);
+  }
+
+  return result;
+}
+
+
+void BlendWorker::collectKeyFrames(BVHNode* limb, int fromFrame, int toFrame,
+                                   QList<QList<FrameData> >& block)
+{
+  QList<FrameData> keys;
+  for(int frame=fromFrame; frame<=toFrame && limb->type!=BVH_END; frame++)
+  {
+    if(limb->isKeyframe(frame))
+      keys.append(limb->frameData(frame));
+  }
+  block.append(keys);
+
+  for(int i=0; i<limb->numChildren(); i++)
+    collectKeyFrames(limb->child(i), fromFrame, toFrame, block);
+}
+
+
+void BlendWorker::applyKeyFrames(BVHNode* limb, const QList<QList<FrameData> >& block, int& nodeIndex)
+{
+  const QList<FrameData>& keys = block.at(nodeIndex);
+  nodeIndex++;
+  foreach(FrameData data, keys)
+    limb->addKeyframe(data.frameNumber(), data.position(), data.rotation());
+
+  for(int i=0; i<limb->numChildren(); i++)
+    applyKeyFrames(limb->child(i), block, nodeIndex);
+}
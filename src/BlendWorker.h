@@ -0,0 +1,57 @@
+#ifndef BLENDWORKER_H
+#define BLENDWORKER_H
+
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include "bvhnode.h"
+
+class Blender;
+class TrailItem;
+class WeightedAnimation;
+
+
+/** Blends TrailItems prepared by Blender on a background thread. Items are copied when the worker
+    is created, so later moves on the time-line don't touch it. Finished frames are published in
+    blocks, so the beginning of the resulting animation can be played before the whole blend is done. */
+class BlendWorker : public QThread
+{
+  Q_OBJECT
+
+  public:
+    /** @param sortedItems items as returned by Blender::PrepareTrails
+        @param framesCount number of frames of the resulting animation
+        @param blender the one that prepared the items. Its caches (time warps, additive layers,
+               retimed clips) are used and filled by the worker, so nobody else may use it until
+               the worker has finished or was cancelled and waited for. */
+    BlendWorker(QList<TrailItem*> sortedItems, int framesCount, Blender* blender, QObject* parent=0);
+    ~BlendWorker();
+
+    /** Ask the worker to stop after current block. Use wait() to be sure it did. */
+    void cancel();
+    /** Moves all frames blended so far into @param target (must be made from the same skeleton).
+        Returns index of last frame blended so far, -1 if none yet. */
+    int takeBlendedFrames(WeightedAnimation* target);
+
+  signals:
+    /** Another block of frames is ready to be taken */
+    void framesBlended(int lastFrame);
+
+  protected:
+    virtual void run();
+
+  private:
+    Blender* blender;                 //not owned
+    QList<TrailItem*> items;
+    WeightedAnimation* work;          //private target, only touched by the worker thread
+    volatile bool cancelled;
+
+    QMutex blocksMutex;
+    QList<QList<QList<FrameData> > > blocks;      //key frames of finished blocks, per node in depth first order
+    int lastBlendedFrame;
+
+    void collectKeyFrames(BVHNode* limb, int fromFrame, int toFrame, QList<QList<FrameData> >& block);
+    void applyKeyFrames(BVHNode* limb, const QList<QList<FrameData> >& block, int& nodeIndex);
+};
+
+#endif // BLENDWORKER_H
@@ -4,20 +4,30 @@
 
 #include "announcer.h"
 #include "blender.h"
+#include "blendgraph.h"
 #include "bvh.h"
+#include "posedistance.h"
+#include "sectionsweep.h"
 #include "settings.h"
 #include "timelinetrail.h"
 #include "trailitem.cpp"
 #include "weightedanimation.h"
 
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QtAlgorithms>
+#include <QVector>
 #include <math.h>
-#define PI 3.14159265
+#define TIME_WARP_BAND          8       //time warp may shift frames by 1/TIME_WARP_BAND of overlap..
+#define TIME_WARP_MIN_BAND      3       //..but at least by this many frames
 
-Blender::Blender() { }
-Blender::~Blender() { }
+Blender::Blender() { blendedFirstPosition = -1; graph = NULL; graphWarping = false; }
+Blender::~Blender() { releaseShadows(); delete graph; }
 
 
-void Blender::EvaluateRelativeLimbWeights(QList<TimelineTrail*>* trails, int trailsCount)       //TODO: into below method?
+void Blender::EvaluateRelativeLimbWeights(QList<TimelineTrail*>* trails, int trailsCount,       //TODO: into below method?
+                                          int fromPosition, int toPosition)
 {
   int minPosIndex = 999999999;
   int maxPosIndex = -1;
@@ -46,124 +56,413 @@ void Blender::EvaluateRelativeLimbWeights(QList<TimelineTrail*>* trails, int tra
     currentItems[i] = firstItem;
   }
   if(maxPosIndex == -1)                       //Time-line is empty
+  {
+    delete [] currentItems;
     return;
+  }
 
-  int curPosIndex = minPosIndex;
+  int curPosIndex = minPosIndex > fromPosition ? minPosIndex : fromPosition;
+  if(maxPosIndex > toPosition)
+    maxPosIndex = toPosition;
   //Position pseudo-node is not included, but it's OK as it can't be highlighted
   QStringList boneNames = BVH::getValidNodeNames();
+  int bonesCount = boneNames.size();
+
+  QHash<TrailItem*, QVector<BVHNode*> > itemLimbs;    //limbs of each item by bone index, looked up once
+
+  //Items overlapping current position and a dense [active item x bone] matrix of their
+  //frame weight multiplied by limb weight
+  QVector<TrailItem*> activeItems(trailsCount);
+  QVector<int> activeFrames(trailsCount);
+  QVector<int> products(trailsCount * bonesCount);
+  QVector<int> sumWeights(bonesCount);
+
   while(curPosIndex<=maxPosIndex)
   {
-    foreach(QString bName, boneNames)
+    int activeCount = 0;
+
+    for(int i=0; i<trailsCount; i++)
     {
-      int sumWeight = 0;
-      int weightsUsed = 0;
-      bool emptyPosition = true;
+      TrailItem* item = currentItems[i];
 
-      //Temporary helper structure. Value is array of 2 integers: frame index inside
-      //respective animation and its frame weight
-      QMap<BVHNode*, QVector<int> >* usedData = new QMap<BVHNode*, QVector<int> >();
+      if(item == NULL)                                 //No more items on i-th trail
+        continue;
+      if(item->beginIndex() > curPosIndex)             //We're before first item of this trail
+        continue;
 
-      for(int i=0; i<trailsCount; i++)
+      while(item != NULL && item->endIndex() < curPosIndex)     //Move to next item
       {
-        TrailItem* item = currentItems[i];
+        currentItems[i] = item->nextItem();
+        item = currentItems[i];
+      }
+      if(item == NULL || item->isShadow())             //Still here?
+        continue;
 
-        if(item == NULL)                                 //No more items on i-th trail
-          continue;
-        if(item->beginIndex() > curPosIndex)             //We're before first item of this trail
-          continue;
+      if(item->beginIndex() <= curPosIndex && item->endIndex() >= curPosIndex)
+      {
+        activeItems[activeCount] = item;
+        activeFrames[activeCount] = item->animationFrame(curPosIndex - item->beginIndex());
+        activeCount++;
+      }
+    }
 
-        if(item->endIndex() < curPosIndex)               //Move to next item
-        {
-          currentItems[i] = item->nextItem();
-          item = currentItems[i];
-        }
-        if(item == NULL || item->isShadow())             //Still here?
-          continue;
-        else
-          emptyPosition = false;
+    if(activeCount == 0)                      //There were no valid item at this position
+    {                                         //so jump to the next one
+      curPosIndex++;
+      continue;
+    }
 
-        if(item->beginIndex() <= curPosIndex && item->endIndex() >= curPosIndex)
-        {
-          int frameIndex = curPosIndex - item->beginIndex();
-          int frameWeight = item->getWeight(frameIndex);
+    sumWeights.fill(0);
+    for(int a=0; a<activeCount; a++)
+    {
+      TrailItem* item = activeItems[a];
+      if(!itemLimbs.contains(item))
+      {
+        itemLimbs.insert(item, findLimbs(item->getAnimation(), boneNames));
+        item->getAnimation()->setRelativeWeightPositions(item->frames());
+      }
+      const QVector<BVHNode*> limbs = itemLimbs.value(item);
+
+      int frameIndex = activeFrames[a];                 //of the animation
+      int frameWeight = item->getAnimation()->getFrameWeight(frameIndex);
+      int* row = products.data() + a*bonesCount;
+      for(int b=0; b<bonesCount; b++)
+        row[b] = limbs[b]==NULL ? 0 : frameWeight * limbs[b]->frameData(frameIndex).weight();
+      if(item->isAdditive())                  //added on top, doesn't take weight from the others
+        continue;
+      for(int b=0; b<bonesCount; b++)
+        sumWeights[b] += row[b];
+    }
 
-          if(!item->getAnimation()->bones()->contains(bName))
-            Announcer::Exception(NULL, "Exception: can't evaluate relative weight for limb " +bName);
+    //normalize every bone column, so relative weights of a bone at this position sum up to 1.
+    //They're kept by positions of the item, a slowed down animation plays one frame in more of them
+    for(int a=0; a<activeCount; a++)
+    {
+      WeightedAnimation* anim = activeItems[a]->getAnimation();
+      int position = curPosIndex - activeItems[a]->beginIndex();
+      const int* row = products.constData() + a*bonesCount;
+      if(anim->isAdditive())
+      {
+        double amount = anim->getFrameWeight(activeFrames[a]) / 100.0;
+        for(int b=0; b<bonesCount; b++)
+          anim->setRelativeWeight(position, b, row[b]==0 ? 0.0 : amount);
+        continue;
+      }
+      for(int b=0; b<bonesCount; b++)
+      {
+        double relWei = sumWeights[b]==0 ? 1.0 / (double)activeCount     //Little trick if weight of current limb
+                                         : (double)row[b] / (double)sumWeights[b];    //was 0 on all trails
+        anim->setRelativeWeight(position, b, relWei);
+      }
+    }
 
+    curPosIndex++;
+  }
 
-//          BVHNode* limb = item->getAnimation()->bones()->value(bName);      NOT WORKING. REALLY NEED TO KNOW WHY
-          //desperate DEBUG
-          BVHNode* limb = item->getAnimation()->getNodeByName(bName);
+  delete [] currentItems;
+}
 
-          QVector<int> tempData;
-          tempData << frameIndex << frameWeight;
-          usedData->insert(limb, tempData);
-          sumWeight += frameWeight * limb->frameData(frameIndex).weight();
-          weightsUsed++;
-        }
-//        else Announcer::Exception(NULL, "Lame programmer exception :(");    //DEBUG
-      }
+/** Bones of given animation in the order of @param boneNames. Missing ones are NULL. */
+QVector<BVHNode*> Blender::findLimbs(WeightedAnimation* anim, const QStringList& boneNames)
+{
+  QVector<BVHNode*> result;
+  foreach(QString bName, boneNames)
+  {
+//    BVHNode* limb = anim->bones()->value(bName);      NOT WORKING. REALLY NEED TO KNOW WHY
+    BVHNode* limb = anim->getNodeByName(bName);
+    if(limb == NULL)
+      Announcer::Exception(NULL, "Exception: can't evaluate relative weight for limb " +bName);
+    result.append(limb);
+  }
 
-      if(emptyPosition)                         //There were no valid item at this position
-        break;                                  //so jump to the next one
+  return result;
+}
 
 
+WeightedAnimation* Blender::BlendTrails(TrailItem** trails, int trailsCount)
+{
+  QList<TrailItem*> items = PrepareTrails(trails, trailsCount);
+  WeightedAnimation* result = CreateResultingAnimation(items);
 
-      QMapIterator<BVHNode*, QVector<int> > iter(*usedData);
-      while(iter.hasNext())
-      {
-        iter.next();
-        BVHNode* bone = iter.key();
-        QVector<int> tempData = iter.value();
-        int frame = tempData[0];
-        int frameW = tempData[1];
-
-        if(sumWeight==0)                        //Little trick if weight of current limb was 0 on all trails
-          bone->setKeyFrameRelWeight(frame, 1.0 / (double)weightsUsed);
-        else
-        {
-          int limbW = bone->frameData(frame).weight();
-          double relWei = (double)(frameW*limbW) / (double)sumWeight;
-          bone->setKeyFrameRelWeight(frame, relWei);
-        }
-      }
+  if(items.size() > 1)
+    BlendRange(items, result, items.at(0)->beginIndex(), findHighestEndIndex(items));
 
-      delete usedData;
-    }
-    curPosIndex++;
-  }
+  return result;
 }
 
-WeightedAnimation* Blender::BlendTrails(TrailItem** trails, int trailsCount)
+
+QList<TrailItem*> Blender::PrepareTrails(TrailItem** trails, int trailsCount)
 {
-  QList<TrailItem*> items;
   QList<TrailItem*> origItems = lineUpTimelineTrails(trails, trailsCount);
+  rememberLayout(origItems);
+  shadowSpans.clear();
+  releaseShadows();
+  forgetTimeWarps(origItems);
+  if(graph != NULL)               //weights may have changed anywhere
+    graph->invalidate();
 
   if(origItems.size() == 1)       //only one animation
-    items = origItems;
-  else
-  {
-    QList<TrailItem*> mixIns = createMixInsImpliedShadowItems(origItems);
-    QList<TrailItem*> mixOuts = createMixOutsImpliedShadowItems(origItems);
+    return origItems;
+
+  QList<TrailItem*> mixIns = createMixInsImpliedShadowItems(origItems);
+  QList<TrailItem*> mixOuts = createMixOutsImpliedShadowItems(origItems);
 //TODO    if(mixIns==NULL || mixOuts==NULL)
 //      return NULL;
-    items = mergeAndSortItemsByBeginIndex(origItems, mixIns, mixOuts);
-  }
+  return mergeAndSortItemsByBeginIndex(origItems, mixIns, mixOuts);
+}
 
-  int endIndex = findHighestEndIndex(items);
-  int newFramesCont = endIndex - items.at(0)->beginIndex() + 1;
+
+WeightedAnimation* Blender::CreateResultingAnimation(QList<TrailItem*> sortedItems)
+{
+  int endIndex = findHighestEndIndex(sortedItems);
+  int newFramesCont = endIndex - sortedItems.at(0)->beginIndex() + 1;
   WeightedAnimation* result = new WeightedAnimation(new BVH(), "");
   result->setNumberOfFrames(newFramesCont);
+  blendedFirstPosition = sortedItems.at(0)->beginIndex();
 
-  if(origItems.size() == 1)                                     //for a single animation I MUST do it like this.
-    cloneAnimation(origItems.at(0)->getAnimation(), result);    //Otherwise signal/slot apocalypse begins
-  else
-    blend(items, result, endIndex);
+  if(sortedItems.size() == 1)                                       //for a single animation I MUST do it like this.
+  {                                                                 //Otherwise signal/slot apocalypse begins
+    if(sortedItems.at(0)->timeScale() == 1.0)
+      cloneAnimation(sortedItems.at(0)->getAnimation(), result);
+    else                                                            //resampled the same way as when blended
+    {
+      updateGraph(sortedItems, result, endIndex);
+      graph->render(sortedItems.at(0)->beginIndex(), endIndex, 0);
+    }
+  }
 
   return result;
 }
 
 
+int Blender::BlendRange(QList<TrailItem*> sortedItems, WeightedAnimation* target, int fromPosition,
+                        int toPosition)
+{
+  return blend(sortedItems, target, findHighestEndIndex(sortedItems), fromPosition, toPosition);
+}
+
+
+bool Blender::ReblendItem(QList<TimelineTrail*>* trails, int trailsCount, TrailItem* changedItem,
+                          WeightedAnimation* result)
+{
+  //in DEBUG mode shadows are linked into the trails and gap shadows are made while blending
+  if(Settings::Instance()->Debug() || result==NULL || changedItem==NULL || changedItem->isShadow())
+    return false;
+
+  TrailItem** rails = new TrailItem*[trailsCount];
+  for(int i=0; i<trailsCount; i++)
+    rails[i] = trails->at(i)->firstItem();
+  QList<TrailItem*> origItems = lineUpTimelineTrails(rails, trailsCount);
+  delete [] rails;
+
+  if(origItems.size() < 2 || !isSameLayout(origItems))
+    return false;
+
+  //shadows may have changed with the item (mix zones, its first or last posture), so both
+  //old and new ones made from the item must be blended again
+  QList<QPair<int, int> > dirtySpans = shadowSpans.values(changedItem);
+  shadowSpans.clear();
+  releaseShadows();
+  QList<TrailItem*> mixIns = createMixInsImpliedShadowItems(origItems);
+  QList<TrailItem*> mixOuts = createMixOutsImpliedShadowItems(origItems);
+  QList<TrailItem*> items = mergeAndSortItemsByBeginIndex(origItems, mixIns, mixOuts);
+  dirtySpans += shadowSpans.values(changedItem);
+
+  int endIndex = findHighestEndIndex(items);
+  int frameOffset = items.at(0)->beginIndex();
+  if(frameOffset != blendedFirstPosition || endIndex-frameOffset+1 != result->getNumberOfFrames())
+    return false;
+
+  int fromPosition = changedItem->beginIndex();
+  int toPosition = changedItem->endIndex();
+  for(int i=0; i<dirtySpans.size(); i++)
+  {
+    if(dirtySpans[i].first < fromPosition)
+      fromPosition = dirtySpans[i].first;
+    if(dirtySpans[i].second > toPosition)
+      toPosition = dirtySpans[i].second;
+  }
+
+  EvaluateRelativeLimbWeights(trails, trailsCount, fromPosition, toPosition);
+  if(graph != NULL)
+    graph->itemChanged(changedItem);
+
+  //X and Z of the position are accumulated frame by frame, so everything after the re-blended
+  //range must be moved by the same offset as its last frame
+  BVHNode* position = result->getNode(0);
+  QList<Position> oldPositions;
+  for(int frame=fromPosition-frameOffset; frame<result->getNumberOfFrames(); frame++)
+    oldPositions.append(position->frameData(frame).position());
+
+  int lastBlended = blend(items, result, endIndex, fromPosition, toPosition);
+  if(lastBlended >= fromPosition && lastBlended < endIndex)
+  {
+    Position oldPos = oldPositions.at(lastBlended-fromPosition);
+    Position newPos = position->frameData(lastBlended-frameOffset).position();
+    shiftPositionsAfter(position, lastBlended-frameOffset, newPos.x-oldPos.x, newPos.z-oldPos.z);
+  }
+
+  return true;
+}
+
+
+/*! Time warp of @param item to @param reference over their overlap. Returns frame of the item's
+    animation for each overlapping time-line position from @param warpBegin on. Empty if the
+    animations can't be aligned. A warp is kept until the overlap changes or one of the animations leaves time-line. !*/
+QVector<int> Blender::timeWarp(TrailItem* reference, TrailItem* item, int& warpBegin)
+{
+  warpBegin = qMax(reference->beginIndex(), item->beginIndex());
+  int warpEnd = qMin(reference->endIndex(), item->endIndex());
+
+  TimeWarpKey key;
+  key.reference = reference->getAnimation();
+  key.warped = item->getAnimation();
+  TimeWarp warp;
+  warp.referenceFrame = warpBegin - reference->beginIndex();
+  warp.warpedFrame = warpBegin - item->beginIndex();
+  warp.length = warpEnd - warpBegin + 1;
+  if(warp.length < 2 || key.reference == key.warped)
+    return QVector<int>();
+
+  //the alignment depends on the whole overlap, a warp of another one can't be reused
+  QHash<TimeWarpKey, TimeWarp>::const_iterator cached = timeWarps.constFind(key);
+  if(cached != timeWarps.constEnd() && cached.value().referenceFrame == warp.referenceFrame &&
+     cached.value().warpedFrame == warp.warpedFrame && cached.value().length == warp.length)
+    return cached.value().frames;
+
+  PoseFeatures referenceFeatures(key.reference, warp.referenceFrame, warp.referenceFrame+warp.length-1);
+  PoseFeatures warpedFeatures(key.warped, warp.warpedFrame, warp.warpedFrame+warp.length-1);
+  int band = qMax(TIME_WARP_MIN_BAND, warp.length / TIME_WARP_BAND);
+  warp.frames = PoseDistance::align(referenceFeatures, warpedFeatures, band);
+  for(int i=0; i<warp.frames.size(); i++)
+    warp.frames[i] += warp.warpedFrame;
+
+  timeWarps.insert(key, warp);
+  return warp.frames;
+}
+
+
+/** Drops time warps of animations that aren't among the given items any more */
+void Blender::forgetTimeWarps(QList<TrailItem*> items)
+{
+  QSet<WeightedAnimation*> animations;
+  foreach(TrailItem* item, items)
+    animations.insert(item->getAnimation());
+
+  QMutableHashIterator<TimeWarpKey, TimeWarp> it(timeWarps);
+  while(it.hasNext())
+  {
+    it.next();
+    if(!animations.contains(it.key().reference) || !animations.contains(it.key().warped))
+      it.remove();
+  }
+}
+
+
+/*! Makes the blend graph render @param sortedItems into @param target. The graph keeps nodes and their
+    caches of items that stay, so it's changed only when the items or the time warp setting do. !*/
+void Blender::updateGraph(QList<TrailItem*> sortedItems, WeightedAnimation* target, int lastFrameIndex)
+{
+  if(graph == NULL)
+    graph = new BlendGraph(target);
+  else
+    graph->setTarget(target);
+
+  bool warping = Settings::Instance()->timeWarping();
+  if(sortedItems == graphItems && warping == graphWarping)
+    return;
+  graph->setTrails(sortedItems);
+
+  //optionally the later animations are aligned in time to the first one of each section, so e.g. steps
+  //of two walks meet. Frame weights still go by time-line position.
+  QHash<TrailItem*, QList<FrameWarp> > warps;
+  if(warping)
+  {
+    int start;
+    int end;
+    QList<int> active;
+    SectionSweep sweep(sortedItems, lastFrameIndex);
+    while(sweep.nextSection(start, end, active))
+    {
+      TrailItem* reference = NULL;
+      foreach(int index, active)
+      {
+        TrailItem* item = sortedItems.at(index);
+        if(item->isShadow() || item->isAdditive() || item->timeScale() != 1.0)
+          continue;
+        if(reference == NULL)
+        {
+          reference = item;
+          continue;
+        }
+
+        FrameWarp warp;
+        warp.first = start;
+        warp.last = end;
+        warp.frames = timeWarp(reference, item, warp.begin);
+        if(!warp.frames.isEmpty())
+          warps[item].append(warp);
+      }
+    }
+  }
+  foreach(TrailItem* item, sortedItems)
+    graph->placement(item)->setWarps(warps.value(item));
+
+  graphItems = sortedItems;
+  graphWarping = warping;
+}
+
+
+void Blender::rememberLayout(QList<TrailItem*> items)
+{
+  blendedItems = items;
+  blendedBegins.clear();
+  blendedEnds.clear();
+  foreach(TrailItem* item, items)
+  {
+    blendedBegins.append(item->beginIndex());
+    blendedEnds.append(item->endIndex());
+  }
+}
+
+
+bool Blender::isSameLayout(QList<TrailItem*> items)
+{
+  if(items != blendedItems)
+    return false;
+
+  for(int i=0; i<items.size(); i++)
+  {
+    if(items[i]->beginIndex() != blendedBegins[i] || items[i]->endIndex() != blendedEnds[i])
+      return false;
+  }
+
+  return true;
+}
+
+
+/** Every new mix-in/-out shadow comes here. Unless it gets linked into trails (DEBUG mode), it's kept
+    until the next shadows are made, see releaseShadows() */
+void Blender::rememberShadowSpan(TrailItem* shadow, TrailItem* item1, TrailItem* item2)
+{
+  QPair<int, int> span(shadow->beginIndex(), shadow->endIndex());
+  shadowSpans.insert(item1, span);
+  shadowSpans.insert(item2, span);
+  if(!Settings::Instance()->Debug())
+    unlinkedShadows.append(shadow);
+}
+
+
+/** Frees shadows of the previous PrepareTrails or ReblendItem call. Those linked into trails are freed
+    by clearShadowItems() instead. */
+void Blender::releaseShadows()
+{
+  qDeleteAll(unlinkedShadows);
+  unlinkedShadows.clear();
+  graphItems.clear();               //new shadows may get addresses of the deleted ones
+}
+
+
 /** Returns list of TrailItems such that its size is equal to overall TrailItems number (one Item
     at one list position, original lists are merged to one array).
     Original linked list references are preserved. Also, possible shadow items are cleared. */
@@ -212,6 +511,23 @@ void Blender::clearShadowItems(TrailItem* firstItem)
 }
 
 
+/** Descriptor of a shadow item content. Frame weights of the shadow go as
+    (weightFirst + n*weightStep) / weightDivisor. */
+static ShadowPosture shadowPosture(WeightedAnimation* anim1, int frame1, WeightedAnimation* anim2, int frame2,
+                                   int weightFirst, int weightStep, int weightDivisor)
+{
+  ShadowPosture posture;
+  posture.anim1 = anim1;
+  posture.frame1 = frame1;
+  posture.anim2 = anim2;
+  posture.frame2 = frame2;
+  posture.weightFirst = weightFirst;
+  posture.weightStep = weightStep;
+  posture.weightDivisor = weightDivisor;
+  return posture;
+}
+
+
 /** Returns list of new artificial 'shadow' TrailItems. These are created to accomplish the mix-in
     functionality of two overlaping animations (the former is "blended in" the latter one). The shadow
     helpers will have lineary increasing frame weights to achieve gradual in-blending.
@@ -237,6 +553,8 @@ QList<TrailItem*> Blender::createMixInsImpliedShadowItems(QList<TrailItem*> item
 
       if(i==item)                                               //won't combine with self
         continue;
+      if(currentItem->isAdditive() || items[i]->isAdditive())   //layers don't mix with what's beneath
+        continue;
       if(items[i]->mixIn()==0)                                  //nothing to be done
         continue;
       if(currentItem->beginIndex() <= items[i]->beginIndex())   //wrong overlap order
@@ -249,28 +567,19 @@ QList<TrailItem*> Blender::createMixInsImpliedShadowItems(QList<TrailItem*> item
         int framesNum = items[i]->mixIn() > beginsDiff ? beginsDiff
                                                        : items[i]->mixIn();
 
-        WeightedAnimation* mixInShadow = new WeightedAnimation(new BVH(), "");
-        mixInShadow->setNumberOfFrames(framesNum);
-
-        //adjust shadow skeleton posture
+        //shadow skeleton posture
         int crossPoint = items[i]->frames() - (items[i]->endIndex() - currentItem->beginIndex());                 //TODO: possible BUG. What if they just touch?
         if(crossPoint > items[i]->frames())             //they're touching
           crossPoint-=2;
-        interpolatePosture(items[i]->getAnimation(), crossPoint, currentItem->getAnimation(), 0,
-                           mixInShadow);
-
-        //set shadows frame weights (going backwards from last frame to first)
-        for(int n=framesNum-1; n>=0; n--)
-        {
-          double value = (double)(n+1 + (items[i]->mixIn() - framesNum) ) / (double)items[i]->mixIn();
-          mixInShadow->setFrameWeight(n, (int)(value*100));
 
-          mixInShadow->getNode(0)->setKeyframeWeight(n, 0);    //position always taken from 'master' blender
-        }
-
-        TrailItem* shadowItem = new TrailItem(mixInShadow, "(1)mix in shadow for " +currentItem->name(),
-                                              currentItem->beginIndex()-framesNum, true);
+        //frame weights rise up to the last frame: (n+1 + (mixIn-framesNum)) / mixIn
+        ShadowPosture posture = shadowPosture(items[i]->getAnimation(), items[i]->animationFrame(crossPoint),
+                                              currentItem->getAnimation(), 0,
+                                              1 + items[i]->mixIn() - framesNum, 1, items[i]->mixIn());
+        TrailItem* shadowItem = new TrailItem(posture, "(1)mix in shadow for " +currentItem->name(),
+                                              currentItem->beginIndex()-framesNum, framesNum);
         result.append(shadowItem);
+        rememberShadowSpan(shadowItem, items[i], currentItem);
 
         //When in user invoked DEBUG mode, shadow items are embeded in time-line, so user can check them visualy
         if(Settings::Instance()->Debug())
@@ -300,23 +609,13 @@ QList<TrailItem*> Blender::createMixInsImpliedShadowItems(QList<TrailItem*> item
         int gap = 0; //currentItem->beginIndex() - items[i]->endIndex() - 1;
         int framesNum = items[i]->mixIn() - gap;
 
-        WeightedAnimation* mixInShadow = new WeightedAnimation(new BVH(), "");
-        mixInShadow->setNumberOfFrames(framesNum);
-
-        //adjust shadow skeleton posture
-        interpolatePosture(items[i]->getAnimation(), items[i]->frames()-1, currentItem->getAnimation(),
-                           0, mixInShadow);
-
-        for(int n=0; n<framesNum; n++)
-        {
-          double value = (double)(n+1) / (double)framesNum;
-          mixInShadow->setFrameWeight(n, (int)(value*100));
-          mixInShadow->getNode(0)->setKeyframeWeight(n, 0);    //position always taken from 'master' blender
-        }
-
-        TrailItem* shadowItem = new TrailItem(mixInShadow, "(2)mix in shadow for "+currentItem->name(),
-                                              items[i]->endIndex()-framesNum+1, true);
+        //frame weights (n+1) / framesNum
+        ShadowPosture posture = shadowPosture(items[i]->getAnimation(), items[i]->animationFrame(items[i]->frames()-1),
+                                              currentItem->getAnimation(), 0, 1, 1, framesNum);
+        TrailItem* shadowItem = new TrailItem(posture, "(2)mix in shadow for "+currentItem->name(),
+                                              items[i]->endIndex()-framesNum+1, framesNum);
         result.append(shadowItem);
+        rememberShadowSpan(shadowItem, items[i], currentItem);
 
         if(Settings::Instance()->Debug())
         {
@@ -366,6 +665,8 @@ QList<TrailItem*> Blender::createMixOutsImpliedShadowItems(QList<TrailItem*> ite
 
       if(i==item)                                           //won't combine with self
         continue;
+      if(currentItem->isAdditive() || items[i]->isAdditive())
+        continue;
       if(currentItem->mixOut()==0)                          //nothing to be done
         continue;
       if(currentItem->endIndex() <= items[i]->endIndex())   //wrong overlap order
@@ -378,29 +679,21 @@ QList<TrailItem*> Blender::createMixOutsImpliedShadowItems(QList<TrailItem*> ite
         int framesNum = currentItem->mixOut() > endsDiff ? endsDiff
                                                          : currentItem->mixOut();
 
-        WeightedAnimation* mixOutShadow = new WeightedAnimation(new BVH(), "");
-        mixOutShadow->setNumberOfFrames(framesNum);
-
-        //adjust shadow skeleton posture
+        //shadow skeleton posture
         int curAnimFrame;
         if(items[i]->endIndex()+1 == currentItem->beginIndex())     //they're touching. TODO: shouldn't this case be actually in the latter branch? (touching+gap)
           curAnimFrame = 0;
         else
           curAnimFrame = items[i]->endIndex() - currentItem->beginIndex() + 1;
 
-        interpolatePosture(items[i]->getAnimation(), items[i]->frames()-1, currentItem->getAnimation(),
-                           curAnimFrame, mixOutShadow);
-
-        for(int n=0; n<framesNum; n++)
-        {
-          double value = (double)(currentItem->mixOut()-n) / (double)currentItem->mixOut();
-          mixOutShadow->setFrameWeight(n, (int)(value*100));
-          mixOutShadow->getNode(0)->setKeyframeWeight(n, 0);    //position always taken from 'master' blender
-        }
-
-        TrailItem* shadowItem = new TrailItem(mixOutShadow, "(1)mix out shadow for "+currentItem->name(),
-                                              items[i]->endIndex()+1, true);
+        //frame weights (mixOut-n) / mixOut
+        ShadowPosture posture = shadowPosture(items[i]->getAnimation(), items[i]->animationFrame(items[i]->frames()-1),
+                                              currentItem->getAnimation(), currentItem->animationFrame(curAnimFrame),
+                                              currentItem->mixOut(), -1, currentItem->mixOut());
+        TrailItem* shadowItem = new TrailItem(posture, "(1)mix out shadow for "+currentItem->name(),
+                                              items[i]->endIndex()+1, framesNum);
         result.append(shadowItem);
+        rememberShadowSpan(shadowItem, items[i], currentItem);
 
         //show shadow items on time-line for debug purposes
         if(Settings::Instance()->Debug())
@@ -420,23 +713,14 @@ QList<TrailItem*> Blender::createMixOutsImpliedShadowItems(QList<TrailItem*> ite
         int gap = 0; //currentItem->beginIndex()-items[i]->endIndex()-1;
         int framesNum = currentItem->mixOut() - gap;
 
-        WeightedAnimation* mixOutShadow = new WeightedAnimation(new BVH(), "");
-        mixOutShadow->setNumberOfFrames(framesNum);
-
-        //adjust shadow skeleton posture
-        interpolatePosture(items[i]->getAnimation(), items[i]->frames()-1, currentItem->getAnimation(),
-                           0, mixOutShadow);
-
-        for(int n=1; n<=framesNum; n++)
-        {
-          double value = (double)n / (double)currentItem->mixOut();
-          mixOutShadow->setFrameWeight(framesNum-n, (int)(value*100));
-          mixOutShadow->getNode(0)->setKeyframeWeight(n-1, 0);    //position always taken from 'master' blender
-        }
-
-        TrailItem* shadowItem = new TrailItem(mixOutShadow, "(2)mix out shadow for "+currentItem->name(),
-                                              currentItem->beginIndex(), true);
+        //frame weights (framesNum-n) / mixOut
+        ShadowPosture posture = shadowPosture(items[i]->getAnimation(), items[i]->animationFrame(items[i]->frames()-1),
+                                              currentItem->getAnimation(), 0,
+                                              framesNum, -1, currentItem->mixOut());
+        TrailItem* shadowItem = new TrailItem(posture, "(2)mix out shadow for "+currentItem->name(),
+                                              currentItem->beginIndex(), framesNum);
         result.append(shadowItem);
+        rememberShadowSpan(shadowItem, items[i], currentItem);
 
         if(Settings::Instance()->Debug())
         {
@@ -455,88 +739,11 @@ QList<TrailItem*> Blender::createMixOutsImpliedShadowItems(QList<TrailItem*> ite
 }
 
 
-/** Create an BVH frame data for an animation. The animation will have only one posture (initial
-    key frame) made as linear interpolation of two given frames.
-    Frame weights are not considered in interpolation. */
-void Blender::interpolatePosture(WeightedAnimation* anim1, int frame1,
-                                 WeightedAnimation* anim2, int frame2,
-                                 WeightedAnimation* targetAnim)
+static bool beginsBefore(TrailItem* item1, TrailItem* item2)
 {
-  interpolatePostureHelper(anim1, frame1, anim2, frame2, 0, targetAnim);      //position pseudo-node first
-
-  int rootIndex1 = anim1->getPartIndex(anim1->getMotion());
-  interpolatePostureHelper(anim1, frame1, anim2, frame2, rootIndex1, targetAnim);
+  return item1->beginIndex() < item2->beginIndex();
 }
 
-
-/*! Content filler for shadow items !*/
-void Blender::interpolatePostureHelper(WeightedAnimation* anim1, int frame1,
-                                       WeightedAnimation* anim2, int frame2,
-                                       int nodeIndex, WeightedAnimation* targetAnim)
-{
-  Position clearSumPos(0.0, 0.0, 0.0);
-  Position sumPos(0.0, 0.0, 0.0);
-  Rotation clearSumRot(0.0, 0.0, 0.0);
-  Rotation sumRot(0.0, 0.0, 0.0);
-  double sumWeight = 0.0;
-
-  BVHNode* node1 = anim1->getNode(nodeIndex);
-  FrameData data1 = node1->frameData(frame1);
-  int frameW1 = anim1->getFrameWeight(frame1);
-  int limbW1 = data1.weight();
-
-  BVHNode* node2 = anim2->getNode(nodeIndex);
-  FrameData data2 = node2->frameData(frame2);
-  int frameW2 = anim2->getFrameWeight(frame2);
-  int limbW2 = data2.weight();
-
-  sumWeight = sumWeight+(frameW1*limbW1);
-
-  Position p1 = data1.position();
-  p1.Add(anim1->getOffset());
-  clearSumPos.Add(p1);
-  p1.Multiply(frameW1*limbW1);
-  sumPos.Add(p1);
-
-  Position p2 = data2.position();
-  p2.Add(anim2->getOffset());
-  clearSumPos.Add(p2);
-  p2.Multiply(frameW2*limbW2);
-  sumPos.Add(p2);
-
-  sumWeight = sumWeight+(frameW2*limbW2);
-
-  Rotation r1 = data1.rotation();
-  clearSumRot.Add(r1);
-  r1.Multiply(frameW1*limbW1);
-  sumRot.Add(r1);
-
-  Rotation r2 = data2.rotation();
-  clearSumRot.Add(r2);
-  r2.Multiply(frameW2*limbW2);
-  sumRot.Add(r2);
-
-  if(sumWeight == 0.0)
-  {
-    clearSumPos.Multiply(0.5);        // like "/=2"
-    clearSumRot.Multiply(0.5);
-    targetAnim->getNode(nodeIndex)->addKeyframe(0, clearSumPos, clearSumRot);
-  }
-  else
-  {
-    sumPos.Multiply(1/sumWeight);
-    sumRot.Multiply(1/sumWeight);
-    targetAnim->getNode(nodeIndex)->addKeyframe(0, sumPos, sumRot);
-  }
-
-  for(int i=0; i<node1->numChildren(); i++)
-  {
-    int limbIndex = anim1->getPartIndex(node1->child(i));
-    interpolatePostureHelper(anim1, frame1, anim2, frame2, limbIndex, targetAnim);
-  }
-}
-
-
 /** Returns list of TrailItems such that:
     1.) its size is sum of overall number of TrailItems created by user (one Item at list position)
         + automatically created mix-in/mix-out helper items
@@ -545,50 +752,9 @@ QList<TrailItem*> Blender::mergeAndSortItemsByBeginIndex(QList<TrailItem*> realI
                                                          QList<TrailItem*> mixInItems,
                                                          QList<TrailItem*> mixOutItems)
 {
-  QList<TrailItem*> result;
-
-  while(true)
-  {
-    int lowestBeginIndex = 999999999;           //Begin index of left-most item,
-    QList<TrailItem*>* lowestItemList = NULL;   //and list that contains that item
-    int itemIndex = -1;                         //Index of an item in the list
-
-    for(int r=0; r<realItems.size(); r++)
-    {
-      if(realItems.at(r)->beginIndex() < lowestBeginIndex)
-      {
-        lowestItemList = &realItems;
-        lowestBeginIndex = realItems.at(r)->beginIndex();
-        itemIndex = r;
-      }
-    }
-    for(int i=0; i<mixInItems.size(); i++)             //BLEH! code repetition. TODO: think of it
-    {
-      if(mixInItems.at(i)->beginIndex() < lowestBeginIndex)
-      {
-        lowestItemList = &mixInItems;
-        lowestBeginIndex = mixInItems.at(i)->beginIndex();
-        itemIndex = i;
-      }
-    }
-    for(int o=0; o<mixOutItems.size(); o++)             //here as well
-    {
-      if(mixOutItems.at(o)->beginIndex() < lowestBeginIndex)
-      {
-        lowestItemList = &mixOutItems;
-        lowestBeginIndex = mixOutItems.at(o)->beginIndex();
-        itemIndex = o;
-      }
-    }
-
-    if(lowestItemList != NULL)
-    {
-      result.append(lowestItemList->at(itemIndex));
-      lowestItemList->removeAt(itemIndex);
-    }
-    else break;
-  }
-
+  //stable, so items with the same begin keep the order real, mix-in, mix-out
+  QList<TrailItem*> result = realItems + mixInItems + mixOutItems;
+  qStableSort(result.begin(), result.end(), beginsBefore);
   return result;
 }
 
@@ -601,17 +767,23 @@ void Blender::cloneAnimation(WeightedAnimation* fromAnim, WeightedAnimation* toA
 }
 
 
+/*! Key frames are shared with the source until one of the animations changes them !*/
 void Blender::cloneAnimationHelper(int limbIndex, WeightedAnimation* fromAnim, WeightedAnimation * toAnim)
 {
   BVHNode* limb = fromAnim->getNode(limbIndex);
-  QList<int> keys = limb->keyframeList();
-  foreach(int i, keys)
+  BVHNode* targetLimb = toAnim->getNode(limbIndex);
+  targetLimb->shareKeyframes(limb);
+
+  Position offset = fromAnim->getOffset();
+  if(limbIndex==0 && (offset.x!=0.0 || offset.y!=0.0 || offset.z!=0.0))      //only this one gets its own copy
   {
-    FrameData data = fromAnim->getNode(limbIndex)->frameData(i);
-    Position offset = fromAnim->getOffset();
-    Position pos(data.position().x+offset.x, data.position().y+offset.y, data.position().z+offset.z);        //TODO: FUJ! why don't you just use copy constructor (=)?
-    Rotation rot(data.rotation().x, data.rotation().y, data.rotation().z);
-    toAnim->getNode(limbIndex)->addKeyframe(i, pos, rot);
+    QList<int> keys = limb->keyframeList();
+    foreach(int i, keys)
+    {
+      Position pos = limb->frameData(i).position();
+      pos.Add(offset);
+      targetLimb->setKeyframePosition(i, pos);
+    }
   }
 
   for(int x=0; x<limb->numChildren(); x++)
@@ -640,129 +812,59 @@ int Blender::findHighestEndIndex(QList<TrailItem*> items)
     Gaps between items are filled.
     @param sortedItems - TrailItems sorted by their begin index (position on time-line)
     @param result - the target animation which will host the blended postures
-    @param lastFrameIndex - time-line index of the last frame of right-most reaching animation */
-void Blender::blend(QList<TrailItem*> sortedItems, WeightedAnimation* result, int lastFrameIndex)
+    @param lastFrameIndex - time-line index of the last frame of right-most reaching animation
+    @param fromPosition, toPosition - only time-line positions in this range are blended (gaps reaching
+           into it are filled whole)
+    Returns time-line position of the last blended frame. */
+int Blender::blend(QList<TrailItem*> sortedItems, WeightedAnimation* result, int lastFrameIndex,
+                   int fromPosition, int toPosition)
 {
   if(sortedItems.size() < 2)
   {
     QString text = "Argument exception: the argument 'sortedItems' contains to few items.";
     if(Settings::Instance()->Debug())
       Announcer::Exception(NULL, text);
-    return;
+    return -1;
 //    throw new QString(text);
   }
 
-  int currentItemIndex = 0;
-  int intervalStartPosition = 999999999;
-  int intervalEndPosition = sortedItems.at(currentItemIndex)->beginIndex() - 1;
-  QList<int> itemsInInterval;                   //indices (to sortedItems) of items involved in current interval
-
-  //initial section fill with items that begin on the same leftmost time-line position
-  for(int i=0; i<sortedItems.size() ; i++)
-  {
-    if(sortedItems.at(i)->beginIndex() > (intervalEndPosition+1))
-      break;
-    itemsInInterval.append(i);
-  }
-
+  updateGraph(sortedItems, result, lastFrameIndex);
   int frameOffset = sortedItems.first()->beginIndex();
+  int lastBlended = -1;
+  int intervalStartPosition;
+  int intervalEndPosition;
+  QList<int> itemsInInterval;                   //indices (to sortedItems) of items involved in current interval
+  SectionSweep sweep(sortedItems, lastFrameIndex);
 
-  while(intervalEndPosition != lastFrameIndex)
+  while(sweep.nextSection(intervalStartPosition, intervalEndPosition, itemsInInterval))
   {
-    intervalStartPosition = intervalEndPosition+1;        //we shift to the next section
-
-    //remove indices of all items that ended in previous section
-    for(int cur=0; cur<itemsInInterval.size(); cur++)
-    {
-      if(sortedItems[itemsInInterval[cur]]->endIndex() < intervalStartPosition)   //the difference should be exactly 1
-      {
-        itemsInInterval.removeAt(cur);
-        cur--;          //dirty trick not to skip an element in for loop
-      }
-    }
-
-    //Add to the section all items, that are beginning right with it
-    for(int i=0; i<sortedItems.size(); i++)
-    {
-      if(sortedItems.at(i)->beginIndex() == intervalStartPosition && !itemsInInterval.contains(i))       //'contains(i)' ? Ugly! TODO: what about hash-set?
-        itemsInInterval.append(i);
-      else if(sortedItems.at(i)->beginIndex() > intervalStartPosition)
-        break;
-    }
-
-    if(!itemsInInterval.isEmpty())
-    {
-      //find section's end
-      int minEndFramePos = 999999999;            //first find next end of items currently inside section
-      for(int a=0; a<itemsInInterval.size(); a++)
-      {
-        if(sortedItems[itemsInInterval[a]]->endIndex() < minEndFramePos)
-          minEndFramePos = sortedItems[itemsInInterval[a]]->endIndex();
-      }
-
-      int nextIndex = itemsInInterval.last()+1;
-      while(true)
-      {
-        if(nextIndex >= sortedItems.size())                                 //there are no more items after
-          break;                                                            //this section
-
-        if(sortedItems[nextIndex]->beginIndex() > minEndFramePos)           //next item is to far
-          break;
-/*Done few lines above        if(sortedItems[nextIndex]->beginIndex() == intervalStartFrame)      //the item begins right with this
-        {                                                                   //section (probably was a reason
-          itemsInInterval.append(nextIndex);                                //to end the previous)
-        }*/
-        if(sortedItems[nextIndex]->endIndex() < minEndFramePos)
-        {
-          if(sortedItems[nextIndex]->beginIndex() > intervalStartPosition)     //whole item is 'inside', its begin delimits
-          {                                                                 //this section's end
-            minEndFramePos = sortedItems[nextIndex]->beginIndex() - 1;
-            break;
-          }
-          else                //we've already fully included this
-          {                   //animation in blending
-            nextIndex++;
-            continue;
-          }
-        }
-        if(sortedItems[nextIndex]->beginIndex() <= minEndFramePos)          //item's begin index delimits
-        {                                                                   //the section (will be processed
-          minEndFramePos = sortedItems[nextIndex]->beginIndex() - 1;        //in next section pass)
-          break;
-        }
-      }
-      intervalEndPosition = minEndFramePos;
-    }
-    else                                      //no items in this section = we have an empty gap!
-    {
-      int itemIndex = findFirstItemAfter(sortedItems, intervalStartPosition);
-      intervalEndPosition = sortedItems.at(itemIndex)->beginIndex() - 1;
-    }
-
+    if(intervalStartPosition > toPosition)
+      break;                              //rest is out of requested range
+    if(intervalEndPosition < fromPosition)
+      continue;
 
     //THE BLENDING ITSELF
     if(itemsInInterval.isEmpty())         //we need to fill the gap
     {
+      lastBlended = intervalEndPosition;
       int toFrame = intervalEndPosition - frameOffset;
       BVHNode* position = result->getNode(0);
       copyKeyFrame(position, intervalStartPosition-frameOffset-1, toFrame);
       BVHNode* root = result->getMotion();
       copyKeyFrame(root, intervalStartPosition-frameOffset-1, toFrame);
 
-      if(Settings::Instance()->Debug())
+      TrailItem* previousItem = sweep.lastEndedItem();
+      if(Settings::Instance()->Debug() && previousItem != NULL)
       {
-        //NOTE: This is actually a very dirty trick. The shadow is filled with default T-pose. It's only purpose
-        //      is to show rectangle on time-line, so that I know that something is happening (and can check weights).
-        TrailItem* previousItem = findLastItemBefore(sortedItems, intervalStartPosition);
-        WeightedAnimation* gapFillShadow = new WeightedAnimation(new BVH(), "");
-        gapFillShadow->setNumberOfFrames(intervalEndPosition - intervalStartPosition + 1);
-        //copy frame weight of previous item's last frame
-        int w = previousItem->getAnimation()->getFrameWeight(previousItem->frames()-1);
-        for(int i=0; i<gapFillShadow->getNumberOfFrames(); i++)
-          gapFillShadow->setFrameWeight(i, w);
-
-        TrailItem* gapItem = new TrailItem(gapFillShadow, "gap fill shadow after:" +previousItem->name(),
-                                           intervalStartPosition, true);
+        //NOTE: This is actually a very dirty trick. The shadow is never blended. It's only purpose is to show
+        //      rectangle on time-line, so that I know that something is happening (and can check weights).
+        //      It holds the last posture and frame weight of previous item.
+        WeightedAnimation* previousAnim = previousItem->getAnimation();
+        int lastFrame = previousAnim->getNumberOfFrames()-1;
+        ShadowPosture posture = shadowPosture(previousAnim, lastFrame, previousAnim, lastFrame,
+                                              previousAnim->getFrameWeight(lastFrame), 0, 0);
+        TrailItem* gapItem = new TrailItem(posture, "gap fill shadow after:" +previousItem->name(),
+                                           intervalStartPosition, intervalEndPosition - intervalStartPosition + 1);
         if(previousItem->nextItem() != NULL)
         {
           gapItem->setNextItem(previousItem->nextItem());
@@ -774,312 +876,15 @@ void Blender::blend(QList<TrailItem*> sortedItems, WeightedAnimation* result, in
     }
     else
     {
-      combineKeyFrames(sortedItems, itemsInInterval, intervalStartPosition, intervalEndPosition, result,
-                       intervalStartPosition-frameOffset);
+      int blendFrom = intervalStartPosition > fromPosition ? intervalStartPosition : fromPosition;
+      int blendTo = intervalEndPosition < toPosition ? intervalEndPosition : toPosition;
+      graph->render(blendFrom, blendTo, blendFrom-frameOffset);
+      lastBlended = blendTo;
     }
 
   }//while
-}
-
-
-/** The very core method of blending functionality. Combines postures into resulting animation.
-    @param sortedItems - list of all TrailItems to be blended
-    @param itemIndices - indices to the first list argument denoting the animations to be blended here
-    @param fromPosition - frame position number on time-line where to start blending
-    @param toPosition - last position
-    @param target - resulting animation to host mixed postures
-    @param targetFrame - first frame for result posture in the target animation **/
-void Blender::combineKeyFrames(QList<TrailItem*> sortedItems, QList<int> itemIndices, int fromPosition,
-                               int toPosition, WeightedAnimation* target, int targetFrame)
-{
-  if(itemIndices.size() < 1)
-  {
-    QString text = "Argument exception: no animation indices given to be combined.";
-    if(Settings::Instance()->Debug())
-      Announcer::Exception(NULL, text);
-    return;
-//      QMessageBox::warning(NULL, "Exception", text);
-//    throw new QString(text);
-  }
-
-  int timeLineFrame = fromPosition;
-
-  while(timeLineFrame <= toPosition)
-  {
-    BVHNode* position = target->getNode(0);
-    combineKeyFramesHelper(sortedItems, itemIndices, position, timeLineFrame, target, targetFrame);
-
-    BVHNode* root = target->getMotion();
-    combineKeyFramesHelper(sortedItems, itemIndices, root, timeLineFrame, target, targetFrame);
-
-    timeLineFrame++;
-    targetFrame++;
-  }//while
-}
-
-
-void Blender::combineKeyFramesHelper(QList<TrailItem*> sortedItems, QList<int> itemIndices, BVHNode* limb,
-                                     int timeLineFrame, WeightedAnimation* target, int targetFrame)
-{
-  int partIndex = target->getPartIndex(limb);
-  Position resultPos;
-  Rotation resultRot;
-
-  if(partIndex==0)              //position pseudo-node
-  {
-    if(targetFrame==0)          //very beginning of overal blend
-    {
-      Position sumPos(0.0, 0.0, 0.0);
-      int sumWeights = 0;
-
-      int count = itemIndices.size();
-      for(int i=0; i<count; i++)
-      {
-        TrailItem* currentItem = sortedItems[itemIndices[i]];
-        int currentFrame = timeLineFrame - currentItem->beginIndex();         //Well, this must be zero.
-        BVHNode* node = currentItem->getAnimation()->getNode(partIndex);      //And this position.
-        FrameData data = node->frameData(currentFrame);
-        int frameW = currentItem->isShadow() ? 0
-                                             : currentItem->getWeight(currentFrame);        //No difference between MI/MO and gap shadows. BUG? TODO
-        int limbW = data.weight();
-
-        sumWeights += frameW*limbW;
-        Position tempPos = data.position();
-        if(count==1 && sumWeights==0)             //no time for efficient solutions
-        {
-          sumWeights = 53;
-          tempPos.Multiply(53.0);
-        }
-        else
-          tempPos.Multiply((double)(frameW*limbW));
-        sumPos.Add(tempPos);
-      }
-
-      if(sumWeights == 0)           //zero weights
-        sumWeights = count;
-
-      resultPos.x = sumPos.x/sumWeights;
-      resultPos.y = sumPos.y/sumWeights;
-      resultPos.z = sumPos.z/sumWeights;
-    }
-    else                //TODO: in case of single item in interval, lot of vain computation is done. Consider IF branch for it.
-    {
-      double sumY = 0.0;
-      double clearSumY = 0.0;             //just for the case all weights are 0
-      double sumDistance = 0.0;
-      double clearSumDistance = 0.0;
-      double sumBearing = 0.0;
-      double clearSumBearing = 0.0;
-      int sumWeightsY = 0;
-      int sumWeightsXZ = 0;
-      int positionsUsed = 0;
-      double lastSavedBearing;
-
-      for(int x=0; x<itemIndices.size(); x++)
-      {
-        TrailItem* currentItem = sortedItems[itemIndices[x]];
-        int currentFrame = timeLineFrame - currentItem->beginIndex();
-        int frameW = currentItem->isShadow() ? 0
-                                               : currentItem->getWeight(currentFrame);
-
-        if(currentFrame==0)                       //This item has just joined blending. As there's no previous
-        {                                         //frame to have difference with, it wouldn't change anything
-          FrameData data = currentItem->getAnimation()->getNode(partIndex)->frameData(currentFrame);
-          Position temp = data.position();
-          int limbW = data.weight();
-          sumWeightsY += frameW*limbW;
-          sumWeightsXZ += frameW*limbW;            //for case other inputs have zero weight at this place
-          temp.Add(currentItem->getAnimation()->getOffset());
-          clearSumY += temp.y;
-          temp.Multiply((double)(frameW*limbW));          //actually only Y makes sense to be multiplied
-          sumY += temp.y;
-
-          //just for the case this item is the only one in interval
-          Position prevTargetPos = target->getNode(0)->frameData(targetFrame-1).position();
-          resultPos.x = prevTargetPos.x;
-          resultPos.z = prevTargetPos.z;
-        }
-        else
-        {
-          positionsUsed++;
-          BVHNode* positNode = currentItem->getAnimation()->getNode(partIndex);
-
-          //TODO: one great IF for equal positions (distance = bearing = 0.0;)
-
-          Position p1 = positNode->frameData(currentFrame-1).position();
-          p1.Add(currentItem->getAnimation()->getOffset());
-
-          FrameData data = positNode->frameData(currentFrame);
-          Position p2 = data.position();
-          int limbW = data.weight();
-          p2.Add(currentItem->getAnimation()->getOffset());
-
-          sumWeightsXZ += frameW*limbW;
-          sumWeightsY += frameW*limbW;
-          clearSumY += p2.y;
-          sumY += p2.y * frameW*limbW;
-          double distance;
-          double bearing;
-
-          double cPower2 = (p2.x-p1.x)*(p2.x-p1.x) + (p2.z-p1.z)*(p2.z-p1.z);   //pythagorean theorem
-          distance = sqrt(cPower2);
-          clearSumDistance += distance;
-          sumDistance += distance*frameW*limbW;
-
-          double sinPhi = absolut(p2.x - p1.x) / distance;
-
-          double angle = asin(sinPhi) * 180.0 / PI;
-
-          if(p2.x == p1.x && p2.z >= p1.z)                //No position change or move straight forward
-            bearing = 0.0;
-          else if(p2.x >= p1.x && p2.z > p1.z)            //Latter position in quarter 4 comparing to previous
-            bearing = angle;
-          else if(p2.x > p1.x && p2.z <= p1.z)            //quarter 3
-            bearing = 180.0 - angle;
-          else if(p2.x == p1.x && p2.z < p1.z)            //between quarters 2 and 3 (move backward)
-            bearing = 180.0;
-          else if(p2.x < p1.x && p2.z == p1.z)            //between Q1 and Q2 (move right)
-            bearing = -90.0;
-          else if(p2.x < p1.x && p2.z < p1.z)             //Q2
-            bearing = -180.0 + angle;
-          else if(p2.x < p1.x && p2.z > p1.z)             //Q1
-            bearing = -1 * angle;
-
-          else { Announcer::Exception(NULL, "Invalid value exception: can't evaluate bearing"); return; }
-
-/*VERY, VERY NASTY BUG. THINK OF KOVAR.
-          if(x > 0 && absolut(lastSavedBearing-bearing) > 180.0)      //this is to ensure that the resulting
-          {                                                           //direction is 'squeezed' between partial,
-            if(bearing>lastSavedBearing) bearing+=360.0;              //(inside acute angle, not outer)
-            else bearing-=360.0;
-          }
-          lastSavedBearing = bearing;
-*/
-          clearSumBearing += bearing;
-          sumBearing += bearing*frameW*limbW;
-        }
-      }
-
-      if(positionsUsed > 0)
-      {
-        if(clearSumBearing == 180.0 && positionsUsed>1)                      //Dirty workaround when back and forth
-          sumBearing = 0.0;                               //moves are blended
-
-        if(sumDistance == 0.0)
-          sumDistance = clearSumDistance;
-        if(sumBearing == 0.0)
-          sumBearing = clearSumBearing;
-        if(sumWeightsXZ == 0)                             //Houdini
-          sumWeightsXZ = positionsUsed;
-
-
-        Position prevTargetPos = target->getNode(0)->frameData(targetFrame-1).position();
-        //calculate Position (only X and Z coordinates) from given start point,
-        //distance and bearing (asimuth towards Z axis).
-        resultPos.x = prevTargetPos.x + sumDistance/sumWeightsXZ * sin(sumBearing/sumWeightsXZ * PI/180.0);
-        resultPos.z = prevTargetPos.z + sumDistance/sumWeightsXZ * cos(sumBearing/sumWeightsXZ * PI/180.0);
-      }
-
-      if(sumWeightsY == 0)
-        resultPos.y = clearSumY / itemIndices.size();
-      else
-        resultPos.y = sumY/sumWeightsY;
-    }
-  }
-  else        //other nodes, only rotation is interesting
-  {
-    int sumWeights = 0;
-    Rotation sumRot(0.0, 0.0, 0.0);
-    Rotation clearSumRot(0.0, 0.0, 0.0);
-
-
-    double lastSavedRootRotY;
-
-
-    int count = itemIndices.size();
-    for(int i=0; i<count; i++)
-    {
-      TrailItem* currentItem = sortedItems.at(itemIndices[i]);
-      int currentFrame = timeLineFrame - currentItem->beginIndex();
-      BVHNode* node = currentItem->getAnimation()->getNode(partIndex);
-      FrameData data = node->frameData(currentFrame);
-      int frameW = currentItem->getWeight(currentFrame);
-      int limbW = data.weight();
-      sumWeights += frameW*limbW;
-      Rotation temp = data.rotation();
-
-      //This is to ensure that root orientation is always insied acute angle of partial orientations
-/*DEBUG      if(node->type == BVH_ROOT && i>0 && absolut(temp.y - lastSavedRootRotY)>180.0)
-      {
-        if(temp.y>lastSavedRootRotY) temp.y+=360.0;
-        else temp.y-=360.0;
-      }
-      lastSavedRootRotY = temp.y;
-*/
-      clearSumRot.Add(temp);
-      temp.Multiply((double)(frameW*limbW));
-      sumRot.Add(temp);
-    }
-
-    if(sumWeights == 0)
-    {
-      resultRot.x = clearSumRot.x/count;
-      resultRot.y = clearSumRot.y/count;
-      resultRot.z = clearSumRot.z/count;
-    }
-    else
-    {
-      resultRot.x = sumRot.x/sumWeights;
-      resultRot.y = sumRot.y/sumWeights;
-      resultRot.z = sumRot.z/sumWeights;
-    }
-  }
-
-  limb->addKeyframe(targetFrame, resultPos, resultRot);
-
-  for(int x=0; x<limb->numChildren(); x++)
-    combineKeyFramesHelper(sortedItems, itemIndices, limb->child(x), timeLineFrame, target, targetFrame);
-}
-
-
-/** Finds first TrailItem that begins after given time-line position. Returns its index in containing
-    list (also given as argument) **/
-int Blender::findFirstItemAfter(QList<TrailItem*> sortedItems, int afterPosition)
-{
-  int min = 999999999;
-  int result = -1;
-
-  for(int i=0; i < sortedItems.size(); i++)
-  {
-    if(sortedItems[i]->beginIndex() > afterPosition && sortedItems[i]->beginIndex() < min)
-    {
-      min = sortedItems[i]->beginIndex();
-      result = i;
-    }
-  }
 
-  return result;
-}
-
-
-/** Finds last non-shadow TrailItem that ends before given time-line position.
-    Returns reference to the item. **/
-TrailItem* Blender::findLastItemBefore(QList<TrailItem*> sortedItems, int beforePosition)
-{
-  int max = -999999999;
-  int result = -1;
-
-  for(int i=0; i < sortedItems.size(); i++)
-  {
-    if(!sortedItems[i]->isShadow() && sortedItems[i]->endIndex() < beforePosition &&
-       sortedItems[i]->endIndex() > max)
-    {
-      max = sortedItems[i]->beginIndex();
-      result = i;
-    }
-  }
-
-  return sortedItems[result];
+  return lastBlended;
 }
 
 
@@ -1094,3 +899,20 @@ void Blender::copyKeyFrame(BVHNode* limb, int fromFrame, int toFrame)
   for(int i=0; i<limb->numChildren(); i++)
     copyKeyFrame(limb->child(i), fromFrame, toFrame);
 }
+
+
+/** Moves X and Z of all position key frames after given frame by given offset */
+void Blender::shiftPositionsAfter(BVHNode* position, int frame, double deltaX, double deltaZ)
+{
+  QList<int> keys = position->keyframeList();
+  foreach(int key, keys)
+  {
+    if(key <= frame)
+      continue;
+
+    Position pos = position->frameData(key).position();
+    pos.x += deltaX;
+    pos.z += deltaZ;
+    position->setKeyframePosition(key, pos);
+  }
+}
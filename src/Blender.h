@@ -1,14 +1,48 @@
 #ifndef BLENDER_H
 #define BLENDER_H
 
+#include <QHash>
 #include <QList>
+#include <QMultiHash>
+#include <QPair>
+#include <QStringList>
+#include <QVector>
 #include "rotation.h"
 
+class BlendGraph;
 class BVHNode;
 class TimelineTrail;
 class TrailItem;
 class WeightedAnimation;
 
+
+/** Pair of animations a time warp was computed for. Two items overlap in one place only, so just
+    the warp of their latest overlap is kept. */
+struct TimeWarpKey
+{
+  WeightedAnimation* reference;
+  WeightedAnimation* warped;
+
+  bool operator==(const TimeWarpKey& other) const
+  {
+    return reference==other.reference && warped==other.warped;
+  }
+};
+
+inline uint qHash(const TimeWarpKey& key)
+{
+  return qHash(key.reference) ^ (qHash(key.warped) << 1);
+}
+
+/** Frames of the warped animation matched to each frame of the overlap */
+struct TimeWarp
+{
+  int referenceFrame;             //first overlapping frame of each animation
+  int warpedFrame;
+  int length;
+  QVector<int> frames;
+};
+
 class Blender
 {
 public:
@@ -19,23 +53,64 @@ public:
   WeightedAnimation* GetResultingAnimation();           //edu: pfuuh, rubish
 
   /*! Passes through time-line and for every item, frame and limb evaluates its relative weight compared
-      to limb weights of frame it'll blend with. This method must be called befor BlendTrails. !*/              //TODO: it should be called as first in BlendTrails
-  void EvaluateRelativeLimbWeights(QList<TimelineTrail*>* trails, int trailsCount);
+      to limb weights of frame it'll blend with. Results are kept by the items' animations
+      (WeightedAnimation::getRelativeWeight). This method must be called befor BlendTrails. !*/              //TODO: it should be called as first in BlendTrails
+  void EvaluateRelativeLimbWeights(QList<TimelineTrail*>* trails, int trailsCount,
+                                   int fromPosition=0, int toPosition=999999999);
 
   /*! Blends together weighted animations of given TrailItems.
       @param trails array of pointers to first TrailItem in linked list.
       @param trailsCount number of pointers passed in the first argument. !*/
   WeightedAnimation* BlendTrails(TrailItem** trails, int trailsCount);
 
+  /*! First step of BlendTrails. Lines up items of given trails, adds the mix-in/-out shadow items
+      and returns all of them sorted by begin index. The shadows belong to the Blender and live until
+      the next PrepareTrails or ReblendItem call. !*/
+  QList<TrailItem*> PrepareTrails(TrailItem** trails, int trailsCount);
+  /*! Second step of BlendTrails. Creates animation long enough to host blend of given items.
+      If there's only one item, its animation is just copied. !*/
+  WeightedAnimation* CreateResultingAnimation(QList<TrailItem*> sortedItems);
+  /*! Last step of BlendTrails. Blends time-line positions from the given range into @param target.
+      The position before the range must already be blended. Returns position of last blended frame. !*/
+  int BlendRange(QList<TrailItem*> sortedItems, WeightedAnimation* target, int fromPosition, int toPosition);
+
+  /*! Re-blends only the time-line positions affected by a change of weights or mix zones of given item
+      and writes them into @param result, the animation made by last BlendTrails call. Returns FALSE
+      if the time-line layout has changed since (or in DEBUG mode) and BlendTrails must be used instead. !*/
+  bool ReblendItem(QList<TimelineTrail*>* trails, int trailsCount, TrailItem* changedItem,
+                   WeightedAnimation* result);
+
 private:
+  //time-line layout at last BlendTrails, to recognize edits that don't move anything
+  QList<TrailItem*> blendedItems;
+  QList<int> blendedBegins;
+  QList<int> blendedEnds;
+  int blendedFirstPosition;
+  //time-line spans of mix-in/-out shadows, under both items they were made from
+  QMultiHash<TrailItem*, QPair<int, int> > shadowSpans;
+  //shadows made by last PrepareTrails or ReblendItem that aren't linked into trails, owned
+  QList<TrailItem*> unlinkedShadows;
+  //frames of the later of two overlapping animations matched to each frame of the earlier one,
+  //replaced when the overlap changes
+  QHash<TimeWarpKey, TimeWarp> timeWarps;
+  //the time-line as a blend graph, with the items and time warp setting it was made for
+  BlendGraph* graph;
+  QList<TrailItem*> graphItems;
+  bool graphWarping;
+
+  void rememberLayout(QList<TrailItem*> items);
+  bool isSameLayout(QList<TrailItem*> items);
+  void rememberShadowSpan(TrailItem* shadow, TrailItem* item1, TrailItem* item2);
+  void releaseShadows();
+  QVector<BVHNode*> findLimbs(WeightedAnimation* anim, const QStringList& boneNames);
+  QVector<int> timeWarp(TrailItem* reference, TrailItem* item, int& warpBegin);
+  void forgetTimeWarps(QList<TrailItem*> items);
+  void updateGraph(QList<TrailItem*> sortedItems, WeightedAnimation* target, int lastFrameIndex);
+
   QList<TrailItem*> lineUpTimelineTrails(TrailItem** trails, int trailsCount);
   void clearShadowItems(TrailItem* firstItem);
   QList<TrailItem*> createMixInsImpliedShadowItems(QList<TrailItem*> items);
   QList<TrailItem*> createMixOutsImpliedShadowItems(QList<TrailItem*> items);
-  void interpolatePosture(WeightedAnimation* anim1, int frame1, WeightedAnimation* anim2, int frame2,
-                          WeightedAnimation* targetAnim);
-  void interpolatePostureHelper(WeightedAnimation* anim1, int frame1, WeightedAnimation* anim2, int frame2,
-                                int nodeIndex, WeightedAnimation* targetAnim);
   QList<TrailItem*> mergeAndSortItemsByBeginIndex(QList<TrailItem*> realItems,
                                                   QList<TrailItem*> mixInItems,
                                                   QList<TrailItem*> mixOutItems);
@@ -43,16 +118,11 @@ private:
   void cloneAnimationHelper(int limbIndex, WeightedAnimation* fromAnim, WeightedAnimation * toAnim);
 
   int findHighestEndIndex(QList<TrailItem*> items);
-  void blend(QList<TrailItem*> sortedItems, WeightedAnimation* result, int lastFrameIndex);
-
-  void combineKeyFrames(QList<TrailItem*> sortedItems, QList<int> itemIndices, int fromTimeLineFrame,
-                        int sectionLength, WeightedAnimation* target, int targetFrame);
-  void combineKeyFramesHelper(QList<TrailItem*> sortedItems, QList<int> itemIndices, BVHNode* limb,
-                              int timeLineFrame, WeightedAnimation* target, int targetFrame);
+  int blend(QList<TrailItem*> sortedItems, WeightedAnimation* result, int lastFrameIndex,
+            int fromPosition, int toPosition);
 
-  int findFirstItemAfter(QList<TrailItem*> sortedItems, int afterPosition);
-  TrailItem* findLastItemBefore(QList<TrailItem*> sortedItems, int beforePosition);
   void copyKeyFrame(BVHNode* limb, int fromFrame, int toFrame);
+  void shiftPositionsAfter(BVHNode* position, int frame, double deltaX, double deltaZ);
 
   double static absolut(double val) { return val>0.0 ? val : (-1 * val); }
 };
@@ -47,6 +47,8 @@ BlenderTab::BlenderTab(qavimator* mainWindow, const QString& fileName, bool crea
           blenderPlayer, SLOT(onAnimationChanged(WeightedAnimation*)));
   connect(blenderTimeline, SIGNAL(resultingAnimationChanged(WeightedAnimation*)),
           this, SLOT(onTimelineAnimationChanged(WeightedAnimation*)));
+  connect(blenderTimeline, SIGNAL(resultingAnimationUpdated()), this, SLOT(onTimelineAnimationUpdated()));
+  connect(blenderTimeline, SIGNAL(resultingAnimationBlended(int)), this, SLOT(onTimelineAnimationBlended(int)));
   connect(blenderTimeline, SIGNAL(timelinePositionChanged()), this, SLOT(onTimelinePositionChanged()));
   connect(blenderTimeline, SIGNAL(selectedItemChanged()),
           this, SLOT(onSelectedItemChanged()));
@@ -77,6 +79,8 @@ BlenderTab::~BlenderTab()
   delete widget_2;
   delete blenderPlayer;
   delete blenderTimeline;
+  foreach(LoadedClip loaded, loadedClips)
+    delete loaded.clip;
 }
 
 
@@ -154,8 +158,13 @@ void BlenderTab::UpdateMenu()
 
   mainWindow->toolsOptimizeBVHAction->setEnabled(false);
   mainWindow->toolsMirrorAction->setEnabled(false);
+  mainWindow->toolsBakeIKAction->setEnabled(false);
+  mainWindow->toolsFindLoopAction->setEnabled(false);
+  mainWindow->toolsResampleAction->setEnabled(false);
+  mainWindow->toolsSmoothAction->setEnabled(false);
 
   mainWindow->optionsJointLimitsAction->setEnabled(false);
+  mainWindow->optionsJacobianIKAction->setEnabled(false);
   mainWindow->optionsLoopAction->setEnabled(!blenderTimeline->isClear());
   mainWindow->optionsProtectFirstFrameAction->setEnabled(false);
   mainWindow->optionsShowTimelineAction->setEnabled(false);
@@ -381,6 +390,7 @@ void BlenderTab::fileExportForSecondLife()
     qDebug("BlenderTab::fileExportForSecondLife(): exporting animation as '%s'.", exportName.toLatin1().constData());
     if(!exportName.endsWith(".bvh", Qt::CaseInsensitive))
       exportName += ".bvh";
+    blenderTimeline->FinishBlending();
     blenderAnimationView->getAnimation()->saveBVH(exportName);
   }
 }
@@ -417,30 +427,55 @@ void BlenderTab::adjustSelectedLimbsWeight(QList<int>* jointNumbers)
 
     blenderTimeline->HideLimsForm();
     LimbsWeightDialog* lwd = new LimbsWeightDialog(selectedItem->name(), &limbList, selectedItem->selectedFrame(),
-                                                   selectedItem->frames(), this);
+                                                   selectedItem->getAnimation()->getNumberOfFrames(), this);
     connect(lwd, SIGNAL(nextFrame()), this, SLOT(onLimbsDialogNextFrame()));
     connect(lwd, SIGNAL(previousFrame()), this, SLOT(onLimbsDialogPreviousFrame()));
+    blenderTimeline->PrepareItemChange();       //the dialog writes the weights when accepted
     if(lwd->exec() == QDialog::Accepted)
     {
       isDirty = true;
       setCurrentFile(CurrentFile);      //asterisk
       blenderTimeline->RebuildResultingAnimation();
     }
+    else
+      blenderTimeline->ResumeBlending();
     lwd->disconnect();
     delete lwd;
   }
 }
 
+/** New clip of the animation file @param filename. A file loaded before (and not changed since) isn't
+    parsed again, the clip is a copy of the loaded one sharing its key frames until they get edited. */
+WeightedAnimation* BlenderTab::loadClip(const QString& filename)
+{
+  QDateTime modified = QFileInfo(filename).lastModified();
+  if(loadedClips.contains(filename))
+  {
+    LoadedClip loaded = loadedClips.value(filename);
+    if(loaded.modified == modified)
+      return new WeightedAnimation(blenderAnimationView->getBVH(), loaded.clip);
+    delete loaded.clip;
+  }
+
+  LoadedClip loaded;
+  loaded.clip = new WeightedAnimation(blenderAnimationView->getBVH(), filename);
+  loaded.modified = modified;
+  loadedClips.insert(filename, loaded);
+  return new WeightedAnimation(blenderAnimationView->getBVH(), loaded.clip);
+}
+
 // ------- Autoconnection slots of UI elements -------- //
 
 void BlenderTab::on_animsList_AnimationFileTaken(QString filename, int orderInBatch, int batchSize)
 {
-  WeightedAnimation* anim = new WeightedAnimation(blenderAnimationView->getBVH(), filename);
+  WeightedAnimation* anim = loadClip(filename);
   if(anim->isFirstFrameTPose())
     canShowWarn = true;
 
   if(blenderTimeline->isClear() && orderInBatch==1)       //Adding first animation to empty time-line, so
     framesPerSecond = anim->fps();                        //adopt its FPS for all next blended outputs
+  else if(framesPerSecond > 1 && anim->fps() != framesPerSecond)
+    anim->resample(framesPerSecond);                      //otherwise it would play faster or slower in the blend
 
   QFileInfo fInfo(filename);
   if(!blenderTimeline->AddAnimation(anim, fInfo.completeBaseName()))
@@ -501,6 +536,20 @@ void BlenderTab::onTimelineAnimationChanged(WeightedAnimation* anim)
   UpdateMenu();                   //ex. export action
 }
 
+void BlenderTab::onTimelineAnimationUpdated()
+{
+  isDirty = true;
+  setCurrentFile(CurrentFile);    //update asterisk
+  blenderAnimationView->repaint();
+}
+
+//Background blending has done another part of resulting animation. Let the player go that far.
+void BlenderTab::onTimelineAnimationBlended(int lastFrame)
+{
+  blenderPlayer->setLastFrame(lastFrame);
+  blenderAnimationView->repaint();
+}
+
 /** There might be settings that affect the way the resulting animation is built.
     So it must be reevaluated after changes in settings. Only known so far is switching DEBUG mode on/off. */
 void BlenderTab::onConfigChanged()
@@ -579,10 +628,10 @@ void BlenderTab::onTimelinePositionChanged()
 void BlenderTab::highlightLimbsByWeight()
 {
   TrailItem* selItem = blenderTimeline->getSelectedItem();
-  if(selItem != NULL)
+  if(selItem != NULL && !selItem->isShadow())
   {
     QMap<QString, double>* limbRelWeights = new QMap<QString, double>();
-    int frame = selItem->selectedFrame();
+    int position = selItem->selectedPosition();       //relative weights are kept by positions
 //    QList<BVHNode*> nodes = selItem->getAnimation()->bones()->values();
     //DEBUG. And very ugly. It traverses through skeleton over and over many times. TODO: REALLY NEED SOME LINEAR HELPER BONE STORAGE
     QList<QString> nodeNames = selItem->getAnimation()->bones()->keys();
@@ -591,9 +640,9 @@ void BlenderTab::highlightLimbsByWeight()
       WeightedAnimation* debug = selItem->getAnimation();
       BVHNode* node = debug->getNodeByName(name);
 
-      FrameData xxxData = node->frameData(frame);
-
-      double relW = xxxData.relativeWeight();
+      double relW = debug->getRelativeWeight(position, node);
+      if(relW < 0.0)                  //not a bone, e.g. position pseudo-node
+        continue;
       QString debugName = node->name();
       limbRelWeights->insert(debugName, relW);
     }
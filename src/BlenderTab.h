@@ -1,6 +1,8 @@
 #ifndef BLENDERTAB_H
 #define BLENDERTAB_H
 
+#include <QDateTime>
+#include <QHash>
 #include <QWidget>
 #include "ui_blendertab.h"
 #include "abstractdocumenttab.h"
@@ -44,6 +46,8 @@ class BlenderTab : public QWidget, public Ui::BlenderTab, public AbstractDocumen
     virtual void onTabActivated();
     virtual void onTabDeactivated();
     void onTimelineAnimationChanged(WeightedAnimation* anim);
+    void onTimelineAnimationUpdated();
+    void onTimelineAnimationBlended(int lastFrame);
 
   protected:
     // prevent closing of main window if there are unsaved changes
@@ -82,6 +86,17 @@ class BlenderTab : public QWidget, public Ui::BlenderTab, public AbstractDocumen
     /** TRUE for unsaved content */
     bool isDirty;
     void adjustSelectedLimbsWeight(QList<int>* jointNumbers);
+
+    /** Clip as loaded from a file, never placed on the time-line */
+    struct LoadedClip
+    {
+      WeightedAnimation* clip;
+      QDateTime modified;
+    };
+    /** Clips loaded so far by file name. Each item added from a file gets a copy of its clip
+        sharing the key frames, so a file placed more times is parsed and held in memory once. */
+    QHash<QString, LoadedClip> loadedClips;
+    WeightedAnimation* loadClip(const QString& filename);
     void highlightLimbsByWeight();
 
     /////////////edu: DEBUG /////////////
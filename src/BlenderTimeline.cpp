@@ -3,16 +3,26 @@
 */
 #define BLENDING_TRACKS      3
 #define MIN_TRAIL_FRAMES     150  //edu: trail is 150 positions long
+#define LAZY_PREFETCH_FRAMES 30   //frames blended ahead of the one requested in lazy blending
 
+#include <QApplication>
+#include <QDir>
+#include <QFileDialog>
+#include <QFileInfo>
 #include <QHBoxLayout>
 #include <QKeyEvent>
+#include <QMessageBox>
 #include <QScrollArea>
 #include "blender.h"
 #include "blendertimeline.h"
+#include "blendworker.h"
 #include "noarrowsscrollarea.h"
+#include "posedistance.h"
+#include "poseindex.h"
 #include "timelinetrail.h"
 #include "trailitem.cpp"
 #include "limbsweightform.h"
+#include "settings.h"
 
 
 
@@ -20,6 +30,11 @@ BlenderTimeline::BlenderTimeline(QWidget* parent, Qt::WindowFlags) : QFrame(pare
 {
   trailFramesCount = MIN_TRAIL_FRAMES;
   resultAnimation = NULL;
+  blender = new Blender();
+  worker = NULL;
+  blendingInterrupted = false;
+  lazyBlendedPosition = -1;
+  poseIndex = NULL;
 
   scrollArea = new NoArrowsScrollArea(this);
   scrollArea->setBackgroundRole(QPalette::Dark);
@@ -45,6 +60,11 @@ BlenderTimeline::BlenderTimeline(QWidget* parent, Qt::WindowFlags) : QFrame(pare
     connect(tt, SIGNAL(adjustLimbsWeight(/*TODO: frameData*/)), this, SLOT(showLimbsWeightForm(/*TODO: frameData*/)));
     connect(tt, SIGNAL(positionsCountChanged(int)), this, SLOT(setFramesCount(int)));
     connect(tt, SIGNAL(trailContentChanged(TrailItem*)), this, SLOT(onTrailContentChanged()));
+    connect(tt, SIGNAL(itemContentChanging(TrailItem*)), this, SLOT(onItemContentChanging()));
+    connect(tt, SIGNAL(itemContentKept(TrailItem*)), this, SLOT(onItemContentKept()));
+    connect(tt, SIGNAL(itemContentChanged(TrailItem*)), this, SLOT(onItemContentChanged(TrailItem*)));
+    connect(tt, SIGNAL(transitionWanted(TrailItem*)), this, SLOT(onTransitionWanted(TrailItem*)));
+    connect(tt, SIGNAL(similarPosesWanted(TrailItem*)), this, SLOT(onSimilarPosesWanted(TrailItem*)));
 
     trails.append(tt);
     scrollLayout->addWidget(tt);
@@ -58,7 +78,8 @@ BlenderTimeline::BlenderTimeline(QWidget* parent, Qt::WindowFlags) : QFrame(pare
   needsReshape = true;
 
   limbsForm = new LimbsWeightForm(this);
-  connect(limbsForm, SIGNAL(valueChanged()), this, SLOT(onTrailContentChanged()));
+  connect(limbsForm, SIGNAL(valueChanging()), this, SLOT(onItemContentChanging()));
+  connect(limbsForm, SIGNAL(valueChanged()), this, SLOT(onLimbsWeightChanged()));
 
   QHBoxLayout* layout=new QHBoxLayout(this);
   layout->setMargin(0);
@@ -69,8 +90,11 @@ BlenderTimeline::BlenderTimeline(QWidget* parent, Qt::WindowFlags) : QFrame(pare
 
 BlenderTimeline::~BlenderTimeline()
 {
+  stopBlending();
   while (!trails.isEmpty())           //delete trails one by one
     delete trails.takeFirst();
+  delete blender;
+  delete poseIndex;
 }
 
 bool BlenderTimeline::AddAnimation(WeightedAnimation* anim, QString title)
@@ -120,6 +144,9 @@ void BlenderTimeline::RebuildResultingAnimation(bool emiting)
 {
   int oldPosition = 0;            //old selected frame on this time-line
 
+  stopBlending();                 //items are about to change under its hands
+  blendingInterrupted = false;
+
   if(!isClear())
   {
     int count = trails.size();
@@ -138,7 +165,6 @@ void BlenderTimeline::RebuildResultingAnimation(bool emiting)
     if(resultAnimation)
       disconnect(resultAnimation, SIGNAL(currentFrame(int)), 0, 0);     //edu: is this needed?
 
-    Blender* blender = new Blender();
     blender->EvaluateRelativeLimbWeights(&trails, count);
     WeightedAnimation* old = resultAnimation;
     if(old != NULL)
@@ -146,9 +172,30 @@ void BlenderTimeline::RebuildResultingAnimation(bool emiting)
       oldPosition = animationBeginPosition+old->getFrame();
       delete old;
     }
-    resultAnimation = blender->BlendTrails(rails, count);
+    QList<TrailItem*> items = blender->PrepareTrails(rails, count);
+    delete [] rails;
+    resultAnimation = blender->CreateResultingAnimation(items);
 
-    delete blender;
+    if(items.size() > 1)
+    {
+      //In DEBUG mode the gap shadows are linked into trails while blending, so keep it on this thread
+      if(Settings::Instance()->Debug())
+        blender->BlendRange(items, resultAnimation, animationBeginPosition, 999999999);
+      else if(Settings::Instance()->lazyBlending())
+      {
+        //frames get blended when asked for, see blendLazilyUpTo()
+        lazyItems = items;
+        lazyBlendedPosition = animationBeginPosition-1;
+        blendLazilyUpTo(qMax(0, oldPosition-animationBeginPosition));
+      }
+      else
+      {
+        worker = new BlendWorker(items, resultAnimation->getNumberOfFrames(), blender, this);
+        connect(worker, SIGNAL(framesBlended(int)), this, SLOT(onFramesBlended(int)));
+        connect(worker, SIGNAL(finished()), this, SLOT(onBlendingFinished()));
+        worker->start();
+      }
+    }
 
     if(resultAnimation != NULL)         //else an exception has been thrown
       connect(resultAnimation, SIGNAL(currentFrame(int)), this, SLOT(onPlayFrameChanged(int)));
@@ -161,6 +208,37 @@ void BlenderTimeline::RebuildResultingAnimation(bool emiting)
 }
 
 
+void BlenderTimeline::FinishBlending()
+{
+  if(resultAnimation != NULL && !lazyItems.isEmpty())
+    blendLazilyUpTo(resultAnimation->getNumberOfFrames()-1);
+
+  if(worker == NULL)
+    return;
+
+  worker->wait();
+  onFramesBlended(-1);
+  stopBlending();
+}
+
+
+void BlenderTimeline::PrepareItemChange()
+{
+  if(worker == NULL)
+    return;
+
+  stopBlending();
+  blendingInterrupted = true;
+}
+
+
+void BlenderTimeline::ResumeBlending()
+{
+  if(blendingInterrupted)
+    RebuildResultingAnimation();
+}
+
+
 void BlenderTimeline::HideLimsForm()
 {
   limbsForm->hide();
@@ -186,6 +264,37 @@ void BlenderTimeline::limitUserActions(bool limit)
     trail->limitUserActions(limit);
 }
 
+void BlenderTimeline::stopBlending()
+{
+  lazyItems.clear();
+  if(worker == NULL)
+    return;
+
+  worker->cancel();
+  worker->wait();
+  delete worker;
+  worker = NULL;
+}
+
+/** Makes sure the frames of lazily blended result are blended up to @param frame (and some more
+    for smooth playback). Frames are blended in order, as position of each depends on the previous one. */
+void BlenderTimeline::blendLazilyUpTo(int frame)
+{
+  if(resultAnimation == NULL || lazyItems.isEmpty())
+    return;
+
+  int lastPosition = animationBeginPosition + resultAnimation->getNumberOfFrames() - 1;
+  int toPosition = qMin(animationBeginPosition + frame + LAZY_PREFETCH_FRAMES, lastPosition);
+  if(toPosition <= lazyBlendedPosition)
+    return;
+
+  int blended = blender->BlendRange(lazyItems, resultAnimation, lazyBlendedPosition+1, toPosition);
+  if(blended > lazyBlendedPosition)
+    lazyBlendedPosition = blended;
+  if(blended >= lastPosition || blended < 0)      //complete (or nothing to blend)
+    lazyItems.clear();
+}
+
 void BlenderTimeline::fitStackWidgetToContent()
 {
   TimelineTrail* t = trails.at(0);
@@ -291,8 +400,168 @@ void BlenderTimeline::onTrailContentChanged()
   RebuildResultingAnimation();
 }
 
+//Only weights or mix zones of the item have changed. Try to re-blend just the affected part.
+void BlenderTimeline::onItemContentChanged(TrailItem* item)
+{
+  //a partial re-blend needs complete previous result
+  if(resultAnimation == NULL || worker != NULL || blendingInterrupted || !lazyItems.isEmpty() ||
+     !blender->ReblendItem(&trails, trails.size(), item, resultAnimation))
+  {
+    RebuildResultingAnimation();
+    return;
+  }
+
+  emit resultingAnimationUpdated();
+  setCurrentFramePosition(animationBeginPosition + resultAnimation->getFrame());    //redraw current posture
+}
+
+//The worker shares weights and mix zones with the time-line, so it can't run while they change
+void BlenderTimeline::onItemContentChanging()
+{
+  PrepareItemChange();
+}
+
+void BlenderTimeline::onItemContentKept()
+{
+  ResumeBlending();
+}
+
+void BlenderTimeline::onLimbsWeightChanged()
+{
+  onItemContentChanged(getSelectedItem());
+}
+
+//Move finished block of the background blending into resulting animation
+void BlenderTimeline::onFramesBlended(int)
+{
+  if(worker == NULL || resultAnimation == NULL)      //signal from a stopped worker
+    return;
+
+  int lastFrame = worker->takeBlendedFrames(resultAnimation);
+  if(lastFrame >= 0)
+    emit resultingAnimationBlended(lastFrame);
+}
+
+void BlenderTimeline::onBlendingFinished()
+{
+  if(worker == NULL || sender() != worker)
+    return;
+
+  onFramesBlended(-1);
+  stopBlending();
+}
+
+/** Finds animation on other trails that the item should follow (the one reaching furthest of those
+    beginning before the item) and offers to move the item where their postures match best. */
+void BlenderTimeline::onTransitionWanted(TrailItem* item)
+{
+  if(item == NULL || item->isShadow())
+    return;
+
+  TimelineTrail* itemTrail = qobject_cast<TimelineTrail*>(sender());
+  TrailItem* previous = NULL;
+  foreach(TimelineTrail* trail, trails)
+  {
+    if(trail == itemTrail)
+      continue;
+    for(TrailItem* other = trail->firstItem(); other != NULL; other = other->nextItem())
+    {
+      if(!other->isShadow() && other->beginIndex() < item->beginIndex() &&
+         (previous == NULL || other->endIndex() > previous->endIndex()))
+        previous = other;
+    }
+  }
+
+  if(previous == NULL)
+  {
+    QMessageBox::information(this, "Find transition", "There's no animation beginning before '" +
+                             item->name() + "' on other trails.");
+    return;
+  }
+
+  PoseTransition transition = PoseDistance::findTransition(previous->getAnimation(), item->getAnimation());
+  if(transition.fromFrame < 0)
+  {
+    QMessageBox::warning(this, "Find transition", "Postures of '" + previous->name() + "' and '" +
+                         item->name() + "' can't be compared.");
+    return;
+  }
+
+  int newBegin = previous->beginIndex() + previous->framePosition(transition.fromFrame)
+                 - item->framePosition(transition.toFrame);
+  int mixLength = qMin(transition.length, item->frames());
+  QString text = QString("Frame %1 of '%2' matches best frame %3 of '%4'.\n\nMove '%4' to position %5 and "
+                         "mix '%2' into it over %6 frames?").arg(transition.fromFrame+1).arg(previous->name())
+                         .arg(transition.toFrame+1).arg(item->name()).arg(newBegin+1).arg(mixLength);
+  if(QMessageBox::question(this, "Find transition", text, QMessageBox::Yes | QMessageBox::No) != QMessageBox::Yes)
+    return;
+
+  int oldMixIn = previous->mixIn();
+  PrepareItemChange();
+  previous->setMixIn(mixLength);          //before the move, which rebuilds the result
+  if(itemTrail == NULL || !itemTrail->MoveItem(item, newBegin))
+  {
+    previous->setMixIn(oldMixIn);
+    ResumeBlending();
+    QMessageBox::warning(this, "Find transition", "Not enough space to move '" + item->name() + "'.");
+  }
+}
+
+void BlenderTimeline::onSimilarPosesWanted(TrailItem* item)
+{
+  if(item == NULL || item->isShadow())
+    return;
+
+  QString library = QFileDialog::getExistingDirectory(this, "Choose animation library",
+                                                      poseIndex ? poseIndex->directory()
+                                                                : Settings::Instance()->lastPath());
+  if(library.isEmpty())
+    return;
+
+  if(poseIndex == NULL || poseIndex->directory() != QDir(library).absolutePath())
+  {
+    delete poseIndex;
+    poseIndex = new PoseIndex(library);
+    poseIndex->open();
+  }
+
+  //only files changed since the last search are read
+  int frame = qMax(0, item->selectedFrame());
+  QApplication::setOverrideCursor(Qt::WaitCursor);
+  bool updated = poseIndex->update() >= 0;
+  QList<PoseMatch> matches = poseIndex->nearest(item->getAnimation(), frame, 50);
+  QApplication::restoreOverrideCursor();
+
+  if(!updated)
+  {
+    QMessageBox::warning(this, "Find similar postures", "Can't write index of postures into '" + library + "'.");
+    return;
+  }
+  if(matches.isEmpty())
+  {
+    QMessageBox::information(this, "Find similar postures", "No animation in '" + library +
+                             "' has the skeleton of '" + item->name() + "'.");
+    return;
+  }
+
+  //best frame of each file
+  QStringList files;
+  QString text = QString("Postures closest to frame %1 of '%2':\n").arg(frame+1).arg(item->name());
+  foreach(PoseMatch match, matches)
+  {
+    if(files.contains(match.file) || files.size() == 10)
+      continue;
+    files.append(match.file);
+    text += QString("\n%1, frame %2 (difference %3)").arg(QFileInfo(match.file).fileName()).arg(match.frame+1)
+            .arg(match.distance, 0, 'f', 4);
+  }
+  QMessageBox::information(this, "Find similar postures", text);
+}
+
 void BlenderTimeline::onPlayFrameChanged(int playFrame)
 {
+  blendLazilyUpTo(playFrame);             //before the frame gets drawn
+
   foreach(TimelineTrail* trail, trails)
     trail->setCurrentPosition(animationBeginPosition + playFrame);
 }
@@ -5,10 +5,13 @@
 #include <QList>
 #include "weightedanimation.h"
 
+class Blender;
+class BlendWorker;
 class QKeyEvent;
 class QSize;
 class LimbsWeightForm;
 class NoArrowsScrollArea;
+class PoseIndex;
 class TimelineTrail;
 class TrailItem;
 
@@ -29,6 +32,13 @@ class BlenderTimeline : public QFrame
         the overall animation. Supposed to be used for case of change in global application settings.
         @param emiting tells if the rebuild should emit the resultingAnimationChanged signal. */
     void RebuildResultingAnimation(bool emiting=true);
+    /** Wait until the background (or lazy) blending is done, so the resulting animation is complete */
+    void FinishBlending();
+    /** To be called before weights, mix zones or speed of an item change. Stops the background
+        blending, which reads them. The change must be followed by a re-blend or ResumeBlending(). */
+    void PrepareItemChange();
+    /** Blends the rest of the resulting animation if PrepareItemChange() stopped it and nothing changed */
+    void ResumeBlending();
     void HideLimsForm();
     /** Return currently selected TrailItem. If none was selected by user, NUUL is returned */
     TrailItem* getSelectedItem() const;
@@ -41,6 +51,10 @@ class BlenderTimeline : public QFrame
   signals:
     /** Warn about Animation and its first frame position */
     void resultingAnimationChanged(WeightedAnimation*);
+    /** Part of the resulting animation was blended again, the animation object stays the same */
+    void resultingAnimationUpdated();
+    /** Background blending has finished frames of the resulting animation up to @param lastFrame */
+    void resultingAnimationBlended(int lastFrame);
     void timelinePositionChanged();
     void selectedItemChanged();
     void selectedItemLost();
@@ -56,6 +70,14 @@ class BlenderTimeline : public QFrame
     void startItemReposition(TrailItem* draggingItem);
     void endItemReposition();
     void onTrailContentChanged();
+    void onItemContentChanging();
+    void onItemContentKept();
+    void onItemContentChanged(TrailItem* item);
+    void onLimbsWeightChanged();
+    void onFramesBlended(int lastFrame);
+    void onBlendingFinished();
+    void onTransitionWanted(TrailItem* item);
+    void onSimilarPosesWanted(TrailItem* item);
 
 
     void onPlayFrameChanged(int playFrame);
@@ -73,8 +95,16 @@ class BlenderTimeline : public QFrame
     int trailFramesCount;
     int needsReshape;
     WeightedAnimation* resultAnimation;
+    Blender* blender;                  //lent to the worker while it runs
+    BlendWorker* worker;               //NULL if nothing is being blended in the background
+    bool blendingInterrupted;          //TRUE if the worker was stopped before finishing the result
+    QList<TrailItem*> lazyItems;       //prepared items of lazily blended result, empty when it's complete
+    int lazyBlendedPosition;           //time-line position of last lazily blended frame
+    PoseIndex* poseIndex;              //index of last searched animation library, NULL if none
 
     void fitStackWidgetToContent();
+    void stopBlending();
+    void blendLazilyUpTo(int frame);
     void ensurePlayFrameVisibility(int position);
 };
 
@@ -4,11 +4,14 @@
 #include <QLineEdit>
 #include <QCloseEvent>
 #include <QTabBar>
+#include <QApplication>
+#include <QInputDialog>
 
 
 #include "animationview.h"
 #include "announcer.h"
 #include "keyframertab.h"
+#include "posedistance.h"
 #include "prop.h"
 #include "qavimator.h"
 #include "rotation.h"
@@ -144,8 +147,13 @@ void KeyFramerTab::bindMenuActions()
   connect(mainWindow->fileSavePropsAction, SIGNAL(triggered()), this, SLOT(fileSavePropsAction_triggered()));
   connect(mainWindow->toolsOptimizeBVHAction, SIGNAL(triggered()), this, SLOT(toolsOptimizeBVHAction_triggered()));
   connect(mainWindow->toolsMirrorAction, SIGNAL(triggered()), this, SLOT(toolsMirrorAction_triggered()));
+  connect(mainWindow->toolsBakeIKAction, SIGNAL(triggered()), this, SLOT(toolsBakeIKAction_triggered()));
+  connect(mainWindow->toolsFindLoopAction, SIGNAL(triggered()), this, SLOT(toolsFindLoopAction_triggered()));
+  connect(mainWindow->toolsResampleAction, SIGNAL(triggered()), this, SLOT(toolsResampleAction_triggered()));
+  connect(mainWindow->toolsSmoothAction, SIGNAL(triggered()), this, SLOT(toolsSmoothAction_triggered()));
   connect(mainWindow->optionsSkeletonAction, SIGNAL(triggered(bool)), this, SLOT(optionsSkeletonAction_toggled(bool)));
   connect(mainWindow->optionsJointLimitsAction, SIGNAL(triggered(bool)), this, SLOT(optionsJointLimitsAction_toggled(bool)));
+  connect(mainWindow->optionsJacobianIKAction, SIGNAL(triggered(bool)), this, SLOT(optionsJacobianIKAction_toggled(bool)));
   connect(mainWindow->optionsLoopAction, SIGNAL(toggled(bool)), this, SLOT(optionsLoopAction_toggled(bool)));
   connect(mainWindow->optionsProtectFirstFrameAction, SIGNAL(triggered(bool)), this, SLOT(optionsProtectFirstFrameAction_toggled(bool)));
   connect(mainWindow->optionsShowTimelineAction, SIGNAL(triggered(bool)), this, SLOT(optionsShowTimelineAction_toggled(bool)));
@@ -226,8 +234,13 @@ void KeyFramerTab::UpdateMenu()
 
   mainWindow->toolsOptimizeBVHAction->setEnabled(true);
   mainWindow->toolsMirrorAction->setEnabled(true);
+  mainWindow->toolsBakeIKAction->setEnabled(true);
+  mainWindow->toolsFindLoopAction->setEnabled(true);
+  mainWindow->toolsResampleAction->setEnabled(true);
+  mainWindow->toolsSmoothAction->setEnabled(true);
 
   mainWindow->optionsJointLimitsAction->setEnabled(true);
+  mainWindow->optionsJacobianIKAction->setEnabled(true);
   mainWindow->optionsLoopAction->setEnabled(true);
   mainWindow->optionsProtectFirstFrameAction->setEnabled(true);
   mainWindow->optionsShowTimelineAction->setEnabled(true);
@@ -270,6 +283,7 @@ void KeyFramerTab::readSettings()
   bool showTimelinePanel=true;
 
   jointLimits=true;
+  jacobianIK=false;
   loop=true;
   protectFirstFrame=true;
   lastPath=QString::null;
@@ -277,6 +291,7 @@ void KeyFramerTab::readSettings()
   mainWindow->optionsLoopAction->setChecked(loop);
   mainWindow->optionsSkeletonAction->setChecked(skeleton);
   mainWindow->optionsJointLimitsAction->setChecked(jointLimits);
+  mainWindow->optionsJacobianIKAction->setChecked(jacobianIK);
   mainWindow->optionsShowTimelineAction->setChecked(showTimelinePanel);
 
   if(!showTimelinePanel) timelineView->hide();
@@ -1004,6 +1019,7 @@ void KeyFramerTab::fileNew()
   addToOpenFiles(/*UntitledName()*/CurrentFile);
 
   anim->useRotationLimits(jointLimits);
+  anim->useJacobianIK(jacobianIK);
 
   if(protectFirstFrame)
   {
@@ -1120,6 +1136,7 @@ void KeyFramerTab::fileAdd(const QString& name)
     timeline->setAnimation(anim);
     selectAnimation(anim);
     anim->useRotationLimits(jointLimits);
+    anim->useJacobianIK(jacobianIK);
 
 //    qDebug("qavimator::fileAdd(): checking for loop points");
     // no loop in point? must be a BVH or an older avm. set a sane default
@@ -1367,6 +1384,115 @@ void KeyFramerTab::toolsOptimizeBVH()
   updateInputs();
 }
 
+// Menu Action: Tools / Bake IK
+void KeyFramerTab::toolsBakeIK()
+{
+  Animation* anim=animationView->getAnimation();
+  QApplication::setOverrideCursor(Qt::WaitCursor);
+  anim->bakeIK(anim->getLoopInPoint(),anim->getLoopOutPoint());
+  QApplication::restoreOverrideCursor();
+  animationView->repaint();
+  updateInputs();
+}
+
+// Menu Action: Tools / Find Loop
+void KeyFramerTab::toolsFindLoop()
+{
+  Animation* anim=animationView->getAnimation();
+  int numOfFrames=anim->getNumberOfFrames();
+  if(numOfFrames<3)
+    return;
+
+  bool ok;
+  int minLength=QInputDialog::getInteger(this, tr("Find Loop"), tr("Shortest loop (frames):"),
+                                         qMin(anim->fps(), numOfFrames-1), 2, numOfFrames-1, 1, &ok);
+  if(!ok)
+    return;
+  int maxLength=QInputDialog::getInteger(this, tr("Find Loop"), tr("Longest loop (frames):"),
+                                         numOfFrames-1, minLength, numOfFrames-1, 1, &ok);
+  if(!ok)
+    return;
+
+  QApplication::setOverrideCursor(Qt::WaitCursor);
+  QList<PoseLoop> loops=PoseDistance::findLoops(anim, minLength, maxLength, 10, protectFirstFrame ? 1 : 0);
+  QApplication::restoreOverrideCursor();
+
+  if(loops.isEmpty())
+  {
+    QMessageBox::information(this, tr("Find Loop"), tr("No loop of the given length was found."));
+    return;
+  }
+
+  // user view of frames, so always +1
+  QStringList candidates;
+  foreach(PoseLoop loop, loops)
+    candidates.append(tr("Frames %1 - %2 (%3 frames, difference %4)").arg(loop.inFrame+1).arg(loop.outFrame+1)
+                      .arg(loop.outFrame-loop.inFrame+1).arg(loop.distance, 0, 'f', 4));
+
+  QString chosen=QInputDialog::getItem(this, tr("Find Loop"), tr("Best loops found:"), candidates, 0, false, &ok);
+  if(!ok)
+    return;
+
+  PoseLoop loop=loops.at(candidates.indexOf(chosen));
+  // loop in first, so neither point gets clamped by the old other one
+  setLoopInPoint(1);
+  setLoopOutPoint(loop.outFrame+1);
+  setLoopInPoint(loop.inFrame+1);
+}
+
+// Menu Action: Tools / Resample
+void KeyFramerTab::toolsResample()
+{
+  Animation* anim=animationView->getAnimation();
+  bool ok;
+  int fps=QInputDialog::getInteger(this, tr("Resample"), tr("Convert to frames per second:"),
+                                   qMin(anim->fps(), 50), 2, 50, 1, &ok);
+  if(!ok || fps==anim->fps())
+    return;
+
+  QApplication::setOverrideCursor(Qt::WaitCursor);
+  anim->resample(fps);
+  QApplication::restoreOverrideCursor();
+  calculateLongestRunningTime();
+  animationView->repaint();
+  updateInputs();
+}
+
+// Menu Action: Tools / Smooth
+void KeyFramerTab::toolsSmooth()
+{
+  Animation* anim=animationView->getAnimation();
+  bool ok;
+  int strength=QInputDialog::getInteger(this, tr("Smooth"), tr("Strength (1 is the lightest):"), 2, 1, 10, 1, &ok);
+  if(!ok)
+    return;
+
+  // the original stays in a copy until the user has seen the smoothed animation play
+  int frame=anim->getFrame();
+  QList<BVHNode*> original=anim->copyKeyframes();
+  QApplication::setOverrideCursor(Qt::WaitCursor);
+  anim->smooth(strength, protectFirstFrame ? 1 : 0);
+  QApplication::restoreOverrideCursor();
+
+  // play the result while asking, then leave playback as it was
+  PlayState playstateBefore=playstate;
+  if(playstate==PLAYSTATE_STOPPED)
+    nextPlaystate();
+  int answer=QMessageBox::question(this, tr("Smooth"), tr("Keep the smoothed animation?"),
+                                   QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes);
+  if(playstateBefore==PLAYSTATE_STOPPED && playstate!=PLAYSTATE_STOPPED)
+  {
+    timer.stop();
+    setPlaystate(PLAYSTATE_STOPPED);
+  }
+  if(answer!=QMessageBox::Yes)
+    anim->restoreKeyframes(original);
+  qDeleteAll(original);
+
+  frameSlider(frame);
+  animationView->repaint();
+}
+
 // Menu Action: Options / Skeleton
 void KeyFramerTab::showSkeleton(bool on)
 {
@@ -1403,6 +1529,19 @@ void KeyFramerTab::setJointLimits(bool on)
 }
 
 
+// Menu Action: Options / Jacobian IK
+void KeyFramerTab::setJacobianIK(bool on)
+{
+  jacobianIK=on;
+  Animation* anim=animationView->getAnimation();
+  if(anim)
+  {
+    anim->useJacobianIK(on);
+    animationView->repaint();
+    updateInputs();
+  }
+}
+
 // Menu Action: Options / Protect First Frame
 void KeyFramerTab::setProtectFirstFrame(bool on)
 {
@@ -1984,6 +2123,26 @@ void KeyFramerTab::toolsOptimizeBVHAction_triggered()
   toolsOptimizeBVH();
 }
 
+void KeyFramerTab::toolsBakeIKAction_triggered()
+{
+  toolsBakeIK();
+}
+
+void KeyFramerTab::toolsFindLoopAction_triggered()
+{
+  toolsFindLoop();
+}
+
+void KeyFramerTab::toolsResampleAction_triggered()
+{
+  toolsResample();
+}
+
+void KeyFramerTab::toolsSmoothAction_triggered()
+{
+  toolsSmooth();
+}
+
 void KeyFramerTab::toolsMirrorAction_triggered()
 {
   Animation* anim=animationView->getAnimation();
@@ -2001,6 +2160,11 @@ void KeyFramerTab::optionsJointLimitsAction_toggled(bool on)
   setJointLimits(on);
 }
 
+void KeyFramerTab::optionsJacobianIKAction_toggled(bool on)
+{
+  setJacobianIK(on);
+}
+
 void KeyFramerTab::optionsLoopAction_toggled(bool on)
 {
   setLoop(on);
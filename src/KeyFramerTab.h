@@ -102,9 +102,14 @@ protected slots:
 
     void toolsOptimizeBVHAction_triggered();
     void toolsMirrorAction_triggered();
+    void toolsBakeIKAction_triggered();
+    void toolsFindLoopAction_triggered();
+    void toolsResampleAction_triggered();
+    void toolsSmoothAction_triggered();
 
     void optionsSkeletonAction_toggled(bool on);
     void optionsJointLimitsAction_toggled(bool on);
+    void optionsJacobianIKAction_toggled(bool on);
     void optionsLoopAction_toggled(bool on);
     void optionsProtectFirstFrameAction_toggled(bool on);
     void optionsShowTimelineAction_toggled(bool on);
@@ -191,9 +196,14 @@ protected:
 
     void toolsOptimizeBVH();
     void toolsMirror();
+    void toolsBakeIK();
+    void toolsFindLoop();
+    void toolsResample();
+    void toolsSmooth();
 
     void showSkeleton(bool on);
     void setJointLimits(bool on);
+    void setJacobianIK(bool on);
     void setLoop(bool on);
     void setProtectFirstFrame(bool on);
     void showTimeline(bool state);
@@ -301,6 +311,7 @@ protected:
 
     bool loop;
     bool jointLimits;
+    bool jacobianIK;
     bool frameDataValid;
     // if set the first frame of an animation is protected
     bool protectFirstFrame;
@@ -84,6 +84,10 @@ void LimbsWeightForm::on_limbComboBox_currentIndexChanged(QString itemText)
 
 void LimbsWeightForm::on_weightSlider_valueChanged(int value)
 {
+  if(selectedLimb->frameData(frame).weight() == value)      //e.g. the slider follows another frame
+    return;
+
+  emit valueChanging();
   selectedLimb->setKeyframeWeight(frame, value);
   labels.value(selectedLimb->name())->setText(QString::number(selectedLimb->frameData(frame).weight()));
   emit valueChanged();
@@ -26,6 +26,8 @@ class LimbsWeightForm : public QWidget
     void UpdateContent(WeightedAnimation* animation, int frame);
 
   signals:
+    /** Weight of the selected limb is about to be written */
+    void valueChanging();
     void valueChanged();
 
   private:
@@ -0,0 +1,400 @@
+/*
+  Comparing of postures of animations.
+*/
+
+#include "animation.h"
+#include "bvhnode.h"
+#include "iktree.h"
+#include "posedistance.h"
+
+#include <QFuture>
+#include <QThread>
+#include <QtAlgorithms>
+#include <QtConcurrentRun>
+#include <math.h>
+
+#define POSE_TILE               64      //frames in one tile of distance matrix
+#define POSE_VELOCITY_WEIGHT    0.05f   //weight of squared root speed difference (per frame)
+#define POSE_LOOP_MIN_LENGTHS   32      //fewest loop lengths given to one thread
+
+
+PoseFeatures::PoseFeatures(Animation* anim, int firstFrame, int lastFrame)
+{
+  if(lastFrame < 0 || lastFrame >= anim->getNumberOfFrames())
+    lastFrame = anim->getNumberOfFrames()-1;
+  if(firstFrame < 0)
+    firstFrame = 0;
+  framesCount = lastFrame-firstFrame+1 > 0 ? lastFrame-firstFrame+1 : 0;
+  velocityWeight = POSE_VELOCITY_WEIGHT;
+
+  QList<BVHNode*> joints;
+  QList<int> subtreeSizes;
+  int bones = collectJoints(anim->getMotion(), joints, subtreeSizes);
+  jointsCount = joints.size();
+  stride = 4*jointsCount + 3;
+
+  foreach(BVHNode* joint, joints)
+    names.append(joint->name());
+  weights.resize(jointsCount);
+  for(int j=0; j<jointsCount; j++)
+    weights[j] = (float)subtreeSizes.at(j) / (float)bones;
+
+  data.resize(framesCount*stride);
+  BVHNode* position = anim->getNode(0);
+  int animFrames = anim->getNumberOfFrames();
+
+  for(int f=0; f<framesCount; f++)
+  {
+    int frame = firstFrame+f;
+    float* out = data.data() + f*stride;
+
+    for(int j=0; j<jointsCount; j++)
+    {
+      MT_Quaternion q = IKTree::toQuaternion(joints.at(j), joints.at(j)->frameData(frame).rotation());
+      for(int c=0; c<4; c++)
+        out[4*j+c] = (float)q[c];
+    }
+
+    //root velocity, the first frame takes it from the next one
+    int previous = frame > 0 ? frame-1 : 0;
+    int next = frame > 0 ? frame : (animFrames > 1 ? 1 : 0);
+    Position p1 = position->frameData(previous).position();
+    Position p2 = position->frameData(next).position();
+    out[4*jointsCount]   = (float)(p2.x-p1.x);
+    out[4*jointsCount+1] = (float)(p2.y-p1.y);
+    out[4*jointsCount+2] = (float)(p2.z-p1.z);
+  }
+}
+
+
+void PoseFeatures::euclidean(int frame, float* out) const
+{
+  const float* in = data.constData() + frame*stride;
+
+  //|qa-qb|^2 = 2 - 2*dot for unit quaternions, so joint weights are halved
+  for(int j=0; j<jointsCount; j++)
+  {
+    float scale = (float)sqrt(weights.at(j) / 2.0);
+    if(in[4*j+3] < 0.0f)                      //one sign for all, w is the last component
+      scale = -scale;
+    for(int c=0; c<4; c++)
+      out[4*j+c] = scale * in[4*j+c];
+  }
+
+  float velocityScale = (float)sqrt(velocityWeight);
+  for(int c=0; c<3; c++)
+    out[4*jointsCount+c] = velocityScale * in[4*jointsCount+c];
+}
+
+
+/** Collects joints with rotation in depth first order. Returns number of joints in the subtree. */
+int PoseFeatures::collectJoints(BVHNode* joint, QList<BVHNode*>& joints, QList<int>& subtreeSizes)
+{
+  if(joint->type == BVH_END)
+    return 0;
+
+  int index = joints.size();
+  joints.append(joint);
+  subtreeSizes.append(1);
+
+  int size = 1;
+  for(int i=0; i<joint->numChildren(); i++)
+    size += collectJoints(joint->child(i), joints, subtreeSizes);
+
+  subtreeSizes[index] = size;
+  return size;
+}
+
+
+/*! Rows firstRow..lastRow of the distance matrix. Columns are walked in tiles, so the postures
+    of b stay in cache for all the rows. !*/
+static void distanceRows(const PoseFeatures* a, const PoseFeatures* b, float* out, int firstRow, int lastRow)
+{
+  int columns = b->frames();
+
+  for(int tile=0; tile<columns; tile+=POSE_TILE)
+  {
+    int tileEnd = qMin(tile+POSE_TILE, columns);
+    for(int r=firstRow; r<=lastRow; r++)
+    {
+      float* row = out + r*columns;
+      for(int c=tile; c<tileEnd; c++)
+        row[c] = a->distance(r, *b, c);
+    }
+  }
+}
+
+
+QVector<float> PoseDistance::matrix(const PoseFeatures& a, const PoseFeatures& b)
+{
+  QVector<float> result(a.frames() * b.frames());
+  if(result.isEmpty() || !a.isComparableWith(b))
+    return QVector<float>();
+
+  //blocks of rows go to the thread pool, the first one is done on this thread
+  QList<QFuture<void> > workers;
+  for(int row=POSE_TILE; row<a.frames(); row+=POSE_TILE)
+    workers.append(QtConcurrent::run(distanceRows, &a, &b, result.data(), row,
+                                     qMin(row+POSE_TILE, a.frames())-1));
+  distanceRows(&a, &b, result.data(), 0, qMin(POSE_TILE, a.frames())-1);
+  for(int i=0; i<workers.size(); i++)
+    workers[i].waitForFinished();
+
+  return result;
+}
+
+
+PoseTransition PoseDistance::findTransition(Animation* from, Animation* to, int searchFrames, int window)
+{
+  PoseTransition best;
+  best.fromFrame = -1;
+  best.toFrame = -1;
+  best.length = 0;
+  best.distance = 999999999.0;
+
+  int fromFrames = from->getNumberOfFrames();
+  int tail = qMin(searchFrames, fromFrames);
+  int head = qMin(searchFrames, to->getNumberOfFrames());
+  window = qMax(1, qMin(window, qMin(tail, head)));
+  if(tail < 1 || head < 1)
+    return best;
+
+  PoseFeatures tailFeatures(from, fromFrames-tail, fromFrames-1);
+  PoseFeatures headFeatures(to, 0, head-1);
+  QVector<float> distances = matrix(tailFeatures, headFeatures);
+  if(distances.isEmpty())             //different skeletons
+    return best;
+
+  //average along the diagonal, i.e. both animations going on at the same pace
+  for(int i=0; i+window<=tail; i++)
+  {
+    for(int j=0; j+window<=head; j++)
+    {
+      double sum = 0.0;
+      for(int k=0; k<window; k++)
+        sum += distances.at((i+k)*head + j+k);
+
+      if(sum/window < best.distance)
+      {
+        best.distance = sum/window;
+        best.fromFrame = fromFrames-tail+i;
+        best.toFrame = j;
+      }
+    }
+  }
+
+  best.length = fromFrames - best.fromFrame;
+  return best;
+}
+
+
+QVector<int> PoseDistance::align(const PoseFeatures& a, const PoseFeatures& b, int band)
+{
+  int n = a.frames();
+  int m = b.frames();
+  if(n < 1 || m < 1 || !a.isComparableWith(b))
+    return QVector<int>();
+
+  //columns searched in row i are lo[i]..lo[i]+width-1 around the diagonal
+  band = qMax(band, 1);
+  int width = 2*band+1;
+  QVector<int> lo(n);
+  for(int i=0; i<n; i++)
+  {
+    int center = n > 1 ? (int)((qint64)i*(m-1)/(n-1)) : 0;
+    lo[i] = center-band;
+  }
+
+  const float infinity = 1e30f;
+  QVector<float> cost(n*width, infinity);
+  for(int i=0; i<n; i++)
+  {
+    for(int k=0; k<width; k++)
+    {
+      int j = lo[i]+k;
+      if(j < 0 || j >= m)
+        continue;
+
+      float best;
+      if(i == 0 && j == 0)
+        best = 0.0f;
+      else
+      {
+        best = infinity;
+        if(k > 0)                                     //left
+          best = qMin(best, cost[i*width + k-1]);
+        if(i > 0)
+        {
+          int up = j - lo[i-1];                       //same column in previous row
+          if(up >= 0 && up < width)
+            best = qMin(best, cost[(i-1)*width + up]);
+          if(up-1 >= 0 && up-1 < width)               //diagonal
+            best = qMin(best, cost[(i-1)*width + up-1]);
+        }
+      }
+      if(best < infinity)
+        cost[i*width + k] = best + a.distance(i, b, j);
+    }
+  }
+
+  //walk the cheapest path back, remembering first and last frame of b matched with each frame of a
+  QVector<int> first(n, m);
+  QVector<int> last(n, -1);
+  int i = n-1;
+  int j = m-1;
+  if(j-lo[i] < 0 || j-lo[i] >= width || cost[i*width + j-lo[i]] >= infinity)
+    return QVector<int>();            //band too narrow to reach the end
+
+  while(true)
+  {
+    first[i] = qMin(first[i], j);
+    last[i] = qMax(last[i], j);
+    if(i == 0 && j == 0)
+      break;
+
+    float left = (j > 0 && j-1-lo[i] >= 0) ? cost[i*width + j-1-lo[i]] : infinity;
+    float up = infinity;
+    float diagonal = infinity;
+    if(i > 0)
+    {
+      int k = j-lo[i-1];
+      if(k >= 0 && k < width)
+        up = cost[(i-1)*width + k];
+      if(j > 0 && k-1 >= 0 && k-1 < width)
+        diagonal = cost[(i-1)*width + k-1];
+    }
+
+    if(diagonal <= left && diagonal <= up)
+    {
+      i--;
+      j--;
+    }
+    else if(up <= left)
+      i--;
+    else
+      j--;
+  }
+
+  QVector<int> result(n);
+  for(int r=0; r<n; r++)
+    result[r] = (first[r]+last[r]+1) / 2;
+  return result;
+}
+
+
+/*! What all threads of PoseDistance::findLoops() share !*/
+struct LoopSearch
+{
+  const PoseFeatures* features;
+  int firstFrame;                 //no loop starts before it
+  int window;                     //frames compared around the seam
+};
+
+
+/*! Best loop of each length from firstLength to lastLength. A loop of length L starting at frame i
+    is scored by distances of frames i+k and i+L+k, i.e. along one diagonal of the distance matrix,
+    so each length is a single pass with a sliding window. !*/
+static void bestLoopsOfLengths(const LoopSearch* search, int firstLength, int lastLength, PoseLoop* out)
+{
+  const PoseFeatures* features = search->features;
+  int frames = features->frames();
+  int window = search->window;
+  int half = window/2;
+  QVector<double> prefix(frames+1);
+
+  for(int length=firstLength; length<=lastLength; length++)
+  {
+    PoseLoop& best = out[length-firstLength];
+    best.inFrame = -1;
+    best.outFrame = -1;
+    best.distance = 999999999.0;
+
+    int seams = frames - length;                //frame i is compared with frame i+length
+    if(seams < 1)
+      continue;
+
+    prefix[0] = 0.0;
+    for(int i=0; i<seams; i++)
+      prefix[i+1] = prefix[i] + features->distance(i, *features, i+length);
+
+    for(int i=search->firstFrame; i<seams; i++)
+    {
+      int from = qMax(0, i-half);
+      int to = qMin(seams-1, i-half+window-1);
+      double distance = (prefix[to+1]-prefix[from]) / (to-from+1);
+      if(distance < best.distance)
+      {
+        best.distance = distance;
+        best.inFrame = i;
+        best.outFrame = i+length-1;
+      }
+    }
+  }
+}
+
+
+static bool isBetterLoop(const PoseLoop& loop1, const PoseLoop& loop2)
+{
+  return loop1.distance < loop2.distance;
+}
+
+
+QList<PoseLoop> PoseDistance::findLoops(Animation* anim, int minLength, int maxLength, int count,
+                                        int firstFrame, int window)
+{
+  QList<PoseLoop> result;
+  PoseFeatures features(anim);
+  int frames = features.frames();
+  minLength = qMax(2, minLength);
+  maxLength = qMin(maxLength, frames-1-qMax(0, firstFrame));
+  if(maxLength < minLength || count < 1)
+    return result;
+
+  //lengths are split among threads, each length is one pass along a diagonal
+  int lengths = maxLength-minLength+1;
+  QVector<PoseLoop> bestOfLength(lengths);
+  int numThreads = qBound(1, QThread::idealThreadCount(), (lengths+POSE_LOOP_MIN_LENGTHS-1) / POSE_LOOP_MIN_LENGTHS);
+  int chunk = (lengths+numThreads-1) / numThreads;
+  LoopSearch search;
+  search.features = &features;
+  search.firstFrame = qMax(0, firstFrame);
+  search.window = qMax(1, window);
+  window = search.window;
+
+  QList<QFuture<void> > workers;
+  for(int from=chunk; from<lengths; from+=chunk)
+    workers.append(QtConcurrent::run(bestLoopsOfLengths, (const LoopSearch*)&search, minLength+from,
+                                     minLength+qMin(from+chunk, lengths)-1, bestOfLength.data()+from));
+  bestLoopsOfLengths(&search, minLength, minLength+qMin(chunk, lengths)-1, bestOfLength.data());
+  for(int i=0; i<workers.size(); i++)
+    workers[i].waitForFinished();
+
+  QList<PoseLoop> candidates;
+  for(int i=0; i<lengths; i++)
+  {
+    if(bestOfLength.at(i).inFrame >= 0)
+      candidates.append(bestOfLength.at(i));
+  }
+  qStableSort(candidates.begin(), candidates.end(), isBetterLoop);
+
+  //loops just a few frames off a better one are the same loop for the user
+  foreach(PoseLoop candidate, candidates)
+  {
+    bool similar = false;
+    foreach(PoseLoop loop, result)
+    {
+      if(qAbs(loop.inFrame-candidate.inFrame) <= window && qAbs(loop.outFrame-candidate.outFrame) <= window)
+      {
+        similar = true;
+        break;
+      }
+    }
+
+    if(!similar)
+      result.append(candidate);
+    if(result.size() == count)
+      break;
+  }
+
+  return result;
+}
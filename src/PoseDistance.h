@@ -0,0 +1,115 @@
+#ifndef POSEDISTANCE_H
+#define POSEDISTANCE_H
+
+#include <QList>
+#include <QStringList>
+#include <QVector>
+
+class Animation;
+class BVHNode;
+
+
+/** Posture of every frame of an animation in a form suitable for comparing postures. Each frame has
+    local rotations of all joints as quaternions and the velocity of the root. Joints are weighted by
+    the number of bones they move, so a different hip counts more than a different finger. */
+class PoseFeatures
+{
+  public:
+    /** Features of frames @param firstFrame to @param lastFrame (-1 means the last one) */
+    PoseFeatures(Animation* anim, int firstFrame=0, int lastFrame=-1);
+
+    int frames() const                        { return framesCount; }
+    /** Names of joints in the order they are stored, to check two animations are comparable */
+    const QStringList& jointNames() const     { return names; }
+    bool isComparableWith(const PoseFeatures& other) const  { return names == other.names; }
+    /** Floats written by euclidean() */
+    int dimensions() const                    { return stride; }
+
+    /** Posture @param frame as a vector whose squared euclidean distances are distance()
+        (as long as the quaternions don't flip sign between nearby postures) */
+    void euclidean(int frame, float* out) const;
+
+    /** Distance of posture @param frame and posture @param otherFrame of @param other. Zero for
+        the same posture, it grows with joint rotation differences and root speed difference. */
+    inline float distance(int frame, const PoseFeatures& other, int otherFrame) const
+    {
+      const float* a = data.constData() + frame*stride;
+      const float* b = other.data.constData() + otherFrame*stride;
+      const float* w = weights.constData();
+      float sum = 0.0f;
+
+      //plain loops over contiguous floats, the compiler vectorizes them
+      for(int j=0; j<jointsCount; j++)
+      {
+        float dot = a[4*j]*b[4*j] + a[4*j+1]*b[4*j+1] + a[4*j+2]*b[4*j+2] + a[4*j+3]*b[4*j+3];
+        sum += w[j] * (1.0f - (dot < 0.0f ? -dot : dot));       //q and -q are the same rotation
+      }
+
+      const float* va = a + 4*jointsCount;
+      const float* vb = b + 4*jointsCount;
+      float dx = va[0]-vb[0];
+      float dy = va[1]-vb[1];
+      float dz = va[2]-vb[2];
+      return sum + velocityWeight*(dx*dx + dy*dy + dz*dz);
+    }
+
+  private:
+    int framesCount;
+    int jointsCount;
+    int stride;                       //floats per frame: 4 per joint + root velocity
+    float velocityWeight;
+    QVector<float> data;
+    QVector<float> weights;           //per joint, sum is 1
+    QStringList names;
+
+    int collectJoints(BVHNode* joint, QList<BVHNode*>& joints, QList<int>& subtreeSizes);
+};
+
+
+/** Best place to go from one animation to another found by PoseDistance::findTransition() */
+struct PoseTransition
+{
+  int fromFrame;        //frame of the first animation (-1 if nothing was found)
+  int toFrame;          //frame of the second animation matching fromFrame
+  int length;           //frames of the first animation from fromFrame to its end
+  double distance;      //average posture distance over the compared window
+};
+
+
+/** Loop of an animation found by PoseDistance::findLoops(). The frame after outFrame continues
+    smoothly with inFrame. */
+struct PoseLoop
+{
+  int inFrame;
+  int outFrame;
+  double distance;      //average posture distance around the seam
+};
+
+
+/** Matrices of posture distances between frames and searches based on them */
+class PoseDistance
+{
+  public:
+    /** Distances of all frames of @param a (rows) to all frames of @param b (columns), row by row.
+        The matrix is computed in tiles on all available threads. */
+    static QVector<float> matrix(const PoseFeatures& a, const PoseFeatures& b);
+
+    /** Searches last @param searchFrames frames of @param from and first @param searchFrames frames
+        of @param to for a pair of frames where the postures match best. The postures are compared
+        over @param window following frames, so the motions match too, not just a single pose. */
+    static PoseTransition findTransition(Animation* from, Animation* to, int searchFrames=120, int window=10);
+
+    /** Dynamic time warping of @param b to @param a. Returns for every frame of a the frame of b
+        going with it. Only paths at most @param band frames off the diagonal are searched, so
+        memory and time are O(frames*band). Empty result if the skeletons differ. */
+    static QVector<int> align(const PoseFeatures& a, const PoseFeatures& b, int band);
+
+    /** Searches @param anim for loops of @param minLength to @param maxLength frames not starting
+        before @param firstFrame. Returns at most @param count best of them, the best first. Loops
+        nearly the same as a better one are left out. The seam is compared over @param window frames
+        around it, so velocities match as well as postures. */
+    static QList<PoseLoop> findLoops(Animation* anim, int minLength, int maxLength, int count=10,
+                                     int firstFrame=0, int window=5);
+};
+
+#endif // POSEDISTANCE_H
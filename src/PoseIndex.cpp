@@ -0,0 +1,570 @@
+/*
+  Persistent index of postures of an animation library.
+*/
+
+#include "animation.h"
+#include "bvh.h"
+#include "posedistance.h"
+#include "poseindex.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#define POSE_INDEX_FILE         "animik.poseindex"
+#define POSE_INDEX_MAGIC        "APIX"
+#define POSE_INDEX_VERSION      1
+#define POSE_INDEX_VARIANCE     0.95    //part of variance the reduced space must keep..
+#define POSE_INDEX_MAX_DIMENSIONS 16    //..with at most this many dimensions
+#define POSE_INDEX_PCA_STEP     4       //every n-th frame is used to find principal axes
+
+
+/*! Beginning of the index file. It's followed by mean, principal components, points, their
+    entries and the table of files, in this order. !*/
+struct PoseIndexHeader
+{
+  char magic[4];
+  qint32 version;
+  qint32 dimensions;
+  qint32 reducedDimensions;
+  qint32 poses;
+  qint32 tableSize;                 //bytes of the table of files
+};
+
+
+PoseIndex::PoseIndex(const QString& directory)
+{
+  dir = QDir(directory).absolutePath();
+  map = NULL;
+  close();
+}
+
+PoseIndex::~PoseIndex()
+{
+  close();
+}
+
+
+void PoseIndex::close()
+{
+  if(map != NULL)
+    indexFile.unmap(map);
+  indexFile.close();
+
+  map = NULL;
+  jointNames.clear();
+  indexedFiles.clear();
+  dimensions = 0;
+  reducedDimensions = 0;
+  posesCount = 0;
+  mean = NULL;
+  components = NULL;
+  points = NULL;
+  entries = NULL;
+}
+
+
+bool PoseIndex::open()
+{
+  close();
+  indexFile.setFileName(dir + "/" + POSE_INDEX_FILE);
+  if(!indexFile.open(QIODevice::ReadOnly) || indexFile.size() < (qint64)sizeof(PoseIndexHeader))
+  {
+    close();
+    return false;
+  }
+
+  map = indexFile.map(0, indexFile.size());
+  if(map == NULL)
+  {
+    close();
+    return false;
+  }
+
+  const PoseIndexHeader* header = (const PoseIndexHeader*)map;
+  qint64 floats = header->dimensions + (qint64)header->reducedDimensions*header->dimensions
+                  + (qint64)header->poses*header->reducedDimensions;
+  qint64 expectedSize = sizeof(PoseIndexHeader) + 4*floats + 4*3*(qint64)header->poses + header->tableSize;
+  if(qstrncmp(header->magic, POSE_INDEX_MAGIC, 4) != 0 || header->version != POSE_INDEX_VERSION ||
+     header->dimensions < 0 || header->reducedDimensions < 0 || header->poses < 0 || header->tableSize < 0 ||
+     expectedSize != indexFile.size())
+  {
+    close();
+    return false;
+  }
+
+  dimensions = header->dimensions;
+  reducedDimensions = header->reducedDimensions;
+  posesCount = header->poses;
+  mean = (const float*)(map + sizeof(PoseIndexHeader));
+  components = mean + dimensions;
+  points = components + reducedDimensions*dimensions;
+  entries = (const qint32*)(points + posesCount*reducedDimensions);
+
+  QByteArray table = QByteArray::fromRawData((const char*)(entries + 3*posesCount), header->tableSize);
+  QDataStream in(table);
+  in.setVersion(QDataStream::Qt_4_0);
+  qint32 filesCount;
+  in >> jointNames >> filesCount;
+  for(int i=0; i<filesCount && in.status()==QDataStream::Ok; i++)
+  {
+    IndexedFile file;
+    qint32 poses;
+    in >> file.name >> file.modified >> file.size >> poses;
+    file.poses = poses;
+    indexedFiles.append(file);
+  }
+
+  if(in.status() != QDataStream::Ok)
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+
+/*! Posture features of an animation file. NULL if it can't be read. !*/
+static PoseFeatures* readFeatures(BVH* bvh, const QString& path)
+{
+  Animation* anim = new Animation(bvh, path);
+  PoseFeatures* result = NULL;
+  if(anim->getMotion() != NULL && anim->getNumberOfFrames() > 0)
+    result = new PoseFeatures(anim);
+  delete anim;
+  return result;
+}
+
+
+/*! Eigenvalues and eigenvectors of symmetric matrix @param a (n x n, destroyed) by Jacobi rotations.
+    Eigenvector k is column k of @param vectors. !*/
+static void symmetricEigen(QVector<double>& a, int n, QVector<double>& values, QVector<double>& vectors)
+{
+  vectors.fill(0.0, n*n);
+  for(int i=0; i<n; i++)
+    vectors[i*n+i] = 1.0;
+
+  for(int sweep=0; sweep<50; sweep++)
+  {
+    double offDiagonal = 0.0;
+    double diagonal = 0.0;
+    for(int p=0; p<n; p++)
+    {
+      diagonal += a[p*n+p]*a[p*n+p];
+      for(int q=p+1; q<n; q++)
+        offDiagonal += a[p*n+q]*a[p*n+q];
+    }
+    if(offDiagonal <= 1e-12*diagonal)
+      break;
+
+    for(int p=0; p<n; p++)
+    {
+      for(int q=p+1; q<n; q++)
+      {
+        double apq = a[p*n+q];
+        if(fabs(apq) < 1e-30)
+          continue;
+
+        double theta = (a[q*n+q]-a[p*n+p]) / (2.0*apq);
+        double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta+1.0));
+        double c = 1.0 / sqrt(t*t+1.0);
+        double s = t*c;
+
+        for(int k=0; k<n; k++)              //columns p and q
+        {
+          double akp = a[k*n+p];
+          double akq = a[k*n+q];
+          a[k*n+p] = c*akp - s*akq;
+          a[k*n+q] = s*akp + c*akq;
+        }
+        for(int k=0; k<n; k++)              //rows p and q
+        {
+          double apk = a[p*n+k];
+          double aqk = a[q*n+k];
+          a[p*n+k] = c*apk - s*aqk;
+          a[q*n+k] = s*apk + c*aqk;
+        }
+        for(int k=0; k<n; k++)
+        {
+          double vkp = vectors[k*n+p];
+          double vkq = vectors[k*n+q];
+          vectors[k*n+p] = c*vkp - s*vkq;
+          vectors[k*n+q] = s*vkp + c*vkq;
+        }
+      }
+    }
+  }
+
+  values.resize(n);
+  for(int i=0; i<n; i++)
+    values[i] = a[i*n+i];
+}
+
+
+/*! Orders point indices by one coordinate !*/
+class CoordinateLess
+{
+  public:
+    CoordinateLess(const float* points, int dimensions, int axis)
+      : points(points), dimensions(dimensions), axis(axis) {}
+    bool operator()(int a, int b) const { return points[a*dimensions+axis] < points[b*dimensions+axis]; }
+
+  private:
+    const float* points;
+    int dimensions;
+    int axis;
+};
+
+
+/*! Balanced KD-tree over points first..last-1 of @param order. The median of a range is its middle
+    element and splits the rest by the axis of the biggest spread, so no links are needed. !*/
+static void buildTree(const float* points, int dimensions, QVector<int>& order, QVector<qint32>& splits,
+                      int first, int last)
+{
+  if(last-first < 2)
+    return;
+
+  int axis = 0;
+  float biggestSpread = -1.0f;
+  for(int d=0; d<dimensions; d++)
+  {
+    float low = points[order[first]*dimensions+d];
+    float high = low;
+    for(int i=first+1; i<last; i++)
+    {
+      float value = points[order[i]*dimensions+d];
+      low = qMin(low, value);
+      high = qMax(high, value);
+    }
+    if(high-low > biggestSpread)
+    {
+      biggestSpread = high-low;
+      axis = d;
+    }
+  }
+
+  int middle = (first+last)/2;
+  std::nth_element(order.begin()+first, order.begin()+middle, order.begin()+last,
+                   CoordinateLess(points, dimensions, axis));
+  splits[middle] = axis;
+  buildTree(points, dimensions, order, splits, first, middle);
+  buildTree(points, dimensions, order, splits, middle+1, last);
+}
+
+
+int PoseIndex::update()
+{
+  if(map == NULL)
+    open();
+
+  QDir directory(dir);
+  QStringList filters;
+  filters << "*.bvh" << "*.BVH" << "*.avm" << "*.AVM";
+  QFileInfoList infos = directory.entryInfoList(filters, QDir::Files, QDir::Name);
+
+  QHash<QString, int> oldIds;
+  for(int i=0; i<indexedFiles.size(); i++)
+    oldIds.insert(indexedFiles.at(i).name, i);
+
+  //unchanged files are taken from the index, the rest is read
+  QList<IndexedFile> table;
+  QVector<int> newIds(indexedFiles.size(), -1);
+  QStringList changed;
+  foreach(QFileInfo info, infos)
+  {
+    int oldId = oldIds.value(info.fileName(), -1);
+    if(oldId >= 0 && reducedDimensions > 0 && indexedFiles.at(oldId).modified == info.lastModified() &&
+       indexedFiles.at(oldId).size == info.size())
+    {
+      newIds[oldId] = table.size();
+      table.append(indexedFiles.at(oldId));
+    }
+    else
+      changed.append(info.fileName());
+  }
+
+  QVector<float> newPoints;
+  QVector<qint32> newEntries;
+  for(int i=0; i<posesCount; i++)
+  {
+    int newId = newIds.at(entries[3*i]);
+    if(newId < 0)
+      continue;
+    for(int r=0; r<reducedDimensions; r++)
+      newPoints.append(points[i*reducedDimensions+r]);
+    newEntries << newId << entries[3*i+1] << 0;
+  }
+
+  QVector<float> newMean;
+  QVector<float> newComponents;
+  int newReduced = reducedDimensions;
+  for(int i=0; i<dimensions; i++)
+    newMean.append(mean[i]);
+  for(int i=0; i<reducedDimensions*dimensions; i++)
+    newComponents.append(components[i]);
+  QStringList newJointNames = jointNames;
+  BVH bvh;
+
+  //without an index the principal axes are found first, from all the files
+  if(newReduced == 0)
+  {
+    int n = 0;
+    QVector<double> sum;
+    QVector<double> products;
+    int samples = 0;
+    foreach(QString name, changed)
+    {
+      PoseFeatures* features = readFeatures(&bvh, directory.absoluteFilePath(name));
+      if(features == NULL)
+        continue;
+      if(newJointNames.isEmpty())
+      {
+        newJointNames = features->jointNames();
+        n = features->dimensions();
+        sum.fill(0.0, n);
+        products.fill(0.0, n*n);
+      }
+
+      if(features->jointNames() == newJointNames)
+      {
+        QVector<float> x(n);
+        for(int f=0; f<features->frames(); f+=POSE_INDEX_PCA_STEP)
+        {
+          features->euclidean(f, x.data());
+          for(int i=0; i<n; i++)
+          {
+            sum[i] += x[i];
+            for(int j=i; j<n; j++)
+              products[i*n+j] += x[i]*x[j];
+          }
+          samples++;
+        }
+      }
+      delete features;
+    }
+
+    if(samples == 0)
+      newJointNames.clear();
+    else
+    {
+      newMean.resize(n);
+      for(int i=0; i<n; i++)
+        newMean[i] = sum[i]/samples;
+      for(int i=0; i<n; i++)
+      {
+        for(int j=i; j<n; j++)
+        {
+          products[i*n+j] = products[i*n+j]/samples - (sum[i]/samples)*(sum[j]/samples);
+          products[j*n+i] = products[i*n+j];
+        }
+      }
+
+      QVector<double> values;
+      QVector<double> vectors;
+      symmetricEigen(products, n, values, vectors);
+
+      QList<QPair<double, int> > axes;
+      double variance = 0.0;
+      for(int i=0; i<n; i++)
+      {
+        axes.append(qMakePair(-values[i], i));          //biggest first
+        variance += qMax(0.0, values[i]);
+      }
+      qSort(axes);
+
+      double kept = 0.0;
+      newReduced = 0;
+      newComponents.clear();
+      while(newReduced < qMin(n, POSE_INDEX_MAX_DIMENSIONS) &&
+            (newReduced == 0 || kept < POSE_INDEX_VARIANCE*variance))
+      {
+        int axis = axes.at(newReduced).second;
+        for(int i=0; i<n; i++)
+          newComponents.append(vectors[i*n+axis]);
+        kept += -axes.at(newReduced).first;
+        newReduced++;
+      }
+    }
+  }
+
+  //project the new and changed files
+  int n = newMean.size();
+  QVector<float> x(n);
+  foreach(QString name, changed)
+  {
+    QFileInfo info(directory.absoluteFilePath(name));
+    IndexedFile file;
+    file.name = name;
+    file.modified = info.lastModified();
+    file.size = info.size();
+    file.poses = 0;
+
+    PoseFeatures* features = newReduced > 0 ? readFeatures(&bvh, info.absoluteFilePath()) : NULL;
+    if(features != NULL && features->jointNames() == newJointNames)
+    {
+      for(int f=0; f<features->frames(); f++)
+      {
+        features->euclidean(f, x.data());
+        for(int r=0; r<newReduced; r++)
+        {
+          const float* axis = newComponents.constData() + r*n;
+          float value = 0.0f;
+          for(int i=0; i<n; i++)
+            value += (x[i]-newMean[i]) * axis[i];
+          newPoints.append(value);
+        }
+        newEntries << table.size() << f << 0;
+      }
+      file.poses = features->frames();
+    }
+    delete features;
+    table.append(file);
+  }
+
+  jointNames = newJointNames;
+  if(!write(newMean, newComponents, newReduced, newPoints, newEntries, table))
+    return -1;
+
+  return changed.size();
+}
+
+
+/*! Builds the tree over given points and replaces the index file with them. Maps the new file. !*/
+bool PoseIndex::write(const QVector<float>& newMean, const QVector<float>& newComponents, int newReduced,
+                      QVector<float>& newPoints, QVector<qint32>& newEntries, const QList<IndexedFile>& table)
+{
+  int count = newEntries.size()/3;
+  QVector<int> order(count);
+  for(int i=0; i<count; i++)
+    order[i] = i;
+  QVector<qint32> splits(count, 0);
+  if(newReduced > 0)
+    buildTree(newPoints.constData(), newReduced, order, splits, 0, count);
+
+  QByteArray tableData;
+  QDataStream out(&tableData, QIODevice::WriteOnly);
+  out.setVersion(QDataStream::Qt_4_0);
+  out << jointNames << (qint32)table.size();
+  foreach(IndexedFile file, table)
+    out << file.name << file.modified << file.size << (qint32)file.poses;
+
+  PoseIndexHeader header;
+  memcpy(header.magic, POSE_INDEX_MAGIC, 4);
+  header.version = POSE_INDEX_VERSION;
+  header.dimensions = newMean.size();
+  header.reducedDimensions = newReduced;
+  header.poses = count;
+  header.tableSize = tableData.size();
+
+  QStringList savedJointNames = jointNames;
+  close();                            //the old file must be unmapped before it's replaced
+  jointNames = savedJointNames;
+
+  QString fileName = dir + "/" + POSE_INDEX_FILE;
+  QFile file(fileName + ".new");
+  if(!file.open(QIODevice::WriteOnly))
+    return false;
+
+  file.write((const char*)&header, sizeof(header));
+  file.write((const char*)newMean.constData(), 4*newMean.size());
+  file.write((const char*)newComponents.constData(), 4*newComponents.size());
+  for(int i=0; i<count; i++)
+    file.write((const char*)(newPoints.constData() + order[i]*newReduced), 4*newReduced);
+  for(int i=0; i<count; i++)
+  {
+    qint32 entry[3] = { newEntries[3*order[i]], newEntries[3*order[i]+1], splits[i] };
+    file.write((const char*)entry, sizeof(entry));
+  }
+  file.write(tableData);
+  bool written = file.error() == QFile::NoError;
+  file.close();
+
+  if(!written || (QFile::exists(fileName) && !QFile::remove(fileName)) || !file.rename(fileName))
+    return false;
+
+  return open();
+}
+
+
+QList<PoseMatch> PoseIndex::nearest(Animation* anim, int frame, int k) const
+{
+  QList<PoseMatch> result;
+  if(map == NULL || posesCount == 0 || k < 1)
+    return result;
+
+  PoseFeatures features(anim, frame, frame);
+  if(features.frames() != 1 || features.jointNames() != jointNames)
+    return result;
+
+  QVector<float> x(dimensions);
+  features.euclidean(0, x.data());
+  QVector<float> query(reducedDimensions);
+  for(int r=0; r<reducedDimensions; r++)
+  {
+    const float* axis = components + r*dimensions;
+    float value = 0.0f;
+    for(int i=0; i<dimensions; i++)
+      value += (x[i]-mean[i]) * axis[i];
+    query[r] = value;
+  }
+
+  QList<QPair<float, int> > best;
+  search(query.constData(), 0, posesCount, k, best);
+
+  for(int i=0; i<best.size(); i++)
+  {
+    PoseMatch match;
+    int point = best.at(i).second;
+    match.file = dir + "/" + indexedFiles.at(entries[3*point]).name;
+    match.frame = entries[3*point+1];
+    match.distance = best.at(i).first;
+    result.append(match);
+  }
+
+  return result;
+}
+
+
+/*! Nearest neighbour search in the subtree of points first..last-1. @param best keeps (distance, point)
+    of up to @param k closest points found so far, sorted by distance. !*/
+void PoseIndex::search(const float* query, int first, int last, int k, QList<QPair<float, int> >& best) const
+{
+  if(first >= last)
+    return;
+
+  int middle = (first+last)/2;
+  const float* point = points + middle*reducedDimensions;
+  float distance = 0.0f;
+  for(int r=0; r<reducedDimensions; r++)
+    distance += (query[r]-point[r]) * (query[r]-point[r]);
+
+  if(best.size() < k || distance < best.last().first)
+  {
+    int i = best.size();
+    while(i > 0 && best.at(i-1).first > distance)
+      i--;
+    best.insert(i, qMakePair(distance, middle));
+    if(best.size() > k)
+      best.removeLast();
+  }
+
+  int axis = entries[3*middle+2];
+  float difference = query[axis] - point[axis];
+  if(difference < 0.0f)
+  {
+    search(query, first, middle, k, best);
+    if(best.size() < k || difference*difference < best.last().first)
+      search(query, middle+1, last, k, best);
+  }
+  else
+  {
+    search(query, middle+1, last, k, best);
+    if(best.size() < k || difference*difference < best.last().first)
+      search(query, first, middle, k, best);
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef POSEINDEX_H
+#define POSEINDEX_H
+
+#include <QDateTime>
+#include <QFile>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class Animation;
+
+
+/** Posture found by PoseIndex::nearest() */
+struct PoseMatch
+{
+  QString file;         //absolute path of the animation file
+  int frame;
+  float distance;       //squared distance in the reduced posture space
+};
+
+
+/** Index of postures of all animation files (BVH, AVM) in one directory. Posture features are
+    reduced by principal component analysis and kept in a KD-tree, which is stored in a file in
+    the directory and memory-mapped. Queries for nearest postures only touch the visited nodes.
+    Files that change are indexed again on update(), the others are taken from the index file. */
+class PoseIndex
+{
+  public:
+    PoseIndex(const QString& directory);
+    ~PoseIndex();
+
+    /** Maps index file of the directory into memory. Returns FALSE if there's none or it's broken. */
+    bool open();
+    /** Indexes animation files that are new or changed since the index was written, forgets removed
+        ones and writes the index anew. Returns number of files read, -1 if the index can't be written. */
+    int update();
+
+    QString directory() const       { return dir; }
+    int files() const               { return indexedFiles.size(); }
+    int poses() const               { return posesCount; }
+
+    /** @param k postures closest to posture @param frame of @param anim, the closest first. Empty if
+        the animation has a different skeleton than the indexed ones. */
+    QList<PoseMatch> nearest(Animation* anim, int frame, int k) const;
+
+  private:
+    struct IndexedFile
+    {
+      QString name;                 //relative to the directory
+      QDateTime modified;
+      qint64 size;
+      int poses;                    //0 for files with a different skeleton
+    };
+
+    QString dir;
+    QFile indexFile;
+    uchar* map;
+    QStringList jointNames;
+    QList<IndexedFile> indexedFiles;
+    int dimensions;                 //of posture features
+    int reducedDimensions;
+    int posesCount;
+    const float* mean;              //[dimensions]
+    const float* components;        //[reducedDimensions*dimensions], principal axes
+    const float* points;            //[posesCount*reducedDimensions], in KD-tree order
+    const qint32* entries;          //[posesCount*3], file, frame and split dimension of each point
+
+    void close();
+    void search(const float* query, int first, int last, int k, QList<QPair<float, int> >& best) const;
+    bool write(const QVector<float>& newMean, const QVector<float>& newComponents, int newReduced,
+               QVector<float>& newPoints, QVector<qint32>& newEntries, const QList<IndexedFile>& table);
+};
+
+#endif // POSEINDEX_H
@@ -0,0 +1,79 @@
+#ifndef SECTIONSWEEP_H
+#define SECTIONSWEEP_H
+
+#include <QList>
+#include <QMap>
+#include "trailitem.cpp"
+
+
+/** Sweep over begin and end events of items sorted by their begin index. Every call of nextSection()
+    gives the following time-line section in which the set of overlapping items doesn't change.
+    Each event is handled once, so whole sweep takes O((items + sections) log items). */
+class SectionSweep
+{
+  public:
+    SectionSweep(QList<TrailItem*>& sortedItems, int lastPosition) : items(sortedItems)
+    {
+      last = lastPosition;
+      position = items.isEmpty() ? lastPosition+1 : items.first()->beginIndex();
+      nextItem = 0;
+      lastEnded = NULL;
+    }
+
+    /** Fills section's first and last position and indices of items overlapping it (in ascending
+        order). Returns FALSE if there are no more sections. */
+    bool nextSection(int& start, int& end, QList<int>& activeIndices)
+    {
+      if(position > last)
+        return false;
+
+      //drop items that ended before this section
+      while(!endings.isEmpty() && endings.begin().key() < position)
+      {
+        foreach(int index, endings.begin().value())
+        {
+          active.remove(index);
+          if(!items[index]->isShadow() && (lastEnded==NULL || items[index]->endIndex() >= lastEnded->endIndex()))
+            lastEnded = items[index];
+        }
+        endings.erase(endings.begin());
+      }
+
+      //add items beginning with it
+      while(nextItem < items.size() && items[nextItem]->beginIndex() <= position)
+      {
+        if(items[nextItem]->endIndex() >= position)
+        {
+          active.insert(nextItem, true);
+          endings[items[nextItem]->endIndex()].append(nextItem);
+        }
+        nextItem++;
+      }
+
+      //section lasts until the next begin or end
+      end = last;
+      if(nextItem < items.size() && items[nextItem]->beginIndex()-1 < end)
+        end = items[nextItem]->beginIndex()-1;
+      if(!endings.isEmpty() && endings.begin().key() < end)
+        end = endings.begin().key();
+
+      start = position;
+      activeIndices = active.keys();
+      position = end+1;
+      return true;
+    }
+
+    /** Non-shadow item that ended last before current section. NULL if none did yet */
+    TrailItem* lastEndedItem() { return lastEnded; }
+
+  private:
+    QList<TrailItem*>& items;
+    int last;
+    int position;                       //first position of next section
+    int nextItem;                       //index of first item that hasn't begun yet
+    QMap<int, bool> active;             //indices of overlapping items
+    QMap<int, QList<int> > endings;     //indices of overlapping items by their end position
+    TrailItem* lastEnded;
+};
+
+#endif // SECTIONSWEEP_H
@@ -1,7 +1,9 @@
 #include <QAction>
 #include <QCursor>
 #include <QContextMenuEvent>
+#include <QInputDialog>
 #include <QMenu>
+#include <QMessageBox>
 #include <QPainter>
 #include <QPalette>
 #include <QSize>
@@ -24,6 +26,8 @@
 #define ZOOM_STEP        4     //TODO: the zooming
 #define MAX_TRAIL_FRAMES 4000
 #define MAX_WEIGHT       100.0 //max frame weight
+#define MIN_TIME_SCALE   0.1   //slowest and..
+#define MAX_TIME_SCALE   10.0  //..fastest play of an item
 
 
 int TimelineTrail::_positionWidth = MIN_FRAME_WIDTH;
@@ -59,6 +63,15 @@ TimelineTrail::TimelineTrail(QWidget* parent, Qt::WindowFlags, QString debugName
   connect(mixZonesAction, SIGNAL(triggered()), this, SLOT(setMixZones()));
   limbWeightsAction = new QAction(tr("Set limbs' weights"), this);
   connect(limbWeightsAction, SIGNAL(triggered()), this, SLOT(showLimbsWeight()));
+  additiveAction = new QAction(tr("Add on top of other animations"), this);
+  additiveAction->setCheckable(true);
+  connect(additiveAction, SIGNAL(triggered()), this, SLOT(switchAdditive()));
+  speedAction = new QAction(tr("Set speed..."), this);
+  connect(speedAction, SIGNAL(triggered()), this, SLOT(setItemSpeed()));
+  transitionAction = new QAction(tr("Find transition from previous animation"), this);
+  connect(transitionAction, SIGNAL(triggered()), this, SLOT(findTransition()));
+  similarPosesAction = new QAction(tr("Find similar postures in library..."), this);
+  connect(similarPosesAction, SIGNAL(triggered()), this, SLOT(findSimilarPoses()));
 
   _debugName = debugName;
 }
@@ -269,6 +282,49 @@ void TimelineTrail::updateTimelineItemsIndices()
   }
 }
 
+bool TimelineTrail::MoveItem(TrailItem* item, int beginPosition)
+{
+  if(beginPosition < 0)
+    return false;
+  clearShadowItems();
+
+  int endFrame = beginPosition + item->frames() - 1;
+  if((item->previousItem() != NULL && item->previousItem()->endIndex() >= beginPosition) ||
+     (item->nextItem() != NULL && item->nextItem()->beginIndex() <= endFrame))
+    return false;
+
+  if(endFrame+2 > positionsCount && !coerceExtension(endFrame+2 - positionsCount))
+    return false;
+
+  item->setBeginIndex(beginPosition);
+  trailContentChange();
+  repaint();
+  return true;
+}
+
+bool TimelineTrail::RetimeItem(TrailItem* item, double timeScale)
+{
+  if(item->isShadow() || timeScale < MIN_TIME_SCALE || timeScale > MAX_TIME_SCALE)
+    return false;
+  clearShadowItems();
+
+  emit itemContentChanging(item);
+  double oldScale = item->timeScale();
+  item->setTimeScale(timeScale);
+  int endFrame = item->endIndex();
+  if((item->nextItem() != NULL && item->nextItem()->beginIndex() <= endFrame) ||
+     (endFrame+2 > positionsCount && !coerceExtension(endFrame+2 - positionsCount)))
+  {
+    item->setTimeScale(oldScale);
+    emit itemContentKept(item);
+    return false;
+  }
+
+  trailContentChange();
+  repaint();
+  return true;
+}
+
 bool TimelineTrail::isSuitableSpace(int beginPosition, int positionsCount)
 {
   int endFrame = beginPosition+positionsCount-1;
@@ -346,6 +402,8 @@ void TimelineTrail::drawTrailItem(TrailItem* item)
     selFrameColor = QColor("#725518");
   }
 
+  if(item->isAdditive())
+    boxColor = item==selectedItem ? QColor("#41597c") : QColor("#4a5868");
   if(Settings::Instance()->Debug() && item->isShadow())
     boxColor = QColor("#55bb55");
 
@@ -610,11 +668,12 @@ void TimelineTrail::adjustFrameWeight(int cursorYPosition)
   if(touch>=0 && touch<=real_frame_height)     //not above/under the TrailItem
   {
     float weight = 100.0 * (float)touch / real_frame_height;
-    int frameIndex = currentPosition - selectedItem->beginIndex();
+    int frameIndex = selectedItem->animationFrame(currentPosition - selectedItem->beginIndex());
     int oldWeight = selectedItem->getAnimation()->getFrameWeight(frameIndex);
     int newWeight = 100 - (int)weight;
     if(oldWeight != newWeight)
     {
+      emit itemContentChanging(selectedItem);
       selectedItem->getAnimation()->setFrameWeight(frameIndex, newWeight);
 
 //DEBUG      emit trailContentChanged(_firstItem);
@@ -662,6 +721,12 @@ void TimelineTrail::contextMenuEvent(QContextMenuEvent *event)
     menu.addAction(framesWeightAction);
     menu.addAction(mixZonesAction);
     menu.addAction(limbWeightsAction);
+    additiveAction->setChecked(selectedItem->isAdditive());
+    menu.addAction(additiveAction);
+    menu.addAction(speedAction);
+    menu.addSeparator();
+    menu.addAction(transitionAction);
+    menu.addAction(similarPosesAction);
     menu.exec(event->globalPos());
   }
 }
@@ -795,7 +860,7 @@ void TimelineTrail::mouseReleaseEvent(QMouseEvent *)
   if(settingWeight)
     repaint();
   if(needsRebuild)
-    emit trailContentChanged(_firstItem);
+    emit itemContentChanged(selectedItem);
 
   leftMouseDown = rightMouseDown = false;
   settingWeight = needsRebuild = false;
@@ -827,8 +892,11 @@ void TimelineTrail::moveCurrentItem()
 void TimelineTrail::onFramesWeight()
 {
   FramesWeightDialog* fwd = new FramesWeightDialog(selectedItem);
+  emit itemContentChanging(selectedItem);         //the dialog writes the weights when accepted
   if(fwd->exec() == QDialog::Accepted)
-    emit trailContentChanged(_firstItem);
+    emit itemContentChanged(selectedItem);
+  else
+    emit itemContentKept(selectedItem);
 }
 
 void TimelineTrail::showLimbsWeight()
@@ -844,12 +912,51 @@ void TimelineTrail::setMixZones()
   mzd->exec();
   if(mzd->result() == QDialog::Accepted)
   {
+    emit itemContentChanging(selectedItem);
     selectedItem->setMixIn(mzd->mixIn());
     selectedItem->setMixOut(mzd->mixOut());
-    emit trailContentChanged(_firstItem);
+    emit itemContentChanged(selectedItem);
   }
 }
 
+/** Additive item adds its motion relative to the selected frame (or the first one). Its frame weights
+    are set to full, so the whole motion is added until the user lowers them. */
+void TimelineTrail::switchAdditive()
+{
+  WeightedAnimation* anim = selectedItem->getAnimation();
+  emit itemContentChanging(selectedItem);
+  if(anim->isAdditive())
+    anim->revertAdditive();
+  else
+    anim->makeAdditive(qMax(0, selectedItem->selectedFrame()));
+
+  repaint();
+  emit itemContentChanged(selectedItem);
+}
+
+void TimelineTrail::setItemSpeed()
+{
+  bool ok;
+  double scale = QInputDialog::getDouble(this, tr("Speed of animation"),
+                                         tr("Play '%1' this many times faster (less than 1 is slower):").arg(selectedItem->name()),
+                                         selectedItem->timeScale(), MIN_TIME_SCALE, MAX_TIME_SCALE, 2, &ok);
+  if(!ok || scale == selectedItem->timeScale())
+    return;
+
+  if(!RetimeItem(selectedItem, scale))
+    QMessageBox::warning(this, tr("Speed of animation"), tr("Not enough space for slower '%1'.").arg(selectedItem->name()));
+}
+
+void TimelineTrail::findTransition()
+{
+  emit transitionWanted(selectedItem);
+}
+
+void TimelineTrail::findSimilarPoses()
+{
+  emit similarPosesWanted(selectedItem);
+}
+
 void TimelineTrail::onMovingItem(TrailItem* draggedItem)
 {
   QCursor movCur(Qt::SizeAllCursor);
@@ -23,6 +23,12 @@ class TimelineTrail : public QFrame
     bool AddAnimation(WeightedAnimation* anim, QString title);
     /** Clear content of this trail and set new with given first TrailItem */
     void ResetContent(TrailItem* first);
+    /** Move @param item of this trail to new begin position, if it doesn't hit its neighbours.
+        Returns FALSE if there's not enough space. */
+    bool MoveItem(TrailItem* item, int beginPosition);
+    /** Make @param item play @param timeScale times faster. Returns FALSE if the longer item
+        would hit the next one. */
+    bool RetimeItem(TrailItem* item, double timeScale);
     int animationCount() const          { return _animationCount; }
     TrailItem* firstItem() const        { return _firstItem; }
     TrailItem* lastItem() const         { return _lastItem; }
@@ -59,6 +65,17 @@ class TimelineTrail : public QFrame
 
     /** A change on this trail was made requiring overall animation to be recalculated */
     void trailContentChanged(TrailItem* firstItem);
+    /** Weights, mix zones or speed of an item are about to change. Emitted before anything is written,
+        so whoever reads them (e.g. background blending) can stop first. */
+    void itemContentChanging(TrailItem* item);
+    /** The change announced by itemContentChanging() wasn't made after all */
+    void itemContentKept(TrailItem* item);
+    /** Weights or mix zones of an item were changed, but nothing has moved on the time-line */
+    void itemContentChanged(TrailItem* item);
+    /** User wishes to find where the item should begin to follow the animation before it */
+    void transitionWanted(TrailItem* item);
+    /** User wants to find postures similar to selected frame of @param item in an animation library */
+    void similarPosesWanted(TrailItem* item);
 
 
 
@@ -76,6 +93,10 @@ class TimelineTrail : public QFrame
     void onFramesWeight();
     void showLimbsWeight();
     void setMixZones();
+    void switchAdditive();
+    void setItemSpeed();
+    void findTransition();
+    void findSimilarPoses();
 
   protected:
     int positionsCount;
@@ -99,7 +120,11 @@ class TimelineTrail : public QFrame
     QAction* moveItemAction;
     QAction* mixZonesAction;
     QAction* limbWeightsAction;
+    QAction* additiveAction;
+    QAction* speedAction;
     QAction* framesWeightAction;
+    QAction* transitionAction;
+    QAction* similarPosesAction;
 
 
     void clearShadowItems();
@@ -1,12 +1,31 @@
 #ifndef TRAILITEM_C
 #define TRAILITEM_C
 
+#include <math.h>
 #include "announcer.h"
 #include "weightedanimation.h"
 
 
+/** Content of a shadow TrailItem. It doesn't own any animation data, it only tells which two
+    postures of real items are interpolated and how the frame weights of the shadow go. */
+struct ShadowPosture
+{
+  WeightedAnimation* anim1;
+  int frame1;
+  WeightedAnimation* anim2;
+  int frame2;
+  //frame weight of n-th frame is (weightFirst + n*weightStep)/weightDivisor percent,
+  //weightDivisor 0 means constant weight weightFirst
+  int weightFirst;
+  int weightStep;
+  int weightDivisor;
+};
+
+
 /** Wrapper for an WeightedAnimation item on BlenderTimeline. TrailItems are supposed
-    to build a linked list order by first frame number. */
+    to build a linked list order by first frame number. Frames of an item are its positions
+    on time-line. They're frames of the animation unless the animation is retimed, see
+    WeightedAnimation::timeScale() and animationPosition(). */
 class TrailItem
 {
   public:
@@ -24,6 +43,21 @@ class TrailItem
       previous = 0;
       next = 0;
       this->shadow = isShadow;
+      framesCount = 0;
+    }
+
+    /** Shadow item made only of a view to postures of other items. Nothing is allocated for it. */
+    TrailItem(const ShadowPosture& posture, QString name, int begin, int frames)
+    {
+      this->animation = NULL;
+      this->posture = posture;
+      framesCount = frames;
+      _name = name;
+      this->begin = begin;
+      _selectedFrame = -1;
+      previous = 0;
+      next = 0;
+      this->shadow = true;
     }
 
     const QString& name() const       { return _name; }       //mainly for debug purposes so far
@@ -32,33 +66,69 @@ class TrailItem
     //convenience method
     void shiftBeginIndex(int beginOffset) { begin += beginOffset; }
     int endIndex()                    { return begin + frames() -1; }
+    /** NULL for shadow items, see shadowPosture() */
     WeightedAnimation* getAnimation() { return animation; }
+    const ShadowPosture& shadowPosture() const { return posture; }
     /*! Get user-defined overall weight of a frame on given position.
         For blending purposes. !*/
     int getWeight(int frameIndex) const {
 
+      if(animation == NULL)
+      {
+        if(posture.weightDivisor == 0)
+          return posture.weightFirst;
+        double value = (double)(posture.weightFirst + frameIndex*posture.weightStep) / (double)posture.weightDivisor;
+        return (int)(value*100);
+      }
 //      try{      //DEBUG
-        return animation->getFrameWeight(frameIndex);
+        return animation->getFrameWeight(animationFrame(frameIndex));
 /*      }
       catch(QString* ex){
         return -1;
       }   */
 
     }
-    /** Number of frames of containing animation */
-    int frames() { return animation->getNumberOfFrames(); }
+    /** Number of time-line positions the item takes */
+    int frames()
+    {
+      if(animation == NULL)
+        return framesCount;
+      int count = animation->getNumberOfFrames();
+      if(animation->timeScale() == 1.0 || count < 2)
+        return count;
+      return (int)ceil((count-1) / animation->timeScale() - 0.001) + 1;
+    }
+    double timeScale() const { return animation==NULL ? 1.0 : animation->timeScale(); }
+    void setTimeScale(double scale) { if(animation!=NULL) animation->setTimeScale(scale); }
+    /** Frame of the animation, possibly fractional, played in @param frameIndex of this item */
+    double animationPosition(int frameIndex) const
+    {
+      if(animation == NULL)
+        return frameIndex;
+      return qBound(0.0, frameIndex * animation->timeScale(), (double)(animation->getNumberOfFrames()-1));
+    }
+    /** Nearest frame of the animation played in @param frameIndex of this item */
+    int animationFrame(int frameIndex) const { return (int)(animationPosition(frameIndex) + 0.5); }
+    /** Frame of this item playing frame @param animationFrame of the animation */
+    int framePosition(int animationFrame) const
+    {
+      return animation==NULL ? animationFrame : (int)(animationFrame / animation->timeScale() + 0.5);
+    }
     /** Size of mix-in zone */
-    int mixIn() { return animation->mixIn(); }
-    void setMixIn(int mixIn) { animation->setMixIn(mixIn); }
+    int mixIn() { return animation==NULL ? 0 : animation->mixIn(); }
+    void setMixIn(int mixIn) { if(animation!=NULL) animation->setMixIn(mixIn); }
     /** Size of mix-out zone */
-    int mixOut() { return animation->mixOut(); }
-    void setMixOut(int mixOut) { animation->setMixOut(mixOut); }
+    int mixOut() { return animation==NULL ? 0 : animation->mixOut(); }
+    void setMixOut(int mixOut) { if(animation!=NULL) animation->setMixOut(mixOut); }
+    /** Additive items are added on top of the others, see WeightedAnimation::isAdditive() */
+    bool isAdditive() { return animation!=NULL && animation->isAdditive(); }
+    int additiveReference() { return animation==NULL ? 0 : animation->additiveReference(); }
     /** Highlight @param frameIndex because it's became selected frame.
         GREAT CAUTION: this DOES NOT change the current frame of the underlying
         animation. It only highlights frame of this Item. */
     void selectFrame(int frameIndex)
     {
-      if(frameIndex<0 || frameIndex>=animation->getNumberOfFrames())
+      if(frameIndex<0 || frameIndex>=frames())
       {
         Announcer::Exception(NULL, "Argument exception: frame index out of range.");
         return;
@@ -70,7 +140,9 @@ class TrailItem
     }
     /** Currently highlighted frame of animation. The value has meaning
         only if this item is also highlighted on a timeline. */
-    int selectedFrame() { return _selectedFrame; }            //TODO: no, no! The selected frame of underlying animation should be returned
+    int selectedFrame() { return _selectedFrame<0 ? _selectedFrame : animationFrame(_selectedFrame); }
+    /** Currently highlighted frame of this item (time-line position from its begin), -1 if none */
+    int selectedPosition() const { return _selectedFrame; }
     TrailItem* nextItem() { return next; }
     void setNextItem(TrailItem* nextItem) { this->next=nextItem; }
     TrailItem* previousItem() { return previous; }
@@ -87,6 +159,8 @@ class TrailItem
     int begin;
     int _selectedFrame;
     WeightedAnimation* animation;
+    ShadowPosture posture;            //only for shadows
+    int framesCount;                  //only for shadows
     TrailItem* next;
     TrailItem* previous;
     bool shadow;
@@ -15,6 +15,9 @@ WeightedAnimation::WeightedAnimation(BVH* newBVH,const QString& bvhFile) : Anima
     _mixIn = _mixOut = frames_count/2;
   else
     _mixIn = _mixOut = MIX_IN_OUT;
+  _additive = false;
+  _additiveReference = 0;
+  _timeScale = 1.0;
 
   frameWeights = new int[frames_count];
   for(int i=0; i<frames_count; i++)
@@ -23,6 +26,33 @@ WeightedAnimation::WeightedAnimation(BVH* newBVH,const QString& bvhFile) : Anima
   linearBones = new QMap<QString, BVHNode*>();
   linearBones->insert(positionNode->name(), positionNode);
   initializeLinearBonesHelper(getMotion());
+
+  bonesCount = BVH::getValidNodeNames().size();
+  relativeWeights.resize(frames_count*bonesCount);
+}
+
+WeightedAnimation::WeightedAnimation(BVH* newBVH, WeightedAnimation* source) : Animation(newBVH, source)
+{
+  int frames_count = source->getNumberOfFrames();
+  _tPosed = source->_tPosed;
+  _mixIn = source->_mixIn;
+  _mixOut = source->_mixOut;
+  _additive = source->_additive;
+  _additiveReference = source->_additiveReference;
+  _timeScale = source->_timeScale;
+  weightsBeforeAdditive = source->weightsBeforeAdditive;
+  pOffset = source->pOffset;
+
+  frameWeights = new int[frames_count];
+  for(int i=0; i<frames_count; i++)
+    frameWeights[i] = source->frameWeights[i];
+
+  linearBones = new QMap<QString, BVHNode*>();
+  linearBones->insert(positionNode->name(), positionNode);
+  initializeLinearBonesHelper(getMotion());
+
+  bonesCount = source->bonesCount;
+  relativeWeights = source->relativeWeights;
 }
 
 WeightedAnimation::~WeightedAnimation()     //edu: ~Animation() called automatically
@@ -34,9 +64,32 @@ WeightedAnimation::~WeightedAnimation()     //edu: ~Animation() called automatic
 void WeightedAnimation::setNumberOfFrames(int num)
 {
   frameWeights = (int*) realloc(frameWeights, num * sizeof(int));
+  relativeWeights.resize(num*bonesCount);
   Animation::setNumberOfFrames(num);
 }
 
+void WeightedAnimation::resample(int fps)
+{
+  int oldFrames = totalFrames;
+  QVector<int> oldWeights(oldFrames);
+  for(int i=0; i<oldFrames; i++)
+    oldWeights[i] = frameWeights[i];
+
+  Animation::resample(fps);
+  if(totalFrames == oldFrames)
+    return;
+
+  double scale = (totalFrames-1) / (double)(oldFrames-1);
+  for(int i=0; i<totalFrames; i++)
+    frameWeights[i] = oldWeights.at(qMin((int)(i/scale + 0.5), oldFrames-1));
+
+  if(_mixIn > 0)
+    _mixIn = (int)(_mixIn*scale + 0.5);
+  if(_mixOut > 0)
+    _mixOut = (int)(_mixOut*scale + 0.5);
+  _additiveReference = qMin((int)(_additiveReference*scale + 0.5), totalFrames-1);
+}
+
 int WeightedAnimation::getFrameWeight(int frameIndex)
 {
   if(frameIndex < 0 || frameIndex >= totalFrames)
@@ -68,6 +121,21 @@ void WeightedAnimation::setFrameWeight(int frameIndex, int weight)
     frameWeights[frameIndex] = weight;
 }
 
+double WeightedAnimation::getRelativeWeight(int position, BVHNode* limb) const
+{
+  int boneIndex = BVH::getValidNodeNames().indexOf(limb->name());
+  if(boneIndex < 0 || position < 0 || (position+1)*bonesCount > relativeWeights.size())
+    return -1.0;
+  return getRelativeWeight(position, boneIndex);
+}
+
+double WeightedAnimation::getRelWeight(BVHNode* node)
+{
+  if(node != NULL)
+    return getRelativeWeight((int)(frame / _timeScale + 0.5), node);     //a position playing the frame
+  return -1.0;
+}
+
 int WeightedAnimation::currentFrameWeight()
 {
   return frameWeights[frame];
@@ -83,6 +151,51 @@ void WeightedAnimation::setCurrentFrameWeight(int weight)
 }
 
 
+void WeightedAnimation::makeAdditive(int referenceFrame)
+{
+  weightsBeforeAdditive.resize(totalFrames);
+  for(int i=0; i<totalFrames; i++)
+  {
+    weightsBeforeAdditive[i] = frameWeights[i];
+    frameWeights[i] = 100;
+  }
+  setAdditive(true, referenceFrame);
+}
+
+void WeightedAnimation::revertAdditive()
+{
+  setAdditive(false);
+  int saved = weightsBeforeAdditive.size();
+  if(saved == 0)                //additive since loaded, nothing to go back to
+    return;
+
+  //frames may have been resampled since
+  double scale = (saved == totalFrames || saved < 2 || totalFrames < 2) ? 1.0 : (totalFrames-1) / (double)(saved-1);
+  for(int i=0; i<totalFrames; i++)
+    frameWeights[i] = weightsBeforeAdditive.at(qMin((int)(i/scale + 0.5), saved-1));
+  weightsBeforeAdditive.clear();
+}
+
+int WeightedAnimation::weightBeforeAdditive(int frameIndex) const
+{
+  if(frameIndex < 0 || frameIndex >= weightsBeforeAdditive.size())
+    return -1;
+  return weightsBeforeAdditive.at(frameIndex);
+}
+
+void WeightedAnimation::setWeightBeforeAdditive(int frameIndex, int weight)
+{
+  if(frameIndex < 0 || frameIndex >= totalFrames || weight < 0 || weight > 100)
+  {
+    Announcer::Exception(NULL, "(WeightedAnimation::setWeightBeforeAdditive) Argument exception: frame index or weight out of range");
+    return;
+  }
+  if(weightsBeforeAdditive.size() != totalFrames)
+    weightsBeforeAdditive.fill(50, totalFrames);
+  weightsBeforeAdditive[frameIndex] = weight;
+}
+
+
 void WeightedAnimation::initializeLinearBonesHelper(BVHNode* bone)
 {
   if(!linearBones->contains(bone->name()))
@@ -3,6 +3,7 @@
 
 #include "animation.h"
 #include "QMap"
+#include <QVector>
 
 class QString;
 class BVH;
@@ -13,9 +14,13 @@ class WeightedAnimation : public Animation
 {
 public:
   WeightedAnimation(BVH* newBVH, const QString& bvhFile);
+  /** Copy of @param source, sharing its key frames until one of them changes them. Nothing gets loaded. */
+  WeightedAnimation(BVH* newBVH, WeightedAnimation* source);
   ~WeightedAnimation();
 
   virtual void setNumberOfFrames(int num);
+  /** Also moves frame weights, mix zones and the additive reference frame to the new frames */
+  virtual void resample(int fps);
 
   /*! Return skeleton of BVHNode 'bones' lined up to map. Key is node name (like 'lArm').
       Usefull when passing through skeleton to use iterative approach instead recursive.
@@ -26,12 +31,43 @@ public:
   void setCurrentFrameWeight(int weight);
   void setFrameWeight(int frameIndex, int weight);
 
+  /*! Relative weight of a bone as evaluated by Blender. It's kept by time-line positions of the item
+      from its begin (frames resampled by timeScale()), not by frames of the animation, as a slowed
+      down animation plays one frame in more positions. Bones are indexed as in BVH::getValidNodeNames(). !*/
+  double getRelativeWeight(int position, int boneIndex) const
+                                  { return relativeWeights[position*bonesCount + boneIndex]; }
+  void setRelativeWeight(int position, int boneIndex, double weight)
+                                  { relativeWeights[position*bonesCount + boneIndex] = weight; }
+  /*! Same as above for a bone of this animation. Returns -1.0 for other nodes. !*/
+  double getRelativeWeight(int position, BVHNode* limb) const;
+  /*! Makes room for relative weights of @param positions time-line positions !*/
+  void setRelativeWeightPositions(int positions)  { relativeWeights.resize(positions*bonesCount); }
+  virtual double getRelWeight(BVHNode* node);
+
   /** If TRUE, the first frame is key-frame and the avatar stands in T-pose (location doesn't matter) */
   bool isFirstFrameTPose() const  { return _tPosed; }
   int mixIn() const               { return _mixIn; }
   int mixOut() const              { return _mixOut; }
   void setMixIn(int mixIn)        { _mixIn = mixIn; }
   void setMixOut(int mixOut)      { _mixOut = mixOut; }
+  /** Additive animation isn't averaged with the others. Its motion relative to the reference frame
+      is added on top of their blend, frame weights telling how much of it (100 is whole). */
+  bool isAdditive() const         { return _additive; }
+  int additiveReference() const   { return _additiveReference; }
+  void setAdditive(bool additive, int referenceFrame=0)
+                                  { _additive = additive; _additiveReference = referenceFrame; }
+  /** Makes the animation additive and whole of it added (frame weights 100). Frame weights it had
+      before are kept for revertAdditive(). */
+  void makeAdditive(int referenceFrame);
+  /** Makes additive animation averaged again, with frame weights it had before makeAdditive() */
+  void revertAdditive();
+  /** Frame weight the frame had before makeAdditive(), -1 if there is none to go back to */
+  int weightBeforeAdditive(int frameIndex) const;
+  /** Sets what revertAdditive() puts back to the frame, other frames keep the default weight */
+  void setWeightBeforeAdditive(int frameIndex, int weight);
+  /** How many times faster the animation plays when blended. Its frames are resampled, not copied. */
+  double timeScale() const        { return _timeScale; }
+  void setTimeScale(double scale) { _timeScale = scale; }
 
   /*! Position offset to align this animation when joining to another in process of blending. !*/
   Position getOffset() const      { return pOffset; }
@@ -45,8 +81,15 @@ private:
   bool _tPosed;
   int _mixIn;
   int _mixOut;
+  bool _additive;
+  int _additiveReference;
+  double _timeScale;
+  QVector<int> weightsBeforeAdditive;     //empty unless made additive by makeAdditive()
   Position pOffset;
   QMap<QString, BVHNode*>* linearBones;
+  int bonesCount;
+  /** Relative bone weights, [frame*bonesCount + bone] */
+  QVector<double> relativeWeights;
 };
 
 #endif // WEIGHTEDANIMATION_H
@@ -24,8 +24,14 @@
 #endif
 
 #include <iostream>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
+
+#include <QFuture>
+#include <QThread>
+#include <QVector>
+#include <QtConcurrentRun>
 // #include "main.h"
 
 #include "animation.h"
@@ -39,7 +45,7 @@
   */
 
 Animation::Animation(BVH* newBVH,const QString& bvhFile) :
-  frame(0),totalFrames(0),mirrored(false)
+  frame(0),totalFrames(0),mirrored(false),ikSolver(IKTree::SOLVER_CCD),ikSolvedFrame(-1)
 {
   qDebug("Animation::Animation(%lx)",(unsigned long) this);
 
@@ -93,6 +99,40 @@ Animation::Animation(BVH* newBVH,const QString& bvhFile) :
   connect(&timer,SIGNAL(timeout()),this,SLOT(playbackTimeout()));
 }
 
+Animation::Animation(BVH* newBVH,Animation* source) :
+  frame(0),totalFrames(0),mirrored(false),ikSolver(IKTree::SOLVER_CCD),ikSolvedFrame(-1)
+{
+  qDebug("Animation::Animation(%lx) copy of %lx",(unsigned long) this,(unsigned long) source);
+
+  bvh=newBVH;
+  dataPath=source->dataPath;
+
+  frames=bvh->bvhCopy(source->frames,NULL);
+  positionNode=bvh->bvhCopy(source->positionNode,NULL);
+  calcPartMirrors();
+  useRotationLimits(true);
+  setNumberOfFrames(source->totalFrames);
+  setAvatarScale(source->avatarScale);
+  setFigureType(source->figureType);
+  setLoopInPoint(source->loopInPoint);
+  setLoopOutPoint(source->loopOutPoint);
+  framesPerSecond=source->framesPerSecond;
+
+  ikTree.set(frames);
+  setIK(IK_LHAND, false);
+  setIK(IK_RHAND, false);
+  setIK(IK_LFOOT, false);
+  setIK(IK_RFOOT, false);
+
+  setLoop(false);
+  setDirty(false);
+
+  currentPlayTime=0.0;
+  setPlaystate(PLAYSTATE_STOPPED);
+
+  connect(&timer,SIGNAL(timeout()),this,SLOT(playbackTimeout()));
+}
+
 
 Animation::~Animation()
 {
@@ -356,6 +396,7 @@ void Animation::setIK(IKPartType part,bool flag)
   if(ikOn[part]==flag) return;
 
   ikOn[part]=flag;
+  ikSolvedFrame=-1;
 
   if(flag)
   {
@@ -480,32 +521,130 @@ bool Animation::getIK(IKPartType part)
   return ikOn[part];
 }
 
-void Animation::solveIK()
+void Animation::markIKEffectors()
 {
   bvh->bvhResetIK(frames);
   if(ikOn[IK_LFOOT]) getEndSite("lFoot")->ikOn=true;
   if(ikOn[IK_RFOOT]) getEndSite("rFoot")->ikOn=true;
   if(ikOn[IK_LHAND]) getEndSite("lHand")->ikOn=true;
   if(ikOn[IK_RHAND]) getEndSite("rHand")->ikOn=true;
+}
+
+void Animation::solveIK()
+{
+  markIKEffectors();
 
 //  ikTree.setJointLimits(true);
   ikTree.solve(frame);
+  ikSolvedFrame=frame;
 }
 
-void Animation::setRotation(BVHNode* node,double x,double y,double z)
+/** Solves IK after the keyframes of the changed joints were edited on the current frame.
+    If the IK state of this frame is still valid (seeded), only the chains below the changed
+    joints get solved again, starting from their last pose. */
+void Animation::updateIK(const QList<BVHNode*>& changed,bool seeded)
 {
-  if (node)
+  for(int i=0;i<NUM_IK;i++)
   {
-    //qDebug(QString("Animation::setRotation(")+jointName+")");
-
-    for(int i=0;i<NUM_IK;i++)
+    if(ikOn[i])
     {
-      if(ikOn[i])
+      if(seeded)
       {
-        solveIK();
-        break;
+        ikTree.solve(frame,changed);
+        ikSolvedFrame=frame;
       }
+      else
+        solveIK();
+      return;
+    }
+  }
+}
+
+/** Worker for bakeIK(). Solves the frames first..last with its own IKTree, each frame
+    starting from the pose of the one before. Only reads the nodes, results go to
+    solutions[frame-offset]. */
+static void bakeIKRange(IKTree* tree,int first,int last,int offset,QVector<IKSolution>* solutions)
+{
+  for(int i=first;i<=last;i++)
+  {
+    tree->solveFrame(i,i!=first);
+    tree->getSolution((*solutions)[i-offset]);
+  }
+}
+
+void Animation::bakeIK(int first,int last)
+{
+  first=qMax(first,0);
+  last=qMin(last,totalFrames-1);
+  if(first>last) return;
+
+  bool active=false;
+  for(int i=0;i<NUM_IK;i++)
+    active|=ikOn[i];
+  if(!active) return;
+
+  markIKEffectors();
+
+  // split the range into one chunk of consecutive frames per thread, so seeding
+  // from the previous frame works inside each chunk
+  int numFrames=last-first+1;
+  int numThreads=qBound(1,QThread::idealThreadCount(),numFrames);
+  int chunk=(numFrames+numThreads-1)/numThreads;
+
+  QVector<IKSolution> solutions(numFrames);
+  QList<IKTree*> trees;
+  QList<QFuture<void> > workers;
+  for(int from=first;from<=last;from+=chunk)
+  {
+    int to=qMin(from+chunk-1,last);
+    IKTree* tree=new IKTree(frames);
+    tree->setJointLimits(limits);
+    tree->setSolver(ikSolver);
+    trees.append(tree);
+    workers.append(QtConcurrent::run(bakeIKRange,tree,from,to,first,&solutions));
+  }
+  for(int i=0;i<workers.count();i++)
+    workers[i].waitForFinished();
+  qDeleteAll(trees);
+
+  // keyframes are only written after all workers are done reading them
+  QList<BVHNode*> touched;
+  for(int i=0;i<numFrames;i++)
+  {
+    const IKSolution& solution=solutions.at(i);
+    int bakeFrame=first+i;
+
+    for(int j=0;j<solution.joints.count();j++)
+    {
+      BVHNode* node=solution.joints.at(j);
+      if(node->isKeyframe(bakeFrame))
+        node->setKeyframeRotation(bakeFrame,solution.rotations.at(j));
+      else
+        node->addKeyframe(bakeFrame,node->frameData(bakeFrame).position(),solution.rotations.at(j));
+
+      if(!touched.contains(node)) touched.append(node);
     }
+  }
+
+  for(int i=0;i<touched.count();i++)
+    emit redrawTrack(getPartIndex(touched.at(i)));
+
+  setDirty(true);
+  // the keyframes already hold the IK pose now, so this clears the offsets
+  solveIK();
+  emit frameChanged();
+}
+
+void Animation::setRotation(BVHNode* node,double x,double y,double z)
+{
+  if (node)
+  {
+    //qDebug(QString("Animation::setRotation(")+jointName+")");
+
+    // the IK state is outdated by setDirty() below, so check now if it can be reused
+    bool ikSeeded=(ikSolvedFrame==frame);
+    QList<BVHNode*> changed;
+    changed.append(node);
 
     if(node->isKeyframe(frame))
     {
@@ -534,8 +673,10 @@ void Animation::setRotation(BVHNode* node,double x,double y,double z)
 
       // tell timeline that this mirrored keyframe has changed (added or changed is the same here)
       emit redrawTrack(getPartIndex(mirrorNode));
+      changed.append(mirrorNode);
     }
     setDirty(true);
+    updateIK(changed,ikSeeded);
     // tell timeline that this keyframe has changed (added or changed is the same here)
     emit redrawTrack(getPartIndex(node));
     emit frameChanged();
@@ -582,10 +723,18 @@ Rotation Animation::getGlobalRotation(BVHNode* node)
 }
 
 
+void Animation::useJacobianIK(bool flag)
+{
+  ikSolver=flag ? IKTree::SOLVER_DLS : IKTree::SOLVER_CCD;
+  ikTree.setSolver(ikSolver);
+  ikSolvedFrame=-1;
+}
+
 void Animation::useRotationLimits(bool flag)
 {
   limits=flag;
   ikTree.setJointLimits(flag);
+  ikSolvedFrame=-1;
 }
 
 RotationLimits Animation::getRotationLimits(BVHNode* node)
@@ -629,14 +778,9 @@ int Animation::getRotationOrder(const QString& jointName)
 
 void Animation::setPosition(double x,double y,double z)
 {
-  for(int i=0;i<NUM_IK;i++)
-  {
-    if(ikOn[i])
-    {
-      solveIK();
-      break;
-    }
-  }
+  // the IK state is outdated by setDirty() below, so check now if it can be reused
+  bool ikSeeded=(ikSolvedFrame==frame);
+
   // new keyframe system
   if(positionNode->isKeyframe(frame))
   {
@@ -663,6 +807,9 @@ void Animation::setPosition(double x,double y,double z)
 
 
   setDirty(true);
+  QList<BVHNode*> changed;
+  changed.append(root);
+  updateIK(changed,ikSeeded);
   // tell timeline that this keyframe has changed (added or changed is the same here)
   emit redrawTrack(0);
   emit frameChanged();
@@ -1065,6 +1212,344 @@ void Animation::deleteFrame(int track,int pos)
   emit frameChanged();
 }
 
+/** Joints and source data of resample(). Rotations are kept frame by frame, so one output frame
+    reads the rows of two source frames and goes through all joints in one run. */
+struct ResampleJob
+{
+  QList<BVHNode*> joints;
+  int sourceFrames;
+  double step;                        // source frames per output frame
+  QVector<MT_Quaternion> source;      // [frame*joints+joint]
+  QVector<Position> sourcePositions;  // [frame]
+  QVector<Rotation> rotations;        // [frame*joints+joint], output
+  QVector<Position> positions;        // [frame], output
+};
+
+static void collectJoints(BVHNode* joint,QList<BVHNode*>& joints)
+{
+  if(joint->type!=BVH_END)
+    joints.append(joint);
+  for(int i=0;i<joint->numChildren();i++)
+    collectJoints(joint->child(i),joints);
+}
+
+// Catmull-Rom spline through p1 and p2, p0 and p3 being their outer neighbours
+static double catmullRom(double p0,double p1,double p2,double p3,double t)
+{
+  return 0.5*(2.0*p1+(p2-p0)*t+(2.0*p0-5.0*p1+4.0*p2-p3)*t*t+(3.0*(p1-p2)+p3-p0)*t*t*t);
+}
+
+/** Worker for resample(). Computes output frames first..last, only reads the job's source data. */
+static void resampleRange(ResampleJob* job,int first,int last)
+{
+  int numJoints=job->joints.count();
+  int lastSource=job->sourceFrames-1;
+
+  for(int f=first;f<=last;f++)
+  {
+    double at=qMin(f*job->step,(double) lastSource);
+    int before=(int) at;
+    int after=qMin(before+1,lastSource);
+    double t=at-before;
+
+    const MT_Quaternion* from=job->source.constData()+before*numJoints;
+    const MT_Quaternion* to=job->source.constData()+after*numJoints;
+    Rotation* out=job->rotations.data()+f*numJoints;
+    for(int j=0;j<numJoints;j++)
+    {
+      MT_Quaternion q=from[j];
+      if(t>0.0)
+      {
+        // take the shorter way round
+        MT_Quaternion target=from[j].dot(to[j])<0.0 ? MT_Quaternion(-to[j][0],-to[j][1],-to[j][2],-to[j][3])
+                                                    : to[j];
+        q=from[j].slerp(target,t);
+      }
+      IKTree::toEuler(q,job->joints.at(j)->channelOrder,out[j].x,out[j].y,out[j].z);
+    }
+
+    const Position& p0=job->sourcePositions.at(qMax(before-1,0));
+    const Position& p1=job->sourcePositions.at(before);
+    const Position& p2=job->sourcePositions.at(after);
+    const Position& p3=job->sourcePositions.at(qMin(after+1,lastSource));
+    job->positions[f]=Position(catmullRom(p0.x,p1.x,p2.x,p3.x,t),
+                               catmullRom(p0.y,p1.y,p2.y,p3.y,t),
+                               catmullRom(p0.z,p1.z,p2.z,p3.z,t));
+  }
+}
+
+void Animation::resample(int fps)
+{
+  if(!frames || fps<=1 || fps==framesPerSecond)
+    return;
+  if(totalFrames<2)
+  {
+    setFPS(fps);
+    return;
+  }
+
+  ResampleJob job;
+  collectJoints(frames,job.joints);
+  int numJoints=job.joints.count();
+  int numFrames=(int) ((totalFrames-1)*(double) fps/framesPerSecond+0.5)+1;
+  numFrames=qMax(numFrames,2);
+  job.sourceFrames=totalFrames;
+  job.step=(totalFrames-1)/(double) (numFrames-1);
+
+  job.source.resize(totalFrames*numJoints);
+  job.sourcePositions.resize(totalFrames);
+  for(int i=0;i<totalFrames;i++)
+  {
+    for(int j=0;j<numJoints;j++)
+    {
+      BVHNode* joint=job.joints.at(j);
+      job.source[i*numJoints+j]=IKTree::toQuaternion(joint,joint->frameData(i).rotation());
+    }
+    job.sourcePositions[i]=positionNode->frameData(i).position();
+  }
+  job.rotations.resize(numFrames*numJoints);
+  job.positions.resize(numFrames);
+
+  int numThreads=qBound(1,QThread::idealThreadCount(),numFrames);
+  int chunk=(numFrames+numThreads-1)/numThreads;
+  QList<QFuture<void> > workers;
+  for(int from=0;from<numFrames;from+=chunk)
+    workers.append(QtConcurrent::run(resampleRange,&job,from,qMin(from+chunk-1,numFrames-1)));
+  for(int i=0;i<workers.count();i++)
+    workers[i].waitForFinished();
+
+  // limb weights go with the nearest source frame, ease in/out is dropped
+  QList<BVHNode*> nodes=job.joints;
+  nodes.prepend(positionNode);
+  for(int n=0;n<nodes.count();n++)
+  {
+    BVHNode* node=nodes.at(n);
+    QVector<int> weights(numFrames);
+    for(int i=0;i<numFrames;i++)
+      weights[i]=node->frameData(qMin((int) (i*job.step+0.5),totalFrames-1)).weight();
+
+    QList<int> keys=node->keyframeList();
+    for(int k=0;k<keys.count();k++)
+      node->deleteKeyframe(keys.at(k));
+
+    for(int i=0;i<numFrames;i++)
+    {
+      if(node==positionNode)
+        node->addKeyframe(i,job.positions.at(i),Rotation());
+      else
+        node->addKeyframe(i,Position(),job.rotations.at(i*numJoints+n-1));
+      node->setKeyframeWeight(i,weights.at(i));
+    }
+  }
+
+  double scale=(numFrames-1)/(double) (totalFrames-1);
+  frame=qMin((int) (frame*scale+0.5),numFrames-1);
+  setLoopInPoint((int) (loopInPoint*scale+0.5));
+  setLoopOutPoint((int) (loopOutPoint*scale+0.5));
+  framesPerSecond=fps;
+  setNumberOfFrames(numFrames);
+
+  for(int n=0;n<nodes.count();n++)
+    emit redrawTrack(getPartIndex(nodes.at(n)));
+
+  setDirty(true);
+  solveIK();
+  emit currentFrame(frame);
+  emit frameChanged();
+}
+
+/** Joints and source data of smooth(). Each worker takes a range of joints. */
+struct SmoothJob
+{
+  QList<BVHNode*> joints;
+  int numFrames;
+  int firstFrame;                     // frames before it are left alone
+  QVector<double> weights;            // Savitzky-Golay coefficients, [0] for the middle frame
+  QVector<MT_Quaternion> rotations;   // [joint*frames+frame], smoothed in place
+};
+
+// logarithm of a unit quaternion, half the rotation angle around its axis
+static void quaternionLog(const MT_Quaternion& q,double* v)
+{
+  double length=sqrt(q[0]*q[0]+q[1]*q[1]+q[2]*q[2]);
+  double scale=length>1e-9 ? atan2(length,q[3])/length : 1.0;
+  for(int c=0;c<3;c++)
+    v[c]=q[c]*scale;
+}
+
+static MT_Quaternion quaternionExp(const double* v)
+{
+  double angle=sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+  double scale=angle>1e-9 ? sin(angle)/angle : 1.0;
+  return MT_Quaternion(v[0]*scale,v[1]*scale,v[2]*scale,cos(angle));
+}
+
+/** Worker for smooth(). Every frame is fitted by a quadratic over its window, on log-maps of the
+    neighbouring rotations relative to the frame's own, so the filter never goes across the
+    quaternion's wrap-around. Only reads the source rotations of its own joints. */
+static void smoothJoints(SmoothJob* job,int first,int last)
+{
+  int numFrames=job->numFrames;
+  int half=job->weights.count()-1;
+  QVector<MT_Quaternion> source(numFrames);
+
+  for(int j=first;j<=last;j++)
+  {
+    MT_Quaternion* rotations=job->rotations.data()+j*numFrames;
+    for(int f=0;f<numFrames;f++)
+      source[f]=rotations[f];
+
+    for(int f=job->firstFrame;f<numFrames;f++)
+    {
+      const MT_Quaternion& current=source.at(f);
+      MT_Quaternion inverse=current.conjugate();
+      double sum[3]={ 0.0,0.0,0.0 };
+      for(int k=-half;k<=half;k++)
+      {
+        // the window repeats the end frames
+        int neighbour=qBound(job->firstFrame,f+k,numFrames-1);
+        MT_Quaternion delta=inverse*source.at(neighbour);
+        if(delta[3]<0.0)
+          delta=MT_Quaternion(-delta[0],-delta[1],-delta[2],-delta[3]);
+
+        double v[3];
+        quaternionLog(delta,v);
+        double weight=job->weights.at(qAbs(k));
+        for(int c=0;c<3;c++)
+          sum[c]+=weight*v[c];
+      }
+      rotations[f]=current*quaternionExp(sum);
+    }
+  }
+}
+
+void Animation::smooth(int strength,int firstFrame)
+{
+  firstFrame=qMax(firstFrame,0);
+  if(!frames || strength<1 || totalFrames-firstFrame<3)
+    return;
+
+  // quadratic Savitzky-Golay filter over 2*half+1 frames (a window of 3 would keep everything)
+  SmoothJob job;
+  int half=strength+1;
+  double norm=(2*half-1)*(2*half+1)*(2*half+3);
+  job.weights.resize(half+1);
+  for(int k=0;k<=half;k++)
+    job.weights[k]=3.0*(3*half*half+3*half-1-5*k*k)/norm;
+
+  collectJoints(frames,job.joints);
+  int numJoints=job.joints.count();
+  job.numFrames=totalFrames;
+  job.firstFrame=firstFrame;
+  job.rotations.resize(numJoints*totalFrames);
+  for(int j=0;j<numJoints;j++)
+  {
+    BVHNode* joint=job.joints.at(j);
+    for(int i=0;i<totalFrames;i++)
+      job.rotations[j*totalFrames+i]=IKTree::toQuaternion(joint,joint->frameData(i).rotation());
+  }
+
+  int numThreads=qBound(1,QThread::idealThreadCount(),numJoints);
+  int chunk=(numJoints+numThreads-1)/numThreads;
+  QList<QFuture<void> > workers;
+  for(int from=0;from<numJoints;from+=chunk)
+    workers.append(QtConcurrent::run(smoothJoints,&job,from,qMin(from+chunk-1,numJoints-1)));
+
+  // the position is filtered channel by channel meanwhile
+  QVector<Position> positions(totalFrames);
+  for(int i=0;i<totalFrames;i++)
+    positions[i]=positionNode->frameData(i).position();
+  QVector<Position> smoothed=positions;
+  for(int i=firstFrame;i<totalFrames;i++)
+  {
+    double sum[3]={ 0.0,0.0,0.0 };
+    for(int k=-half;k<=half;k++)
+    {
+      const Position& p=positions.at(qBound(firstFrame,i+k,totalFrames-1));
+      double weight=job.weights.at(qAbs(k));
+      sum[0]+=weight*p.x;
+      sum[1]+=weight*p.y;
+      sum[2]+=weight*p.z;
+    }
+    smoothed[i]=Position(sum[0],sum[1],sum[2]);
+  }
+
+  for(int i=0;i<workers.count();i++)
+    workers[i].waitForFinished();
+
+  // keyframes are only written after all workers are done reading them
+  for(int i=firstFrame;i<totalFrames;i++)
+  {
+    if(positionNode->isKeyframe(i))
+      positionNode->setKeyframePosition(i,smoothed.at(i));
+    else
+    {
+      int weight=positionNode->frameData(i).weight();
+      positionNode->addKeyframe(i,smoothed.at(i),Rotation());
+      positionNode->setKeyframeWeight(i,weight);
+    }
+  }
+  emit redrawTrack(getPartIndex(positionNode));
+
+  for(int j=0;j<numJoints;j++)
+  {
+    BVHNode* joint=job.joints.at(j);
+    for(int i=firstFrame;i<totalFrames;i++)
+    {
+      Rotation rot;
+      IKTree::toEuler(job.rotations.at(j*totalFrames+i),joint->channelOrder,rot.x,rot.y,rot.z);
+      if(joint->isKeyframe(i))
+        joint->setKeyframeRotation(i,rot);
+      else
+      {
+        int weight=joint->frameData(i).weight();
+        joint->addKeyframe(i,Position(),rot);
+        joint->setKeyframeWeight(i,weight);
+      }
+    }
+    emit redrawTrack(getPartIndex(joint));
+  }
+
+  setDirty(true);
+  solveIK();
+  emit frameChanged();
+}
+
+QList<BVHNode*> Animation::copyKeyframes()
+{
+  QList<BVHNode*> nodes;
+  nodes.append(positionNode);
+  collectJoints(frames,nodes);
+
+  QList<BVHNode*> copy;
+  for(int i=0;i<nodes.count();i++)
+  {
+    BVHNode* node=new BVHNode(nodes.at(i)->name(),NULL);
+    node->shareKeyframes(nodes.at(i));
+    copy.append(node);
+  }
+  return copy;
+}
+
+void Animation::restoreKeyframes(const QList<BVHNode*>& copy)
+{
+  QList<BVHNode*> nodes;
+  nodes.append(positionNode);
+  collectJoints(frames,nodes);
+  if(nodes.count()!=copy.count())
+    return;
+
+  for(int i=0;i<nodes.count();i++)
+  {
+    nodes.at(i)->shareKeyframes(copy.at(i));
+    emit redrawTrack(getPartIndex(nodes.at(i)));
+  }
+
+  setDirty(true);
+  solveIK();
+  emit frameChanged();
+}
+
 void Animation::optimizeHelper(BVHNode* joint)
 {
   if(joint->type!=BVH_END)
@@ -1123,6 +1608,8 @@ bool Animation::dirty() const
 
 void Animation::setDirty(bool state)
 {
+  // any edit may have changed keyframes the last IK solution was based on
+  ikSolvedFrame=-1;
   isDirty=state;
   emit animationDirty(state);
 }
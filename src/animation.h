@@ -60,6 +60,8 @@ class Animation : public QObject
     } FigureType;
 
     Animation(BVH* bvh,const QString& bvhFile=QString::null);
+    // copy of @param source without loading anything, its key frames are shared (copy on write)
+    Animation(BVH* bvh,Animation* source);
     ~Animation();
 
     void loadBVH(const QString& bvhFile);
@@ -76,6 +78,8 @@ class Animation : public QObject
     int getLoopOutPoint();
     void setIK(BVHNode* node, bool flag);
     bool getIK(BVHNode* node);
+    // solves IK on all frames from first to last and stores the result as keyframes
+    void bakeIK(int first,int last);
     const QString getPartName(int index) const;
     int getPartIndex(BVHNode* node);
     void setMirrored(bool mirror);
@@ -84,6 +88,9 @@ class Animation : public QObject
     // get and set frames per second
     void setFPS(int fps);
     int fps() const;
+    // converts the animation to another frame rate, so it keeps its speed and gets more or
+    // less frames. Every frame becomes a key frame.
+    virtual void resample(int fps);
 
     // convenience functions
     void setFrameTime(double frameTime);
@@ -117,10 +124,12 @@ class Animation : public QObject
     Rotation getRotation(BVHNode* node);
 
     //edu
-    double getRelWeight(BVHNode* node);
+    virtual double getRelWeight(BVHNode* node);
     Rotation getGlobalRotation(BVHNode* node);
 
     void useRotationLimits(bool flag);
+    // solve all IK parts at once with damped least squares instead of one by one
+    void useJacobianIK(bool flag);
     RotationLimits getRotationLimits(BVHNode* node);
     void setPosition(double x,double y,double z);
     Position getPosition();
@@ -154,6 +163,13 @@ class Animation : public QObject
     void mirror(BVHNode* joint);
 
     void optimize();
+    // filters out jitter of the position and all joints from firstFrame on. strength 1 is
+    // the lightest, every next one smooths over one more frame on each side
+    void smooth(int strength,int firstFrame=0);
+    // copy of key frames of the position and all joints, to be put back by restoreKeyframes().
+    // Key frames are shared, so it costs nothing until the animation changes. Caller deletes it
+    QList<BVHNode*> copyKeyframes();
+    void restoreKeyframes(const QList<BVHNode*>& copy);
 
     enum { MAX_PARTS=64 };
 
@@ -201,6 +217,9 @@ class Animation : public QObject
     bool limits;
     bool ikOn[NUM_IK];
     IKTree ikTree;
+    IKTree::SolverType ikSolver;
+    // frame the current ikTree solution belongs to, -1 if outdated
+    int ikSolvedFrame;
 
     void recursiveAddKeyFrame(BVHNode* joint);
     bool isKeyFrameHelper(BVHNode* joint);
@@ -214,7 +233,9 @@ class Animation : public QObject
     void setIK(IKPartType part, bool flag);
     bool getIK(IKPartType part);
     void applyIK(const QString& name);
+    void markIKEffectors();
     void solveIK();
+    void updateIK(const QList<BVHNode*>& changed,bool seeded);
 
     QString dataPath;
     QTimer timer;
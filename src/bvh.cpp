@@ -973,3 +973,28 @@ void BVH::bvhDelete(BVHNode* node)
     delete node;
   }
 }
+
+BVHNode* BVH::bvhCopy(BVHNode* node,BVHNode* parent)
+{
+  BVHNode* copy=new BVHNode(node->name(),parent);
+  copy->type=node->type;
+  copy->offset[0]=node->offset[0];
+  copy->offset[1]=node->offset[1];
+  copy->offset[2]=node->offset[2];
+  copy->numChannels=node->numChannels;
+  copy->channelOrder=node->channelOrder;
+  for(int i=0;i<6;i++)
+  {
+    copy->channelType[i]=node->channelType[i];
+    copy->channelMin[i]=node->channelMin[i];
+    copy->channelMax[i]=node->channelMax[i];
+  }
+  copy->ikOn=false;
+  copy->ikWeight=node->ikWeight;
+  copy->shareKeyframes(node);
+
+  for(int i=0;i<node->numChildren();i++)
+    copy->addChild(bvhCopy(node->child(i),copy));
+
+  return copy;
+}
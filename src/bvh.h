@@ -75,6 +75,8 @@ class BVH
     void avmWrite(Animation* anim,const QString& file);
     void animWrite(Animation* anim,const QString& file);
     void bvhDelete(BVHNode* node);
+    // copy of the node tree sharing key frames with @param node until either gets changed
+    BVHNode* bvhCopy(BVHNode* node,BVHNode* parent);
 
     QStringList bvhTypeName;
     QStringList bvhChannelName;
@@ -471,6 +471,11 @@ bool BVHNode::compareFrames(int key1,int key2) const
   return true;
 }
 
+void BVHNode::shareKeyframes(const BVHNode* source)
+{
+  keyframes=source->keyframes;
+}
+
 void BVHNode::optimize()
 {
   // PASS 1 - remove identical keyframes
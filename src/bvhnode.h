@@ -135,6 +135,10 @@ class BVHNode
     bool compareFrames(int key1,int key2) const;
     void optimize();
 
+    // key frames are implicitly shared (copy on write), so sharing them costs nothing
+    // until one of the nodes changes its key frames
+    void shareKeyframes(const BVHNode* source);
+
     void dumpKeyframes();
 
     // set and get mirror nodes for this node
@@ -23,10 +23,14 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <assert.h>
 
 #include "mt_transform.h"
 #include "iktree.h"
 
+#include "TNT/subscript.h"
+#include "TNT/cholesky.h"
+
 int display = 0;
 
 static const MT_Vector3 origin(0,0,0);
@@ -36,7 +40,8 @@ static const MT_Vector3 zAxis(0,0,1);
 static const MT_Quaternion identity(0,0,0,1);
 
 IKTree::IKTree(BVHNode *root) :
-  jointLimits(true)
+  jointLimits(true),
+  solver(SOLVER_CCD)
 {
   set(root);
 }
@@ -45,7 +50,31 @@ void IKTree::set(BVHNode *root)
 {
   numBones = 0;
   if (root)
-    addJoint(root);
+    numBones = countJoints(root);
+
+  nodes.resize(numBones);
+  parent.resize(numBones);
+  subtreeEnd.resize(numBones);
+  weight.resize(numBones);
+  offset.resize(numBones);
+  pos.resize(numBones);
+  lRot.resize(numBones);
+  gRot.resize(numBones);
+  solved.resize(numBones);
+
+  if (root)
+  {
+    int next = 0;
+    addJoint(root, -1, next);
+  }
+}
+
+int IKTree::countJoints(BVHNode *node) const
+{
+  int count = 1;
+  for (int i=0; i<node->numChildren(); i++)
+    count += countJoints(node->child(i));
+  return count;
 }
 
 void IKTree::setGoal(int frame,const QString& name)
@@ -53,200 +82,227 @@ void IKTree::setGoal(int frame,const QString& name)
   reset(frame);
 
   for (int i=0; i<numBones; i++) {
-    if (bone[i].node->name()==name) {
-      int j = bone[i].child[0];
-      BVHNode *n = bone[j].node;
-      n->ikGoalPos[0] = bone[j].pos[0];
-      n->ikGoalPos[1] = bone[j].pos[1];
-      n->ikGoalPos[2] = bone[j].pos[2];
-      n->ikGoalDir[0] = bone[j].pos[0] - bone[i].pos[0];
-      n->ikGoalDir[1] = bone[j].pos[1] - bone[i].pos[1];
-      n->ikGoalDir[2] = bone[j].pos[2] - bone[i].pos[2];
+    if (nodes[i]->name()==name && !isLeaf(i)) {
+      int j = i + 1;    // first child
+      BVHNode *n = nodes[j];
+      n->ikGoalPos[0] = pos[j][0];
+      n->ikGoalPos[1] = pos[j][1];
+      n->ikGoalPos[2] = pos[j][2];
+      n->ikGoalDir[0] = pos[j][0] - pos[i][0];
+      n->ikGoalDir[1] = pos[j][1] - pos[i][1];
+      n->ikGoalDir[2] = pos[j][2] - pos[i][2];
     }
   }
 }
 
-void IKTree::reset(int frame)
+// fromPrevious keeps the rotations of joints moved by the last solve as starting pose
+void IKTree::reset(int frame, bool fromPrevious)
 {
-  MT_Quaternion q;
-  BVHNode *n;
+  if (!numBones) return;
 
   for (int i=0; i<numBones; i++)
+    resetBone(i, frame, fromPrevious && solved[i]);
+  updateBones(0);
+}
+
+// loads the keyframe rotation of bone i, the root bone also gets its position
+void IKTree::resetBone(int i, int frame, bool keepRotation)
+{
+  BVHNode *n = nodes[i];
+
+  // all other bones get placed by updateBones()
+  if (i == 0)
   {
-    bone[i].pos = origin;
-    bone[i].lRot = identity;
-    bone[i].gRot = identity;
-    n = bone[i].node;
-    Rotation rot=n->frameData(frame).rotation();
-    Position pos=n->frameData(frame).position();
-
-    for (int k=0; k<n->numChannels; k++)    // rotate each axis in order
-    {
-      q = identity;
-      switch (n->channelType[k]) {
-        case BVH_XROT:
-          q.setRotation(xAxis, rot.x * M_PI / 180);
-        break;
-        case BVH_YROT:
-          q.setRotation(yAxis, rot.y * M_PI / 180);
-        break;
-        case BVH_ZROT:
-          q.setRotation(zAxis, rot.z * M_PI / 180);
-        break;
-        case BVH_XPOS: bone[i].pos[0] = pos.x; break;
-        case BVH_YPOS: bone[i].pos[1] = pos.y; break;
-        case BVH_ZPOS: bone[i].pos[2] = pos.z; break;
-      }
-      bone[i].lRot = q * bone[i].lRot;
+    pos[i] = origin;
+    gRot[i] = identity;
+  }
+  if (!keepRotation)
+  {
+    lRot[i] = identity;
+    solved[i] = false;
+  }
+  Position keyPos=n->frameData(frame).position();
+
+  for (int k=0; k<n->numChannels; k++)
+  {
+    switch (n->channelType[k]) {
+      case BVH_XPOS: pos[i][0] = keyPos.x; break;
+      case BVH_YPOS: pos[i][1] = keyPos.y; break;
+      case BVH_ZPOS: pos[i][2] = keyPos.z; break;
+      default: break;
     }
+  }
+  if (!keepRotation)
+    lRot[i] = toQuaternion(n, n->frameData(frame).rotation());
 /*
-    for (int k=0; k<3; k++) {  // rotate each axis in order
-      rad = n->frame[frame][k] * M_PI / 180;
-      q = identity;
-      switch (n->channelType[k]) {
-      case BVH_XROT: q.setRotation(xAxis, rad); break;
-      case BVH_YROT: q.setRotation(yAxis, rad); break;
-      case BVH_ZROT: q.setRotation(zAxis, rad); break;
-      case BVH_XPOS: bone[i].pos[0] = n->frame[frame][k]; break;
-      case BVH_YPOS: bone[i].pos[1] = n->frame[frame][k]; break;
-      case BVH_ZPOS: bone[i].pos[2] = n->frame[frame][k]; break;
-      }
-      bone[i].lRot = q * bone[i].lRot;
+  for (int k=0; k<3; k++) {  // rotate each axis in order
+    rad = n->frame[frame][k] * M_PI / 180;
+    q = identity;
+    switch (n->channelType[k]) {
+    case BVH_XROT: q.setRotation(xAxis, rad); break;
+    case BVH_YROT: q.setRotation(yAxis, rad); break;
+    case BVH_ZROT: q.setRotation(zAxis, rad); break;
+    case BVH_XPOS: pos[i][0] = n->frame[frame][k]; break;
+    case BVH_YPOS: pos[i][1] = n->frame[frame][k]; break;
+    case BVH_ZPOS: pos[i][2] = n->frame[frame][k]; break;
     }
-*/
+    lRot[i] = q * lRot[i];
   }
-  updateBones(0);
+*/
 }
 
-void IKTree::addJoint(BVHNode *node)
+// stores the joints in depth first order, next is the index of the following joint
+void IKTree::addJoint(BVHNode *node, int parentIndex, int &next)
 {
-  bone[numBones].node = node;
-  bone[numBones].offset.setValue((float)node->offset[0], (float)node->offset[1], (float)node->offset[2]);
-  bone[numBones].weight = node->ikWeight;
-  bone[numBones].numChildren = 0;
+  int i = next++;
 
-  int myNumBones = numBones++;
-  for (int i=0; i<node->numChildren(); i++)
-  {
-    bone[myNumBones].child[bone[myNumBones].numChildren++] = numBones;
-    addJoint(node->child(i));
-  }
+  nodes[i] = node;
+  parent[i] = parentIndex;
+  solved[i] = false;
+  offset[i].setValue((float)node->offset[0], (float)node->offset[1], (float)node->offset[2]);
+  weight[i] = node->ikWeight;
+
+  for (int k=0; k<node->numChildren(); k++)
+    addJoint(node->child(k), i, next);
+  subtreeEnd[i] = next;
 }
 
-void IKTree::toEuler(MT_Quaternion &q, BVHOrderType order, double &x, double &y, double &z)
+// decomposes a rotation built by reset() back into the channel angles of the joint
+void IKTree::toEuler(const MT_Quaternion &q, BVHOrderType order, double &x, double &y, double &z)
 {
-  double q0=q[0],q1=q[1],q2=q[2],q3=q[3];
+  // the formulas below expect the channels composed in reverse order, which is the conjugate
+  double q0=-q[0],q1=-q[1],q2=-q[2],q3=q[3];
 
   switch(order) {
   case BVH_ZYX:
-    x = -atan2(2*(q1*q2-q3*q0),1-2*(q0*q0+q1*q1))*180/M_PI;
-    y = -asin(-2*(q0*q2+q3*q1))*180/M_PI;
-    z = -atan2(2*(q0*q1-q3*q2),1-2*(q1*q1+q2*q2))*180/M_PI;
+    x = atan2(2*(q1*q2-q3*q0),1-2*(q0*q0+q1*q1))*180/M_PI;
+    y = asin(-2*(q0*q2+q3*q1))*180/M_PI;
+    z = atan2(2*(q0*q1-q3*q2),1-2*(q1*q1+q2*q2))*180/M_PI;
     break;
   case BVH_XYZ:
-    x = -atan2(-2*(q1*q2+q3*q0),1-2*(q0*q0+q1*q1))*180/M_PI;
-    y = -asin(2*(q0*q2-q3*q1))*180/M_PI;
-    z = -atan2(-2*(q0*q1+q3*q2),1-2*(q1*q1+q2*q2))*180/M_PI;
+    x = atan2(-2*(q1*q2+q3*q0),1-2*(q0*q0+q1*q1))*180/M_PI;
+    y = asin(2*(q0*q2-q3*q1))*180/M_PI;
+    z = atan2(-2*(q0*q1+q3*q2),1-2*(q1*q1+q2*q2))*180/M_PI;
     break;
   case BVH_YZX:
-    x = -atan2(-2*(q1*q2+q3*q0),1-2*(q0*q0+q2*q2))*180/M_PI;
-    y = -atan2(-2*(q0*q2+q3*q1),1-2*(q1*q1+q2*q2))*180/M_PI;
-    z = -asin(2*(q0*q1-q3*q2))*180/M_PI;
+    x = atan2(-2*(q1*q2+q3*q0),1-2*(q0*q0+q2*q2))*180/M_PI;
+    y = atan2(-2*(q0*q2+q3*q1),1-2*(q1*q1+q2*q2))*180/M_PI;
+    z = asin(2*(q0*q1-q3*q2))*180/M_PI;
     break;
   case BVH_XZY:
-    x = -atan2(2*(q1*q2-q3*q0),1-2*(q0*q0+q2*q2))*180/M_PI;
-    y = -atan2(2*(q0*q2-q3*q1),1-2*(q1*q1+q2*q2))*180/M_PI;
-    z = -asin(-2*(q0*q1+q3*q2))*180/M_PI;
+    x = atan2(2*(q1*q2-q3*q0),1-2*(q0*q0+q2*q2))*180/M_PI;
+    y = atan2(2*(q0*q2-q3*q1),1-2*(q1*q1+q2*q2))*180/M_PI;
+    z = asin(-2*(q0*q1+q3*q2))*180/M_PI;
     break;
   case BVH_YXZ:
-    x = -asin(-2*(q1*q2+q3*q0))*180/M_PI;
-    y = -atan2(2*(q0*q2-q3*q1),1-2*(q0*q0+q1*q1))*180/M_PI;
-    z = -atan2(2*(q0*q1-q3*q2),1-2*(q0*q0+q2*q2))*180/M_PI;
+    x = asin(-2*(q1*q2+q3*q0))*180/M_PI;
+    y = atan2(2*(q0*q2-q3*q1),1-2*(q0*q0+q1*q1))*180/M_PI;
+    z = atan2(2*(q0*q1-q3*q2),1-2*(q0*q0+q2*q2))*180/M_PI;
     break;
   case BVH_ZXY:
-    x = -asin(2*(q1*q2-q3*q0))*180/M_PI;
-    y = -atan2(-2*(q0*q2+q3*q1),1-2*(q0*q0+q1*q1))*180/M_PI;
-    z = -atan2(-2*(q0*q1+q3*q2),1-2*(q0*q0+q2*q2))*180/M_PI;
+    x = asin(2*(q1*q2-q3*q0))*180/M_PI;
+    y = atan2(-2*(q0*q2+q3*q1),1-2*(q0*q0+q1*q1))*180/M_PI;
+    z = atan2(-2*(q0*q1+q3*q2),1-2*(q0*q0+q2*q2))*180/M_PI;
     break;
   }
 }
 
-void IKTree::updateBones(int i)
+MT_Quaternion IKTree::toQuaternion(const BVHNode *node, const Rotation &rot)
 {
-  IKBone theBone = bone[i];
+  MT_Quaternion result = identity;
+  MT_Quaternion q;
 
-  for (int chld=0; chld<theBone.numChildren; chld++)
+  for (int k=0; k<node->numChannels; k++)    // rotate each axis in order
   {
-    int k = theBone.child[chld];
-    IKBone theChild = bone[k];
-    theChild.gRot = theBone.gRot * theBone.lRot;
-    MT_Transform rot(MT_Point3(0,0,0), theChild.gRot);
-    theChild.pos = theBone.pos + rot * theChild.offset;
-    updateBones(k);
+    switch (node->channelType[k]) {
+      case BVH_XROT:
+        q.setRotation(xAxis, rot.x * M_PI / 180);
+      break;
+      case BVH_YROT:
+        q.setRotation(yAxis, rot.y * M_PI / 180);
+      break;
+      case BVH_ZROT:
+        q.setRotation(zAxis, rot.z * M_PI / 180);
+      break;
+      default:
+        continue;
+    }
+    // same order as AnimationView::drawPart() applies glRotatef()
+    result = result * q;
   }
+
+  return result;
 }
 
-void IKTree::solveJoint(int frame, int i, IKEffectorList &effList)
+// places all bones below bone i, parents always come before their children
+void IKTree::updateBones(int i)
 {
-  double x, y, z;
-  double ang = 0;
+  for (int k=i+1; k<subtreeEnd[i]; k++)
+  {
+    int p = parent[k];
+    gRot[k] = gRot[p] * lRot[p];
+    MT_Transform rot(MT_Point3(0,0,0), gRot[k]);
+    pos[k] = pos[p] + rot * offset[k];
+  }
+}
 
-  MT_Quaternion q;
-  MT_Quaternion totalPosRot = MT_Quaternion(0,0,0,0);
-  MT_Quaternion totalDirRot = MT_Quaternion(0,0,0,0);
-  MT_Vector3 axis(0,0,0);
-  BVHNode *n;
-  int numPosRot = 0, numDirRot = 0;
+// one pass of cyclic coordinate descent, children get solved before their parents
+void IKTree::solveCCDPass()
+{
+  QVector<int> effList;
 
-  if (bone[i].numChildren == 0)       // reached end site
+  for (int i=0; i<numBones; i++)
   {
-    if (bone[i].node->ikOn)
-      effList.index[effList.num++] = i;
-    return;
+    // two bone chains are left to solveTwoBone()
+    if (isLeaf(i) && nodes[i]->ikOn && !isAnalytic(i))
+      effList.append(i);
   }
 
-  for (int j=0; j<bone[i].numChildren; j++)
+  for (int i=numBones-1; i>=0; i--)
   {
-    IKEffectorList el;
-    el.num = 0;
-    solveJoint(frame, bone[i].child[j], el);
-    for (int k=0; k<el.num; k++) {
-      effList.index[effList.num++] = el.index[k];
-    }
+    if (!isLeaf(i))
+      solveJoint(i, effList);
   }
+}
+
+void IKTree::solveJoint(int i, const QVector<int> &effList)
+{
+  MT_Quaternion totalPosRot = MT_Quaternion(0,0,0,0);
+  MT_Quaternion totalDirRot = MT_Quaternion(0,0,0,0);
+  BVHNode *n;
+  int numPosRot = 0, numDirRot = 0;
 
   updateBones(i);
 
-  for (int j=0; j<effList.num; j++)
+  for (int j=0; j<effList.count(); j++)
   {
-    int effIndex = effList.index[j];
-    n = bone[effIndex].node;
+    int effIndex = effList.at(j);
+    if (effIndex <= i || effIndex >= subtreeEnd[i]) continue;    // not below this joint
+    n = nodes[effIndex];
     MT_Vector3 effGoalPos(n->ikGoalPos[0], n->ikGoalPos[1], n->ikGoalPos[2]);
-    const MT_Vector3 pC = (bone[effIndex].pos - bone[i].pos).safe_normalized();
-    const MT_Vector3 pD = (effGoalPos - bone[i].pos).safe_normalized();
+    const MT_Vector3 pC = (pos[effIndex] - pos[i]).safe_normalized();
+    const MT_Vector3 pD = (effGoalPos - pos[i]).safe_normalized();
     MT_Vector3 rotAxis = pC.cross(pD);
     if (rotAxis.length2() > MT_EPSILON)
     {
-      totalPosRot += MT_Quaternion(rotAxis, bone[i].weight * acos(pC.dot(pD)));
+      totalPosRot += MT_Quaternion(rotAxis, weight[i] * acos(pC.dot(pD)));
       numPosRot++;
     }
 
-    const MT_Vector3 uC = (bone[effIndex].pos - bone[effIndex-1].pos).safe_normalized();
+    const MT_Vector3 uC = (pos[effIndex] - pos[parent[effIndex]]).safe_normalized();
     const MT_Vector3 uD = (MT_Vector3(n->ikGoalDir[0], n->ikGoalDir[1], n->ikGoalDir[2])).safe_normalized();
     rotAxis = uC.cross(uD);
     if (rotAxis.length2() > MT_EPSILON)
     {
-      double weight = 0.0;
-      if (i == effIndex-1) weight = 0.5;
-      totalDirRot += MT_Quaternion(rotAxis, weight * acos(uC.dot(uD)));
+      double dirWeight = 0.0;
+      if (i == parent[effIndex]) dirWeight = 0.5;
+      totalDirRot += MT_Quaternion(rotAxis, dirWeight * acos(uC.dot(uD)));
       numDirRot++;
     }
   }
 
   if ((numPosRot + numDirRot) > MT_EPSILON)
   {
-    n = bone[i].node;
-    n->ikOn = true;
     // average the quaternions from all effectors
     if (numPosRot)
       totalPosRot /= numPosRot;
@@ -257,75 +313,551 @@ void IKTree::solveJoint(int frame, int i, IKEffectorList &effList)
     else
       totalDirRot = identity;
     MT_Quaternion targetRot = 0.9 * totalPosRot + 0.1 * totalDirRot;
-    targetRot = targetRot * bone[i].lRot;
+    targetRot = targetRot * lRot[i];
+    setJointRotation(i, targetRot);
+  }
+}
+
+// stores a new local rotation for bone i, clamped to the joint limits if enabled
+void IKTree::setJointRotation(int i, MT_Quaternion &targetRot)
+{
+  double x, y, z;
+  double ang = 0;
+  MT_Quaternion q;
+  MT_Vector3 axis(0,0,0);
+  BVHNode *n = nodes[i];
+
+  solved[i] = true;
+  if (jointLimits)
+  {
     toEuler(targetRot, n->channelOrder, x, y, z);
-    if (jointLimits)
+    lRot[i] = identity;
+    for (int k=0; k<n->numChannels; k++)    // clamp each axis in order
     {
-      bone[i].lRot = identity;
-      for (int k=0; k<n->numChannels; k++)    // clamp each axis in order
-      {
-        switch (n->channelType[k]) {
-          case BVH_XROT: ang = x; axis = xAxis; break;
-          case BVH_YROT: ang = y; axis = yAxis; break;
-          case BVH_ZROT: ang = z; axis = zAxis; break;
-          default: break;
-        }
-        // null axis leads to crash in q.setRotation(), so check first
-        if(axis.length())
-        {
-          if (ang < n->channelMin[k]) ang = n->channelMin[k];
-          else if (ang > n->channelMax[k]) ang = n->channelMax[k];
-          q.setRotation(axis, ang * M_PI / 180);
-          bone[i].lRot = q * bone[i].lRot;
-        }
+      switch (n->channelType[k]) {
+        case BVH_XROT: ang = x; axis = xAxis; break;
+        case BVH_YROT: ang = y; axis = yAxis; break;
+        case BVH_ZROT: ang = z; axis = zAxis; break;
+        default: continue;
       }
+      if (ang < n->channelMin[k]) ang = n->channelMin[k];
+      else if (ang > n->channelMax[k]) ang = n->channelMax[k];
+      q.setRotation(axis, ang * M_PI / 180);
+      lRot[i] = lRot[i] * q;
     }
-    else
-      bone[i].lRot = targetRot;
   }
+  else
+    lRot[i] = targetRot;
 }
 
-void IKTree::solve(int frame)
+// rotates bone i by a rotation given in world space and moves its children along
+void IKTree::rotateBone(int i, const MT_Quaternion &worldRot)
 {
-  double x, y, z;
-  reset(frame);
+  const MT_Quaternion &parentRot = gRot[i];
+  MT_Quaternion targetRot = parentRot.conjugate() * worldRot * parentRot * lRot[i];
+  setJointRotation(i, targetRot);
+  updateBones(i);
+}
+
+// effector is handled by solveTwoBone()
+bool IKTree::isAnalytic(int effIndex) const
+{
+  return solver != SOLVER_DLS && isTwoBoneChain(effIndex);
+}
+
+// effector sits at the end of an unbranched upper-middle-end joint chain, like arms and legs
+bool IKTree::isTwoBoneChain(int effIndex) const
+{
+  int end = parent[effIndex];
+  if (end < 0 || !hasSingleChild(end)) return false;
+  int middle = parent[end];
+  if (middle < 0 || !hasSingleChild(middle)) return false;
+  int upper = parent[middle];
+  return upper >= 0 && hasSingleChild(upper);
+}
+
+static double safeAcos(double cosine)
+{
+  return acos(MT_clamp(cosine, -1.0, 1.0));
+}
+
+/*
+  Solves a two bone chain in closed form. The middle joint gets bent so the
+  chain spans the distance to the goal, then the upper joint swings the chain
+  onto the goal and the end bone is turned into the goal direction. The bend
+  plane is kept from the current pose, so elbows and knees don't flip. Joint
+  limits are applied after every step, later steps work with the clamped pose.
+*/
+void IKTree::solveTwoBone(int effIndex)
+{
+  const int end = parent[effIndex];
+  const int middle = parent[end];
+  const int upper = parent[middle];
+  const BVHNode *n = nodes[effIndex];
+
+  const MT_Vector3 goalPos(n->ikGoalPos[0], n->ikGoalPos[1], n->ikGoalPos[2]);
+  const MT_Vector3 goalDir = MT_Vector3(n->ikGoalDir[0], n->ikGoalDir[1], n->ikGoalDir[2]).safe_normalized();
+
+  // the end joint (wrist, ankle) has to stay one end bone length away from the goal
+  const double endLength = (pos[effIndex] - pos[end]).length();
+  const MT_Vector3 target = goalPos - goalDir * endLength;
+
+  const double upperLength = (pos[middle] - pos[upper]).length();
+  const double lowerLength = (pos[end] - pos[middle]).length();
+  if (upperLength < MT_EPSILON || lowerLength < MT_EPSILON) return;
+
+  double reach = (target - pos[upper]).length();
+  const double minReach = fabs(upperLength - lowerLength) + 1e-4;
+  const double maxReach = upperLength + lowerLength - 1e-4;
+  reach = MT_clamp(reach, minReach, maxReach);
+
+  // bend the middle joint
+  MT_Vector3 toUpper = pos[upper] - pos[middle];
+  MT_Vector3 toEnd = pos[end] - pos[middle];
+  MT_Vector3 axis = toUpper.cross(toEnd);
+  if (axis.length2() < MT_EPSILON)    // chain is stretched, bend towards the goal direction
+    axis = toUpper.cross(goalDir);
+  if (axis.length2() > MT_EPSILON)
+  {
+    double angle = safeAcos(toUpper.safe_normalized().dot(toEnd.safe_normalized()));
+    double wantedAngle = safeAcos((upperLength*upperLength + lowerLength*lowerLength - reach*reach) /
+                                  (2 * upperLength * lowerLength));
+    rotateBone(middle, MT_Quaternion(axis, wantedAngle - angle));
+  }
+
+  // swing the upper joint so the end joint lands on the target
+  const MT_Vector3 pC = (pos[end] - pos[upper]).safe_normalized();
+  const MT_Vector3 pD = (target - pos[upper]).safe_normalized();
+  axis = pC.cross(pD);
+  if (axis.length2() > MT_EPSILON)
+    rotateBone(upper, MT_Quaternion(axis, safeAcos(pC.dot(pD))));
+
+  // turn the end bone into the goal direction
+  const MT_Vector3 uC = (pos[effIndex] - pos[end]).safe_normalized();
+  axis = uC.cross(goalDir);
+  if (axis.length2() > MT_EPSILON)
+    rotateBone(end, MT_Quaternion(axis, safeAcos(uC.dot(goalDir))));
+}
+
+// capacity of the stack matrices, solveIterative() falls back to CCD beyond that
+#define DLS_MAX_EFFECTORS 5
+#define DLS_MAX_JOINTS 24
+// two target points per effector, one for the position and one for the direction
+#define DLS_ROWS (6*DLS_MAX_EFFECTORS)
+#define DLS_COLS (3*DLS_MAX_JOINTS)
+#define DLS_DAMPING 1.0
+#define DLS_ITERATIONS 10
+
+/*
+  Matrix of fixed capacity that lives on the stack, with the interface the TNT
+  algorithms expect. Only the first rows x cols elements are in use, indexing
+  is 1-based like in TNT. A matrix with one column serves as vector.
+*/
+template <int ROWS, int COLS> class IKMatrix
+{
+  public:
+    typedef double element_type;
+
+    IKMatrix(int r = ROWS, int c = COLS) : rows(r), cols(c) {}
+
+    int dim() const { return rows; }
+    int dim(int d) const { return d == 1 ? rows : cols; }
+    int num_rows() const { return rows; }
+    int num_cols() const { return cols; }
+
+    double &operator()(int i, int j = 1) { return data[i-1][j-1]; }
+    double operator()(int i, int j = 1) const { return data[i-1][j-1]; }
+
+  protected:
+    int rows;
+    int cols;
+    double data[ROWS][COLS];
+};
 
-  IKEffectorList effList;
+typedef IKMatrix<DLS_ROWS, DLS_ROWS> IKSquareMatrix;
+typedef IKMatrix<DLS_ROWS, 1> IKVector;
 
-  for (int i=0; i<20; i++) {
-    effList.num = 0;
-    solveJoint(frame, 0, effList);
+/*
+  Damped least squares solver for all active effectors at once. Each effector
+  pulls its end site onto the goal position and the joint above onto the goal
+  direction. Every rotation channel of the joints above the effectors becomes
+  a column of the Jacobian, scaled by the joint's IK weight, so joints with
+  weight 0 (like the hip) stay as they are. Channels running into their limits
+  get locked for the rest of the solve.
+*/
+bool IKTree::solveDLS()
+{
+  int eff[DLS_MAX_EFFECTORS];
+  int numEff = 0;
+  int joint[DLS_MAX_JOINTS];
+  int numJoints = 0;
+
+  for (int i=0; i<numBones; i++)
+  {
+    if (isLeaf(i) && nodes[i]->ikOn && !isAnalytic(i) && parent[i] >= 0)
+    {
+      if (numEff == DLS_MAX_EFFECTORS) return false;
+      eff[numEff++] = i;
+    }
   }
 
-  for (int i=0; i<numBones-1; i++)
+  for (int e=0; e<numEff; e++)
+  {
+    for (int j=parent[eff[e]]; j>=0; j=parent[j])
+    {
+      if (weight[j] <= 0) continue;
+      int k = 0;
+      while (k<numJoints && joint[k]!=j) k++;
+      if (k < numJoints) continue;
+      if (numJoints == DLS_MAX_JOINTS) return false;
+      joint[numJoints++] = j;
+    }
+  }
+  if (!numEff || !numJoints) return true;
+
+  // one column per rotation channel, angles in degrees like in the keyframes
+  int colJoint[DLS_COLS];
+  int colChannel[DLS_COLS];
+  double angle[DLS_COLS];
+  bool locked[DLS_COLS];
+  int numCols = 0;
+
+  for (int j=0; j<numJoints; j++)
   {
-    BVHNode *n = bone[i].node;
-    Rotation rot = n->frameData(frame).rotation();
-    toEuler(bone[i].lRot, n->channelOrder, x, y, z);
+    const BVHNode *n = nodes[joint[j]];
+    double x, y, z;
+    toEuler(lRot[joint[j]], n->channelOrder, x, y, z);
 
-    for (int j=0; j<n->numChannels; j++)    // rotate each axis in order
+    for (int k=0; k<n->numChannels; k++)
     {
-      switch (n->channelType[j])
+      switch (n->channelType[k]) {
+        case BVH_XROT: angle[numCols] = x; break;
+        case BVH_YROT: angle[numCols] = y; break;
+        case BVH_ZROT: angle[numCols] = z; break;
+        default: continue;
+      }
+      colJoint[numCols] = joint[j];
+      colChannel[numCols] = k;
+      locked[numCols] = false;
+      numCols++;
+    }
+  }
+
+  const int numRows = 6 * numEff;
+  int rowBone[DLS_MAX_EFFECTORS*2];
+  MT_Vector3 rowGoal[DLS_MAX_EFFECTORS*2];
+
+  for (int e=0; e<numEff; e++)
+  {
+    const BVHNode *n = nodes[eff[e]];
+    const int end = parent[eff[e]];
+    const MT_Vector3 goalPos(n->ikGoalPos[0], n->ikGoalPos[1], n->ikGoalPos[2]);
+    const MT_Vector3 goalDir = MT_Vector3(n->ikGoalDir[0], n->ikGoalDir[1], n->ikGoalDir[2]).safe_normalized();
+
+    rowBone[2*e] = eff[e];
+    rowGoal[2*e] = goalPos;
+    rowBone[2*e+1] = end;
+    rowGoal[2*e+1] = goalPos - goalDir * (pos[eff[e]] - pos[end]).length();
+  }
+
+  IKMatrix<DLS_ROWS, DLS_COLS> jacobian(numRows, numCols);
+  IKSquareMatrix jjt(numRows, numRows);
+  IKSquareMatrix lower(numRows, numRows);
+  IKVector error(numRows);
+  IKVector y(numRows);
+
+  for (int iteration=0; iteration<DLS_ITERATIONS; iteration++)
+  {
+    double maxError = 0;
+    for (int p=0; p<2*numEff; p++)
+    {
+      const MT_Vector3 diff = rowGoal[p] - pos[rowBone[p]];
+      for (int a=0; a<3; a++)
+        error(3*p+a+1) = diff[a];
+      maxError = qMax(maxError, diff.length2());
+    }
+    if (maxError < 0.01)
+      break;
+
+    // fill the Jacobian, walking the channels of each joint in order
+    MT_Quaternion frameRot;
+    int lastJoint = -1;
+    for (int c=0; c<numCols; c++)
+    {
+      const int j = colJoint[c];
+      const BVHNode *n = nodes[j];
+      MT_Vector3 axis;
+
+      if (j != lastJoint)
       {
-        case BVH_XROT: n->ikRot.x = x - rot.x; break;
-        case BVH_YROT: n->ikRot.y = y - rot.y; break;
-        case BVH_ZROT: n->ikRot.z = z - rot.z; break;
-        default: break;
+        frameRot = gRot[j];
+        lastJoint = j;
+      }
+      switch (n->channelType[colChannel[c]]) {
+        case BVH_XROT: axis = xAxis; break;
+        case BVH_YROT: axis = yAxis; break;
+        default: axis = zAxis; break;
+      }
+      const MT_Vector3 worldAxis = MT_Transform(MT_Point3(0,0,0), frameRot) * axis;
+      MT_Quaternion q;
+      q.setRotation(axis, angle[c] * M_PI / 180);
+      frameRot = frameRot * q;
+
+      for (int p=0; p<2*numEff; p++)
+      {
+        MT_Vector3 d(0,0,0);
+        if (!locked[c] && rowBone[p] != j && isAncestor(j, rowBone[p]))
+          d = weight[j] * worldAxis.cross(pos[rowBone[p]] - pos[j]);
+        for (int a=0; a<3; a++)
+          jacobian(3*p+a+1, c+1) = d[a];
       }
     }
 
-/*
-    for (int j=0; j<3; j++) {  // rotate each axis in order
-      switch (n->channelType[j]) {
-        case BVH_XROT: n->ikRot[j] = x - n->frame[frame][j]; break;
-        case BVH_YROT: n->ikRot[j] = y - n->frame[frame][j]; break;
-        case BVH_ZROT: n->ikRot[j] = z - n->frame[frame][j]; break;
-        default: break;
+    // (J*Jt + damping^2*I) * y = error
+    for (int r=1; r<=numRows; r++)
+    {
+      for (int c=r; c<=numRows; c++)
+      {
+        double sum = 0;
+        for (int k=1; k<=numCols; k++)
+          sum += jacobian(r, k) * jacobian(c, k);
+        jjt(r, c) = jjt(c, r) = sum;
+      }
+      jjt(r, r) += DLS_DAMPING * DLS_DAMPING;
+    }
+    if (TNT::Cholesky_upper_factorization(jjt, lower))
+      break;
+    // forward and back substitution with L and Lt (TNT's trisolve.h doesn't build anymore)
+    for (int r=1; r<=numRows; r++)
+    {
+      double sum = error(r);
+      for (int k=1; k<r; k++)
+        sum -= lower(r, k) * y(k);
+      y(r) = sum / lower(r, r);
+    }
+    for (int r=numRows; r>=1; r--)
+    {
+      double sum = y(r);
+      for (int k=r+1; k<=numRows; k++)
+        sum -= lower(k, r) * y(k);
+      y(r) = sum / lower(r, r);
+    }
+
+    // angle change = W * Jt * y, then clamp to the channel limits
+    for (int c=0; c<numCols; c++)
+    {
+      if (locked[c]) continue;
+      double delta = 0;
+      for (int r=1; r<=numRows; r++)
+        delta += jacobian(r, c+1) * y(r);
+      angle[c] += weight[colJoint[c]] * delta * 180 / M_PI;
+
+      if (jointLimits)
+      {
+        const BVHNode *n = nodes[colJoint[c]];
+        const int k = colChannel[c];
+        if (angle[c] <= n->channelMin[k] || angle[c] >= n->channelMax[k])
+        {
+          angle[c] = MT_clamp(angle[c], n->channelMin[k], n->channelMax[k]);
+          locked[c] = true;
+        }
+      }
+    }
+
+    for (int c=0; c<numCols; c++)
+    {
+      const int j = colJoint[c];
+      if (c == 0 || colJoint[c-1] != j)
+      {
+        lRot[j] = identity;
+        solved[j] = true;
+      }
+      MT_Quaternion q;
+      switch (nodes[j]->channelType[colChannel[c]]) {
+        case BVH_XROT: q.setRotation(xAxis, angle[c] * M_PI / 180); break;
+        case BVH_YROT: q.setRotation(yAxis, angle[c] * M_PI / 180); break;
+        default: q.setRotation(zAxis, angle[c] * M_PI / 180); break;
       }
-    } */
+      lRot[j] = lRot[j] * q;
+    }
+    updateBones(0);
+  }
+  return true;
+}
+
+void IKTree::solveFrame(int frame, bool fromPrevious)
+{
+  reset(frame, fromPrevious);
+
+  bool iterative = false;
+
+  for (int i=0; i<numBones; i++)
+  {
+    if (isLeaf(i) && nodes[i]->ikOn && !isAnalytic(i))
+      iterative = true;
+  }
+
+  // the iterative solver may move joints above the two bone chains, so it goes first
+  if (iterative)
+    solveIterative();
+
+  for (int i=0; i<numBones; i++)
+  {
+    if (isLeaf(i) && nodes[i]->ikOn && isAnalytic(i))
+      solveTwoBone(i);
+  }
+}
+
+void IKTree::solveIterative()
+{
+  if (solver == SOLVER_DLS && solveDLS())
+    return;
+
+  // a seeded pose usually needs just a few passes
+  for (int i=0; i<20 && !converged(); i++) {
+    solveCCDPass();
+    updateBones(0);
+  }
+}
+
+// true if all effectors of the iterative solver are close enough to their goals
+bool IKTree::converged() const
+{
+  for (int i=0; i<numBones; i++)
+  {
+    const BVHNode *n = nodes[i];
+    if (!isLeaf(i) || !n->ikOn || isAnalytic(i))
+      continue;
+    MT_Vector3 goal(n->ikGoalPos[0], n->ikGoalPos[1], n->ikGoalPos[2]);
+    if ((pos[i] - goal).length2() > 0.01)
+      return false;
+  }
+  return true;
+}
+
+void IKTree::getSolution(IKSolution &solution)
+{
+  double x, y, z;
+
+  solution.joints.clear();
+  solution.rotations.clear();
+  for (int i=0; i<numBones; i++)
+  {
+    if (!solved[i]) continue;
+    toEuler(lRot[i], nodes[i]->channelOrder, x, y, z);
+    solution.joints.append(nodes[i]);
+    solution.rotations.append(Rotation(x, y, z));
   }
+}
+
+void IKTree::solve(int frame)
+{
+  if (!numBones) return;
+
+  solveFrame(frame, false);
+
+  for (int i=0; i<numBones-1; i++)
+    storeIKRotation(i, frame);
 
   display = 1;
   updateBones(0);
   display = 0;
 }
+
+/*
+  Re-solves the frame of the last solve() when only the keyframes of the changed
+  joints were edited since, e.g. while the user drags a part. All other joints
+  keep their last solution, and only the two bone chains below a changed joint
+  get solved again. The iterative solver still works on the whole tree, but
+  starts from its last solution.
+*/
+void IKTree::solve(int frame, const QList<BVHNode*> &changed)
+{
+  QList<int> touched;
+
+  for (int c=0; c<changed.count(); c++)
+  {
+    for (int i=0; i<numBones; i++)
+    {
+      if (nodes[i] != changed.at(c)) continue;
+      resetBone(i, frame, false);
+      updateBones(i);
+      touched.append(i);
+    }
+  }
+  if (touched.isEmpty()) return;
+
+  bool iterative = false;
+  for (int i=0; i<numBones; i++)
+  {
+    if (!isLeaf(i) || !nodes[i]->ikOn) continue;
+
+    if (!isAnalytic(i))
+    {
+      iterative = true;
+      continue;
+    }
+
+    const int end = parent[i];
+    const int middle = parent[end];
+    const int upper = parent[middle];
+    for (int t=0; t<touched.count(); t++)
+    {
+      if (!isAncestor(touched.at(t), i)) continue;
+      solveTwoBone(i);
+      touched << upper << middle << end;
+      break;
+    }
+  }
+
+  if (iterative)
+  {
+    solveIterative();
+    for (int i=0; i<numBones-1; i++)
+      storeIKRotation(i, frame);
+  }
+  else
+  {
+    for (int t=0; t<touched.count(); t++)
+      storeIKRotation(touched.at(t), frame);
+  }
+}
+
+// true if bone i is bone j or one of its parents
+bool IKTree::isAncestor(int i, int j) const
+{
+  return j >= i && j < subtreeEnd[i];
+}
+
+// hands the solved rotation of bone i to its node as offset to the keyframe rotation
+void IKTree::storeIKRotation(int i, int frame)
+{
+  double x, y, z;
+  BVHNode *n = nodes[i];
+  Rotation rot = n->frameData(frame).rotation();
+
+  toEuler(lRot[i], n->channelOrder, x, y, z);
+  if (solved[i])
+    n->ikOn = true;
+
+  for (int j=0; j<n->numChannels; j++)    // rotate each axis in order
+  {
+    switch (n->channelType[j])
+    {
+      case BVH_XROT: n->ikRot.x = x - rot.x; break;
+      case BVH_YROT: n->ikRot.y = y - rot.y; break;
+      case BVH_ZROT: n->ikRot.z = z - rot.z; break;
+      default: break;
+    }
+  }
+
+/*
+  for (int j=0; j<3; j++) {  // rotate each axis in order
+    switch (n->channelType[j]) {
+      case BVH_XROT: n->ikRot[j] = x - n->frame[frame][j]; break;
+      case BVH_YROT: n->ikRot[j] = y - n->frame[frame][j]; break;
+      case BVH_ZROT: n->ikRot[j] = z - n->frame[frame][j]; break;
+      default: break;
+    }
+  } */
+}
@@ -22,58 +22,87 @@
 #ifndef IKTREE_H
 #define IKTREE_H
 
+#include <QVector>
+
 // #include "bvh.h"
 #include "bvhnode.h"
 #include "mt_quaternion.h"
 
-#define MAX_BONES 50
-#define MAX_CHILDREN 4
-#define MAX_EFFECTORS 5
-
-
-
-struct IKEffectorList
+// joint rotations of one solved frame, in channel angles
+struct IKSolution
 {
-  int num;
-  int index[MAX_EFFECTORS];
-};
-
-
-struct IKBone
-{
-  BVHNode *node;
-  double weight;
-  MT_Vector3 offset;
-  MT_Vector3 pos;
-  MT_Quaternion lRot;  // local rotation
-  MT_Quaternion gRot;  // global rotation
-  int numChildren;
-  int child[MAX_CHILDREN];
+  QList<BVHNode*> joints;
+  QList<Rotation> rotations;
 };
 
 
 class IKTree
 {
   public:
+    typedef enum
+    {
+      SOLVER_CCD=0,   // closed form for arms and legs, cyclic coordinate descent elsewhere
+      SOLVER_DLS      // damped least squares on all effectors at once
+    } SolverType;
+
     IKTree(BVHNode *root = NULL);
 
     void set(BVHNode *root);
     void setGoal(int frame, const QString& name);
     void solve(int frame);
+    // faster re-solve of the last solved frame, if only the changed joints got new keyframe values
+    void solve(int frame, const QList<BVHNode*> &changed);
+    // solves without touching the nodes, so each thread can use its own tree
+    void solveFrame(int frame, bool fromPrevious);
+    void getSolution(IKSolution &solution);
     void setJointLimits(bool flag) { jointLimits = flag; }
+    void setSolver(SolverType type) { solver = type; }
+
+    // local rotation of a node from its channel angles, and back
+    static MT_Quaternion toQuaternion(const BVHNode *node, const Rotation &rot);
+    static void toEuler(const MT_Quaternion &q, BVHOrderType order, double &x, double &y, double &z);
 
   protected:
     enum {AXIS_X, AXIS_Y, AXIS_Z};
 
+    // bones in depth first order, so parents come before their children and
+    // the subtree of bone i are the bones i..subtreeEnd[i]-1
     int numBones;
-    IKBone bone[MAX_BONES];
+    QVector<BVHNode*> nodes;
+    QVector<int> parent;             // -1 for the root
+    QVector<int> subtreeEnd;
+    QVector<double> weight;
+    QVector<MT_Vector3> offset;
+    QVector<MT_Vector3> pos;
+    QVector<MT_Quaternion> lRot;     // local rotation
+    QVector<MT_Quaternion> gRot;     // global rotation
+    QVector<bool> solved;            // rotated by the last solve
+
     bool jointLimits;
+    SolverType solver;
+
+    bool isLeaf(int i) const { return subtreeEnd[i] == i+1; }
+    bool hasSingleChild(int i) const { return !isLeaf(i) && subtreeEnd[i+1] == subtreeEnd[i]; }
 
-    void reset(int frame);
-    void addJoint(BVHNode *node);
-    void solveJoint(int frame, int i, IKEffectorList &effList);
-    void toEuler(MT_Quaternion &q, BVHOrderType order, double &x, double &y, double &z);
+    void reset(int frame, bool fromPrevious = false);
+    void resetBone(int i, int frame, bool keepRotation);
+    void storeIKRotation(int i, int frame);
+    int countJoints(BVHNode *node) const;
+    void addJoint(BVHNode *node, int parentIndex, int &next);
+    void solveCCDPass();
+    void solveJoint(int i, const QVector<int> &effList);
     void updateBones(int startIndex);
+    void solveIterative();
+    bool converged() const;
+    bool solveDLS();
+
+    // closed form solver for shoulder-forearm-hand and thigh-shin-foot chains
+    bool isAnalytic(int effIndex) const;
+    bool isTwoBoneChain(int effIndex) const;
+    bool isAncestor(int i, int j) const;
+    void solveTwoBone(int effIndex);
+    void rotateBone(int i, const MT_Quaternion &worldRot);
+    void setJointRotation(int i, MT_Quaternion &targetRot);
 };
 
 #endif
@@ -18,16 +18,32 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include "blendcheck.h"
 #include "qavimator.h"
 #include "settings.h"
 
 #include <QMessageBox>      //DEBUG, TODO: delete
+#include <QTextStream>
 
 int main( int argc, char ** argv )
 {
     QApplication a(argc,argv);
 
     Settings::Instance()->ReadSettings();
+
+    //check of blending without the main window: animik --blend-check [check directory] [--record]
+    //(still a GUI program, the QApplication above needs a display)
+    int check = a.arguments().indexOf("--blend-check");
+    if(check != -1)
+    {
+      QString checkDir = QString(QAVIMATOR_DATAPATH) + "/blendcheck";
+      if(check+1 < a.arguments().size() && !a.arguments().at(check+1).startsWith("--"))
+        checkDir = a.arguments().at(check+1);
+      QTextStream out(stdout);
+      BlendCheck blendCheck(checkDir);
+      return blendCheck.run(a.arguments().contains("--record"), out) == 0 ? 0 : 1;
+    }
+
     qavimator* mw=new qavimator();
 
     //DEBUG, TODO: delete
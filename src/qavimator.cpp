@@ -119,8 +119,13 @@ void qavimator::UpdateMenus()
 
   toolsOptimizeBVHAction->setEnabled(false);
   toolsMirrorAction->setEnabled(false);
+  toolsBakeIKAction->setEnabled(false);
+  toolsFindLoopAction->setEnabled(false);
+  toolsResampleAction->setEnabled(false);
+  toolsSmoothAction->setEnabled(false);
 
   optionsJointLimitsAction->setEnabled(false);
+  optionsJacobianIKAction->setEnabled(false);
   optionsLoopAction->setEnabled(false);
   optionsProtectFirstFrameAction->setEnabled(false);
   optionsShowTimelineAction->setEnabled(false);
@@ -44,6 +44,8 @@ Settings::Settings()
   m_easeIn = m_easeOut = false;
 
   m_debug = false;
+  m_lazyBlending = false;
+  m_timeWarping = false;
 }
 
 Settings::~Settings()
@@ -118,6 +120,8 @@ void Settings::ReadSettings()
     m_easeOut = settings.value("/ease_out").toBool();
 
     m_debug = settings.value("/debug").toBool();
+    m_lazyBlending = settings.value("/lazy_blending", false).toBool();
+    m_timeWarping = settings.value("/time_warping", false).toBool();
 
     // sanity
     if(width<50) width=50;
@@ -182,6 +186,8 @@ void Settings::WriteSettings()
   settings.setValue("/tpose_warning", m_tPoseWarning);
 
   settings.setValue("/debug", m_debug);
+  settings.setValue("/lazy_blending", m_lazyBlending);
+  settings.setValue("/time_warping", m_timeWarping);
 
   settings.endGroup();
 }
@@ -216,3 +222,9 @@ bool Settings::easeOut() const                    { return m_easeOut; }
 /** Debug mode. If on, additional outputs are available and shown to the user */
 bool Settings::Debug() const                      { return m_debug; }
 void Settings::setDebug(bool value)               { m_debug = value; }
+/** Blend only the frames being shown, the rest when exporting */
+bool Settings::lazyBlending() const               { return m_lazyBlending; }
+void Settings::setLazyBlending(bool value)        { m_lazyBlending = value; }
+/** Align overlapping animations in time before they're blended */
+bool Settings::timeWarping() const                { return m_timeWarping; }
+void Settings::setTimeWarping(bool value)         { m_timeWarping = value; }
@@ -66,6 +66,10 @@ public:
 
   bool Debug() const;
   void setDebug(bool value);
+  bool lazyBlending() const;
+  void setLazyBlending(bool value);
+  bool timeWarping() const;
+  void setTimeWarping(bool value);
 
 private:
   Settings();
@@ -88,6 +92,8 @@ private:
   bool m_easeOut;      //      specific?
 
   bool m_debug;
+  bool m_lazyBlending;
+  bool m_timeWarping;
 };
 
 #endif
@@ -32,6 +32,8 @@ SettingsDialog::SettingsDialog(QWidget* parent) : QDialog(parent)
   easeInCheckbox->setChecked(Settings::Instance()->easeIn());
   easeOutCheckbox->setChecked(Settings::Instance()->easeOut());
   tPoseWarningCheckBox->setChecked(Settings::Instance()->tPoseWarning());
+  lazyBlendingCheckBox->setChecked(Settings::Instance()->lazyBlending());
+  timeWarpingCheckBox->setChecked(Settings::Instance()->timeWarping());
   debugCheckBox->setChecked(Settings::Instance()->Debug());
 }
 
@@ -51,6 +53,8 @@ void SettingsDialog::on_applyButton_clicked()
   Settings::setEaseOut(easeOutCheckbox->isChecked());     */
 
   Settings::Instance()->setTPoseWarning(tPoseWarningCheckBox->isChecked());
+  Settings::Instance()->setLazyBlending(lazyBlendingCheckBox->isChecked());
+  Settings::Instance()->setTimeWarping(timeWarpingCheckBox->isChecked());
   Settings::Instance()->setDebug(debugCheckBox->isChecked());
 
   Settings::Instance()->WriteSettings();